@@ -0,0 +1,457 @@
+// Dithering benchmark and regression test, run with `make bench`
+// Runs the scaler, tone curve (with and without auto-levels), packing and every dithering algorithm on a set of
+// test frames and reports the time per pixel, throughput and CPU cycles (if perf_event is available) for each of them
+// The output of every deterministic stage is hashed and compared to bench.golden, so optimizations
+// can't silently change the picture. Golden values are kept per bpp, transport bpp, tone settings and noise seed, which are
+// taken from vsmp.conf and the command line like in vsmp, e.g. `./vsmp-bench --bpp 1 --transport-bpp 2`
+// Test frames are generated unless PGM (P5) or raw 8bpp files are given, raw files as path:WIDTHxHEIGHT
+// Only depends on libc, so it builds on any Linux box
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "vsmp.h"
+#include "config.c"
+#include "memory.c"
+#include "timing.c"
+#include "tone.c"
+#include "pack.c"
+#include "wavefront.c"
+#include "dither.c"
+#include "scale.c"
+
+#define BENCH_GOLDEN "bench.golden"
+#define BENCH_MAX_FRAMES 16
+#define BENCH_MAX_GOLDEN 1024
+
+typedef struct {
+  char name[64];
+  unsigned char *buf;
+  int linesize;
+  int width;
+  int height;
+} BenchFrame;
+
+enum { BENCH_PACKED, BENCH_GREY, BENCH_SCALED };
+
+typedef struct {
+  const char *name;
+  DitherFunction run;
+  int output;        // BENCH_PACKED, an 8bpp frame with linesize width (BENCH_GREY) or one at 3/4 of the size (BENCH_SCALED)
+  int deterministic; // output can be checked against a golden hash
+  int seeded;        // output depends on the noise seed
+} BenchStage;
+
+typedef struct {
+  char key[128];
+  uint64_t hash;
+} BenchGolden;
+
+static BenchGolden golden[BENCH_MAX_GOLDEN];
+static int goldenCount = 0;
+
+// Scaling to 3/4 of the size with either filter, see scale.c
+static void scaleStage(const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *out, int filter) {
+  ScaleGeometry geometry;
+
+  memset(&geometry, 0, sizeof(geometry));
+  geometry.width = geometry.w = width;
+  geometry.height = geometry.h = height;
+  geometry.step = 1;
+  geometry.outWidth = width * 3 / 4;
+  geometry.outHeight = height * 3 / 4;
+  geometry.filterX = geometry.filterY = filter;
+  scalePrepare(&geometry);
+  scaleRun(frameBuf, linesize, out, geometry.outWidth);
+}
+
+static void scaleAreaStage(const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *out) {
+  scaleStage(frameBuf, linesize, width, height, out, SCALE_AREA);
+}
+
+static void scaleBilinearStage(const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *out) {
+  scaleStage(frameBuf, linesize, width, height, out, SCALE_BILINEAR);
+}
+
+// Tone curve as applied while dithering, on its own
+static void contrastStage(const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *out) {
+  initDitherLuts();
+  for (int j = 0; j < height; j++)
+    loadLine(frameBuf, linesize, width, j, out + j * width);
+}
+
+// The same with the black and white value picked from the frame's histogram first
+static void autoLevelsStage(const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *out) {
+  int autoLevels = config.autoLevels;
+
+  config.autoLevels = 1;
+  toneAutoLevels(frameBuf, linesize, width, height);
+  contrastStage(frameBuf, linesize, width, height, out);
+  config.autoLevels = autoLevels;
+  toneBlack = toneWhite = -1;
+}
+
+static void packStage(const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *out) {
+  packFrame(frameBuf, linesize, width, height, out);
+}
+
+// Scaling, tone curve and pack, followed by every dithering algorithm at the configured bpp
+#define BENCH_FIXED_STAGES 5
+static BenchStage stages[BENCH_FIXED_STAGES + DITHER_ALGORITHM_COUNT] = {
+  { "scale-area", scaleAreaStage, BENCH_SCALED, 1 },
+  { "scale-bilinear", scaleBilinearStage, BENCH_SCALED, 1 },
+  { "contrast", contrastStage, BENCH_GREY, 1 },
+  { "auto-levels", autoLevelsStage, BENCH_GREY, 1 },
+  { "pack", packStage, BENCH_PACKED, 1 }
+};
+
+static void setupStages() {
+  for (int a = 0; a < DITHER_ALGORITHM_COUNT; a++) {
+    const DitherAlgorithm *algorithm = &ditherAlgorithms[a];
+    stages[BENCH_FIXED_STAGES + a] = (BenchStage) { algorithm->name, algorithm->perBpp[config.bitsPerPixel - 1], BENCH_PACKED,
+      !algorithm->seeded || config.noiseSeed, algorithm->seeded };
+  }
+}
+
+static uint32_t outputSize(const BenchStage *stage, int width, int height) {
+  if (stage->output == BENCH_SCALED)
+    return (width * 3 / 4) * (height * 3 / 4);
+  return stage->output == BENCH_GREY ? width * height : packedFrameSize(width, height);
+}
+
+// FNV-1a
+static uint64_t hashBuffer(const uint8_t *buf, uint32_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (uint32_t i = 0; i < size; i++) {
+    hash ^= buf[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Counts CPU cycles spent in user space by the calling thread, returns -1 if perf_event isn't available
+static int openCycleCounter() {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t readCycleCounter(int counter) {
+  uint64_t cycles = 0;
+  if (read(counter, &cycles, sizeof(cycles)) != sizeof(cycles))
+    return 0;
+  return cycles;
+}
+
+// Generated test frames: a smooth gradient with some soft shapes, which is the typical case,
+// and uniform random noise, which is the worst case for anything that skips work on flat areas
+// The linesize is padded the way libav does it
+static void generateFrame(BenchFrame *frame, const char *name, int noise) {
+  const int width = 1872, height = 1404;
+  uint32_t state = 12345;
+  int i, j;
+
+  snprintf(frame->name, sizeof(frame->name), "%s", name);
+  frame->width = width;
+  frame->height = height;
+  frame->linesize = 1920;
+  frame->buf = malloc(frame->linesize * height);
+
+  for (j = 0; j < height; j++) {
+    for (i = 0; i < frame->linesize; i++) {
+      int value;
+      if (noise) {
+        state = state * 1664525 + 1013904223;
+        value = state >> 24;
+      }
+      else {
+        int dx = i - width / 3, dy = j - height / 2;
+        value = (i * 160 / width) + (j * 60 / height);
+        if (dx * dx + dy * dy < 300 * 300)
+          value += 35 - (dx * dx + dy * dy) / 2600;
+        if (i > width * 2 / 3 && (j / 64) % 2)
+          value = 255 - value;
+      }
+      frame->buf[j * frame->linesize + i] = value < 0 ? 0 : (value > 255 ? 255 : value);
+    }
+  }
+}
+
+// Skips whitespace and comments in a PGM header
+static void skipPgmSpace(FILE *in) {
+  int c;
+  while ((c = fgetc(in)) != EOF) {
+    if (c == '#') {
+      while ((c = fgetc(in)) != EOF && c != '\n');
+    }
+    else if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+      ungetc(c, in);
+      return;
+    }
+  }
+}
+
+static int loadFrame(BenchFrame *frame, const char *arg) {
+  char path[256];
+  const char *name = strrchr(arg, '/') ? strrchr(arg, '/') + 1 : arg;
+  const char *size = strrchr(arg, ':');
+  int maxval = 255;
+
+  snprintf(path, sizeof(path), "%.*s", size ? (int) (size - arg) : (int) strlen(arg), arg);
+  snprintf(frame->name, sizeof(frame->name), "%.*s", (int) strcspn(name, ":"), name);
+
+  FILE *in = fopen(path, "rb");
+  if (!in) {
+    printf("Failed to open test frame %s\n", path);
+    return 1;
+  }
+
+  if (size) {
+    if (sscanf(size + 1, "%dx%d", &frame->width, &frame->height) != 2) {
+      printf("Expected raw frame as path:WIDTHxHEIGHT, got %s\n", arg);
+      fclose(in);
+      return 1;
+    }
+  }
+  else {
+    char magic[3] = { 0 };
+    if (fread(magic, 1, 2, in) != 2 || strcmp(magic, "P5")) {
+      printf("%s is not a binary PGM file\n", path);
+      fclose(in);
+      return 1;
+    }
+    skipPgmSpace(in);
+    fscanf(in, "%d", &frame->width);
+    skipPgmSpace(in);
+    fscanf(in, "%d", &frame->height);
+    skipPgmSpace(in);
+    fscanf(in, "%d", &maxval);
+    fgetc(in);
+  }
+
+  if (frame->width <= 0 || frame->height <= 0 || maxval != 255) {
+    printf("%s: only 8 bit frames are supported\n", path);
+    fclose(in);
+    return 1;
+  }
+
+  frame->linesize = frame->width;
+  frame->buf = malloc(frame->width * frame->height);
+  if (fread(frame->buf, 1, frame->width * frame->height, in) != frame->width * frame->height) {
+    printf("%s is too short for %dx%d pixels\n", path, frame->width, frame->height);
+    fclose(in);
+    return 1;
+  }
+
+  fclose(in);
+  return 0;
+}
+
+// The other tone settings only become part of the key once they are changed from their defaults
+static void goldenKey(char *key, int size, const BenchFrame *frame, const BenchStage *stage) {
+  char tone[96] = "", seed[24] = "";
+  const char *offset = "";
+
+  if (config.blackValue || config.gamma != 100 || config.sCurve || *config.panelCurve) {
+    const char *curve = strrchr(config.panelCurve, '/') ? strrchr(config.panelCurve, '/') + 1 : config.panelCurve;
+    snprintf(tone, sizeof(tone), "/%d-%d-%d%s%s", config.blackValue, config.gamma, config.sCurve, *curve ? "-" : "", curve);
+  }
+  if (stage->seeded && config.noiseSeed != NOISE_SEED)
+    snprintf(seed, sizeof(seed), "/seed-%d", config.noiseSeed);
+  if (config.blueNoiseOffset && strcmp(stage->name, "blueNoise") == 0)
+    offset = "/offset";
+  snprintf(key, size, "%s:%dx%d %s %d/%d/%d%s%s%s", frame->name, frame->width, frame->height, stage->name,
+    config.bitsPerPixel, config.transportBpp, config.whiteValue, tone, seed, offset);
+}
+
+static BenchGolden *findGolden(const char *key) {
+  for (int g = 0; g < goldenCount; g++) {
+    if (strcmp(golden[g].key, key) == 0)
+      return &golden[g];
+  }
+  return NULL;
+}
+
+static void loadGolden() {
+  char frame[96], stage[64], settings[32];
+  unsigned long long hash;
+
+  FILE *in = fopen(BENCH_GOLDEN, "r");
+  if (!in)
+    return;
+
+  while (goldenCount < BENCH_MAX_GOLDEN && fscanf(in, "%95s %63s %31s %llx", frame, stage, settings, &hash) == 4) {
+    snprintf(golden[goldenCount].key, sizeof(golden[goldenCount].key), "%s %s %s", frame, stage, settings);
+    golden[goldenCount].hash = hash;
+    goldenCount++;
+  }
+  fclose(in);
+}
+
+static int saveGolden() {
+  FILE *out = fopen(BENCH_GOLDEN, "w");
+  if (!out) {
+    printf("Failed to write %s\n", BENCH_GOLDEN);
+    return 1;
+  }
+
+  for (int g = 0; g < goldenCount; g++)
+    fprintf(out, "%s %016llx\n", golden[g].key, (unsigned long long) golden[g].hash);
+  fclose(out);
+  return 0;
+}
+
+static void usage() {
+  printf("Usage: vsmp-bench [vsmp options] [-n runs] [-t threads] [--update-golden] [test frames...]\n");
+  printf("       vsmp options are --config, --bpp, --transport-bpp and the tone settings (--white, --black, ...), see `vsmp` for all of them\n");
+  printf("       test frames are binary PGM files or raw 8bpp files given as path:WIDTHxHEIGHT\n");
+}
+
+int main(int argc, const char *argv[]) {
+  BenchFrame frames[BENCH_MAX_FRAMES];
+  int frameCount = 0, runs = 5, update = 0, failures = 0, missing = 0;
+  int a, f, s, r;
+
+  if ((a = configArgs(argc, argv)) < 0 || toneInit())
+    return -1;
+  noiseSetup();
+
+  for (; a < argc; a++) {
+    if (strcmp(argv[a], "-n") == 0 && a + 1 < argc)
+      runs = atoi(argv[++a]);
+    else if (strcmp(argv[a], "-t") == 0 && a + 1 < argc)
+      ditherThreads = atoi(argv[++a]);
+    else if (strcmp(argv[a], "--update-golden") == 0)
+      update = 1;
+    else if (argv[a][0] == '-' || frameCount == BENCH_MAX_FRAMES) {
+      usage();
+      return -1;
+    }
+    else if (loadFrame(&frames[frameCount++], argv[a]))
+      return 1;
+  }
+
+  if (runs < 1 || ditherThreads < 1) {
+    usage();
+    return -1;
+  }
+
+  if (frameCount == 0) {
+    generateFrame(&frames[frameCount++], "gradient", 0);
+    generateFrame(&frames[frameCount++], "noise", 1);
+  }
+
+  setupStages();
+  loadGolden();
+
+  int counter = openCycleCounter();
+  if (counter < 0)
+    printf("perf_event not available, not counting cycles\n");
+
+  printf("%d bpp, transport %d bpp, white value %d, %d dithering thread(s), ordered dithering uses %s, best of %d runs\n",
+    config.bitsPerPixel, config.transportBpp, config.whiteValue, ditherThreads, ORDERED_SIMD, runs);
+
+  for (f = 0; f < frameCount; f++) {
+    BenchFrame *frame = &frames[f];
+    uint32_t pixels = frame->width * frame->height;
+    uint32_t packedSize = packedFrameSize(frame->width, frame->height);
+    uint8_t *out = calloc(pixels > packedSize ? pixels : packedSize, 1);
+
+    printf("\n%s (%dx%d)\n", frame->name, frame->width, frame->height);
+    printf("%-26s %9s %9s %10s  %s\n", "", "ns/pixel", "MB/s", "cycles/px", "output");
+
+    for (s = 0; s < sizeof(stages) / sizeof(BenchStage); s++) {
+      const BenchStage *stage = &stages[s];
+      double best = 0;
+      uint64_t bestCycles = 0;
+
+      // First run untimed, so that buffers and noise tables are set up
+      stage->run(frame->buf, frame->linesize, frame->width, frame->height, out);
+
+      for (r = 0; r < runs; r++) {
+        struct timespec start;
+
+        if (counter >= 0) {
+          ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+          ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        stage->run(frame->buf, frame->linesize, frame->width, frame->height, out);
+        double ms = msSince(&start);
+        if (counter >= 0)
+          ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+
+        if (r == 0 || ms < best) {
+          best = ms;
+          bestCycles = counter >= 0 ? readCycleCounter(counter) : 0;
+        }
+      }
+
+      char cycles[16] = "-";
+      if (counter >= 0)
+        snprintf(cycles, sizeof(cycles), "%.2f", (double) bestCycles / pixels);
+
+      printf("%-26s %9.2f %9.1f %10s  ", stage->name, best * 1e6 / pixels, pixels / (best * 1e3), cycles);
+
+      if (!stage->deterministic) {
+        printf("random\n");
+        continue;
+      }
+
+      char key[128];
+      uint64_t hash = hashBuffer(out, outputSize(stage, frame->width, frame->height));
+      BenchGolden *expected;
+      goldenKey(key, sizeof(key), frame, stage);
+      expected = findGolden(key);
+
+      if (update) {
+        if (!expected && goldenCount < BENCH_MAX_GOLDEN) {
+          expected = &golden[goldenCount++];
+          snprintf(expected->key, sizeof(expected->key), "%s", key);
+        }
+        if (expected)
+          expected->hash = hash;
+        printf("%016llx\n", (unsigned long long) hash);
+      }
+      else if (!expected) {
+        printf("%016llx (no golden value)\n", (unsigned long long) hash);
+        missing++;
+      }
+      else if (expected->hash != hash) {
+        printf("%016llx MISMATCH, expected %016llx\n", (unsigned long long) hash, (unsigned long long) expected->hash);
+        failures++;
+      }
+      else
+        printf("ok\n");
+    }
+
+    free(out);
+  }
+
+  if (update)
+    return saveGolden();
+
+  printf("\n");
+  if (missing)
+    printf("%d outputs have no golden value yet, run with --update-golden to record them\n", missing);
+  if (failures)
+    printf("%d outputs differ from %s\n", failures, BENCH_GOLDEN);
+  else
+    printf("All checked outputs match %s\n", BENCH_GOLDEN);
+
+  return failures ? 1 : 0;
+}
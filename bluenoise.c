@@ -0,0 +1,176 @@
+// Blue noise mask generator, run by make to write bluenoise.h: `./bluenoise-gen bluenoise.h`
+// Uses Ulichney's void-and-cluster method on a BLUE_NOISE_SIZE x BLUE_NOISE_SIZE torus, so the mask tiles seamlessly
+// Every pixel's energy is the sum of a Gaussian filter (sigma 1.5) over the set pixels around it. Starting from a few
+// random pixels, which are moved until the tightest cluster no longer is the largest void, pixels are ranked by
+// taking the tightest clusters out one by one and then filling the largest voids until the mask is full. The ranks,
+// scaled to 0 - 255, are the thresholds
+// The filter is in integers and ties go to the lowest index, so every machine generates the same mask, which the blueNoise
+// hashes in bench.golden depend on. Two tournament trees keep track of the tightest cluster and the largest void,
+// so finding them takes no search and generating a 256x256 mask takes about two seconds on a PC
+// Only depends on libc
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "vsmp.h"
+
+#define SIZE BLUE_NOISE_SIZE
+#define PIXELS (SIZE * SIZE)
+
+#define KERNEL_RADIUS 6  // the filter is cut off where it has fallen below 1/3000
+#define KERNEL_SCALE 65536
+#define KERNEL_Q 0.8007374029168081 // exp(-1 / (2 * 1.5 * 1.5)), multiplied up instead of calling exp, which may round differently
+#define INITIAL_FRACTION 10 // 1 in this many pixels are set at random to start with
+
+static int kernel[2 * KERNEL_RADIUS + 1][2 * KERNEL_RADIUS + 1];
+
+static uint8_t pattern[PIXELS];
+static uint8_t initial[PIXELS];
+static int32_t energy[PIXELS];
+static uint32_t ranks[PIXELS];
+
+// Leaves at PIXELS + i, every node holds the best pixel below it
+static int32_t voidTree[2 * PIXELS];    // unset pixel with the least energy
+static int32_t clusterTree[2 * PIXELS]; // set pixel with the most energy
+
+static void initKernel() {
+  for (int dy = -KERNEL_RADIUS; dy <= KERNEL_RADIUS; dy++) {
+    for (int dx = -KERNEL_RADIUS; dx <= KERNEL_RADIUS; dx++) {
+      double weight = KERNEL_SCALE;
+      for (int d = 0; d < dx * dx + dy * dy; d++)
+        weight *= KERNEL_Q;
+      kernel[dy + KERNEL_RADIUS][dx + KERNEL_RADIUS] = (int) (weight + 0.5);
+    }
+  }
+}
+
+// On a tie, the left child wins, which always holds the lower indices
+static int betterVoid(int a, int b) {
+  int64_t ea = pattern[a] ? INT64_MAX : energy[a], eb = pattern[b] ? INT64_MAX : energy[b];
+  return eb < ea ? b : a;
+}
+
+static int betterCluster(int a, int b) {
+  int64_t ea = pattern[a] ? energy[a] : -1, eb = pattern[b] ? energy[b] : -1;
+  return eb > ea ? b : a;
+}
+
+static void updateTrees(int i) {
+  for (int node = (PIXELS + i) / 2; node; node /= 2) {
+    voidTree[node] = betterVoid(voidTree[2 * node], voidTree[2 * node + 1]);
+    clusterTree[node] = betterCluster(clusterTree[2 * node], clusterTree[2 * node + 1]);
+  }
+}
+
+static void buildTrees() {
+  for (int i = 0; i < PIXELS; i++)
+    voidTree[PIXELS + i] = clusterTree[PIXELS + i] = i;
+  for (int node = PIXELS - 1; node; node--) {
+    voidTree[node] = betterVoid(voidTree[2 * node], voidTree[2 * node + 1]);
+    clusterTree[node] = betterCluster(clusterTree[2 * node], clusterTree[2 * node + 1]);
+  }
+}
+
+// Sets or clears pixel i, adding or removing its share of the energy around it
+static void setPixel(int i, int value) {
+  int x = i % SIZE, y = i / SIZE, sign = value ? 1 : -1;
+
+  pattern[i] = value;
+  for (int dy = -KERNEL_RADIUS; dy <= KERNEL_RADIUS; dy++) {
+    for (int dx = -KERNEL_RADIUS; dx <= KERNEL_RADIUS; dx++) {
+      int n = ((y + dy) & (SIZE - 1)) * SIZE + ((x + dx) & (SIZE - 1));
+      energy[n] += sign * kernel[dy + KERNEL_RADIUS][dx + KERNEL_RADIUS];
+      updateTrees(n);
+    }
+  }
+}
+
+// lowbias32, like the white noise in dither.c
+static uint32_t hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+static void generate() {
+  int i, rank, ones = PIXELS / INITIAL_FRACTION;
+  uint32_t counter = 1;
+
+  initKernel();
+  buildTrees();
+
+  for (i = 0; i < ones; i++) {
+    int pixel;
+    do
+      pixel = hash(counter++) & (PIXELS - 1);
+    while (pattern[pixel]);
+    setPixel(pixel, 1);
+  }
+
+  // Moves the tightest cluster into the largest void until it would stay where it is
+  // The limit only guards against pixels going round in circles
+  for (i = 0; i < PIXELS; i++) {
+    int cluster = clusterTree[1];
+    setPixel(cluster, 0);
+    int largestVoid = voidTree[1];
+    setPixel(largestVoid, 1);
+    if (largestVoid == cluster)
+      break;
+  }
+
+  for (i = 0; i < PIXELS; i++)
+    initial[i] = pattern[i];
+
+  for (rank = ones - 1; rank >= 0; rank--) {
+    int cluster = clusterTree[1];
+    setPixel(cluster, 0);
+    ranks[cluster] = rank;
+  }
+
+  // The energies are integers, so they are exactly what they were after putting the pixels back
+  for (i = 0; i < PIXELS; i++) {
+    if (initial[i])
+      setPixel(i, 1);
+  }
+
+  // Once more than half of the pixels are set, the tightest cluster of unset pixels is the unset pixel
+  // with the least energy from set pixels, so the largest void is taken all the way
+  for (rank = ones; rank < PIXELS; rank++) {
+    int largestVoid = voidTree[1];
+    setPixel(largestVoid, 1);
+    ranks[largestVoid] = rank;
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    printf("Usage: bluenoise-gen [output file]\n");
+    return 1;
+  }
+
+  printf("Generating a %dx%d blue noise mask\n", SIZE, SIZE);
+  generate();
+
+  FILE *out = fopen(argv[1], "w");
+  if (!out) {
+    printf("ERROR could not open %s\n", argv[1]);
+    return 1;
+  }
+
+  fprintf(out, "// Blue noise mask for the blueNoise dither, generated by bluenoise.c\n");
+  fprintf(out, "#define BLUE_NOISE_MASK_SIZE %d\n\n", SIZE);
+  fprintf(out, "static const uint8_t blueNoiseMask[BLUE_NOISE_MASK_SIZE * BLUE_NOISE_MASK_SIZE] = {\n");
+  for (int i = 0; i < PIXELS; i++)
+    fprintf(out, "%s%u%s", i % 32 ? "" : "  ", (unsigned) ((uint64_t) ranks[i] * 256 / PIXELS),
+      i == PIXELS - 1 ? "\n" : (i % 32 == 31 ? ",\n" : ","));
+  fprintf(out, "};\n");
+
+  if (fclose(out)) {
+    printf("ERROR could not write %s\n", argv[1]);
+    return 1;
+  }
+  return 0;
+}
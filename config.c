@@ -0,0 +1,187 @@
+// Runtime configuration
+// The settings below can be changed without rebuilding vsmp. They are read from vsmp.conf in the working directory,
+// or the file given with --config, and can be overridden on the command line, e.g. `vsmp --bpp 1 --dither atkinson [video file]`
+// The config file has one `key = value` per line, using the same keys as the command line options without the dashes,
+// # starts a comment. Settings missing from both take their defaults from vsmp.h
+// Everything else in vsmp.h is still a compile-time setting
+
+#include <limits.h>
+#include <math.h>
+
+#define CONFIG_FILE "vsmp.conf"
+#define CONFIG_TEXT_SIZE 64
+
+#define STRINGIFY(x) #x
+#define MACRO_NAME(x) STRINGIFY(x)
+
+typedef struct {
+  int bitsPerPixel;
+  int transportBpp;
+  int framesPerHour;
+  int frameStepSize;
+  int whiteValue;
+  int blackValue;
+  int gamma;       // in hundredths
+  int sCurve;      // strength of the S-curve in percent
+  int autoLevels;
+  int hwaccel;
+  int scale;       // SCALE_OFF, SCALE_FIT or SCALE_FILL, see scale.c
+  int scaleWidth;  // size frames are scaled to, 0 for the panel's
+  int scaleHeight;
+  int noiseSeed;   // seed of the whiteNoise dither, 0 for a random one
+  int blueNoiseOffset; // move the blue noise mask for every frame
+  char dither[CONFIG_TEXT_SIZE]; // name of the dithering algorithm, looked up by ditherSetup
+  char panelCurve[CONFIG_TEXT_SIZE]; // file with the panel's response, empty for none, see tone.c
+} Config;
+
+static Config config = {
+  BITS_PER_PIXEL, TRANSPORT_BPP, FRAMES_PER_HOUR, FRAME_STEP_SIZE, WHITE_VALUE, BLACK_VALUE, (int) (GAMMA * 100 + 0.5), S_CURVE,
+  AUTO_LEVELS, HWACCEL, SCALE_MODE, SCALE_WIDTH, SCALE_HEIGHT, NOISE_SEED, BLUE_NOISE_OFFSET, MACRO_NAME(DITHER), PANEL_CURVE
+};
+
+typedef struct {
+  const char *key;
+  int *value; // NULL for the options that are text
+  int min;
+  int max;
+  int hundredths; // set for numbers with up to two decimals, which are stored multiplied by 100
+  char *text;
+} ConfigOption;
+
+static const ConfigOption configOptions[] = {
+  { "bpp", &config.bitsPerPixel, 1, 8 },
+  { "transport-bpp", &config.transportBpp, 2, 8 },
+  { "frames-per-hour", &config.framesPerHour, 1, 3600 },
+  { "frame-step", &config.frameStepSize, 1, INT_MAX },
+  { "white", &config.whiteValue, 1, 255 },
+  { "black", &config.blackValue, 0, 254 },
+  { "gamma", &config.gamma, 20, 500, 1 },
+  { "s-curve", &config.sCurve, 0, 100 },
+  { "auto-levels", &config.autoLevels, 0, 1 },
+  { "panel-curve", .text = config.panelCurve },
+  { "hwaccel", &config.hwaccel, 0, 1 },
+  { "scale", &config.scale, 0, 2 },
+  { "scale-width", &config.scaleWidth, 0, 0xffff },
+  { "scale-height", &config.scaleHeight, 0, 0xffff },
+  { "dither", .text = config.dither },
+  { "noise-seed", &config.noiseSeed, 0, INT_MAX },
+  { "blue-noise-offset", &config.blueNoiseOffset, 0, 1 }
+};
+
+#define CONFIG_OPTION_COUNT (sizeof(configOptions) / sizeof(ConfigOption))
+
+static const ConfigOption *findConfigOption(const char *key) {
+  for (int o = 0; o < CONFIG_OPTION_COUNT; o++) {
+    if (strcmp(configOptions[o].key, key) == 0)
+      return &configOptions[o];
+  }
+  return NULL;
+}
+
+// Sets one option from its text value, returns -1 if the value isn't valid
+static int configSet(const ConfigOption *option, const char *value) {
+  char *end;
+
+  if (option->text) {
+    if (!*value || strlen(value) >= CONFIG_TEXT_SIZE) {
+      printf("Invalid value '%s' for %s\n", value, option->key);
+      return -1;
+    }
+    snprintf(option->text, CONFIG_TEXT_SIZE, "%s", value);
+    return 0;
+  }
+
+  long number = option->hundredths ? lround(strtod(value, &end) * 100) : strtol(value, &end, 10);
+  if (end == value || *end || number < option->min || number > option->max) {
+    if (option->hundredths)
+      printf("Invalid value '%s' for %s, expected a number from %.2f to %.2f\n", value, option->key, option->min / 100.0, option->max / 100.0);
+    else
+      printf("Invalid value '%s' for %s, expected a number from %d to %d\n", value, option->key, option->min, option->max);
+    return -1;
+  }
+  if (option->value == &config.transportBpp && number != 2 && number != 4 && number != 8) {
+    printf("Invalid value '%s' for %s, supported values are 2, 4 and 8\n", value, option->key);
+    return -1;
+  }
+
+  *option->value = number;
+  return 0;
+}
+
+// Reads a config file, a missing file is only an error if it was asked for
+static int configLoad(const char *path, int required) {
+  char line[256];
+  int lineNumber = 0;
+
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    if (required)
+      printf("ERROR could not open config file %s\n", path);
+    return required ? -1 : 0;
+  }
+
+  while (fgets(line, sizeof(line), in)) {
+    char key[64], value[64], rest;
+    const ConfigOption *option;
+    lineNumber++;
+
+    line[strcspn(line, "#\r\n")] = 0;
+    if (sscanf(line, " %63[^= \t] = %63s %c", key, value, &rest) != 2) {
+      if (sscanf(line, " %c", &rest) == 1) {
+        printf("%s:%d: expected key = value\n", path, lineNumber);
+        fclose(in);
+        return -1;
+      }
+      continue;
+    }
+
+    if (!(option = findConfigOption(key))) {
+      printf("%s:%d: unknown setting %s\n", path, lineNumber, key);
+      fclose(in);
+      return -1;
+    }
+    if (configSet(option, value)) {
+      fclose(in);
+      return -1;
+    }
+  }
+
+  fclose(in);
+  printf("Read settings from %s\n", path);
+  return 0;
+}
+
+// Applies the config file and the options at the start of the command line, in that order
+// Returns the index of the first argument that is no option, or -1 on errors
+static int configArgs(int argc, const char *argv[]) {
+  const char *path = NULL;
+  const ConfigOption *option;
+  int a;
+
+  // The file has to be read first, so that options override it wherever --config is given
+  for (a = 1; a + 1 < argc && strncmp(argv[a], "--", 2) == 0; a += 2) {
+    if (strcmp(argv[a], "--config") == 0)
+      path = argv[a + 1];
+    else if (!findConfigOption(argv[a] + 2))
+      break;
+  }
+  if (configLoad(path ? path : CONFIG_FILE, path != NULL))
+    return -1;
+
+  for (a = 1; a + 1 < argc && strncmp(argv[a], "--", 2) == 0; a += 2) {
+    if (strcmp(argv[a], "--config") == 0)
+      continue;
+    if (!(option = findConfigOption(argv[a] + 2)))
+      break;
+    if (configSet(option, argv[a + 1]))
+      return -1;
+  }
+
+  // Packing keeps the top transport-bpp bits of every pixel, which would undo the dithering to more levels than that
+  if (config.bitsPerPixel > config.transportBpp) {
+    printf("ERROR bpp (%d) can't be more than transport-bpp (%d)\n", config.bitsPerPixel, config.transportBpp);
+    return -1;
+  }
+
+  return a;
+}
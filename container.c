@@ -0,0 +1,191 @@
+// Pre-dithered, pre-packed frame container ("vsmp container")
+// `vsmp --transcode [video file] [output file]` runs the complete frame pipeline (decoding, contrast adjustment,
+// dithering and packing) once, ideally using the DRYRUN build on a fast machine, and stores every
+// frame-step-th frame as a fixed-size record of packed pixels
+// Playing such a file skips libav entirely, a refresh is one read from the page cache plus the display transfer
+
+#define CONTAINER_MAGIC "VSMPCTR1"
+#define CONTAINER_ALIGN 4096
+
+typedef struct {
+  char magic[8];
+  uint32_t headerSize; // offset of the first record
+  uint32_t recordSize; // distance between records, each record starts with a packed frame
+  uint32_t frameCount;
+  uint32_t frameStep;  // source frames between two records
+  uint16_t width;
+  uint16_t height;
+  uint8_t bitsPerPixel;
+  uint8_t transportBpp;
+  uint8_t reserved[2];
+  char dither[32];     // name of the dithering algorithm
+} ContainerHeader;
+
+static FILE *containerOut = NULL;
+static uint32_t containerOutRecord = 0; // record the next frame passed to containerWriteFrame goes to
+static MemoryBuffer containerPackBuffer = MEMORY_BUFFER("container record");
+static uint8_t *containerPackBuf = NULL;
+static ContainerHeader containerOutHeader;
+
+const ContainerHeader *containerHeader = NULL;
+
+static uint32_t alignContainer(uint32_t size) {
+  return (size + CONTAINER_ALIGN - 1) & ~(CONTAINER_ALIGN - 1);
+}
+
+static int containerCreate(const char *path) {
+  containerOut = fopen(path, "wb");
+  if (!containerOut) {
+    printf("ERROR could not create container file %s\n", path);
+    return -1;
+  }
+
+  memset(&containerOutHeader, 0, sizeof(containerOutHeader));
+  memcpy(containerOutHeader.magic, CONTAINER_MAGIC, sizeof(containerOutHeader.magic));
+  containerOutHeader.headerSize = alignContainer(sizeof(ContainerHeader));
+  containerOutHeader.frameStep = config.frameStepSize;
+  containerOutHeader.bitsPerPixel = config.bitsPerPixel;
+  containerOutHeader.transportBpp = config.transportBpp;
+  snprintf(containerOutHeader.dither, sizeof(containerOutHeader.dither), "%s", config.dither);
+  return 0;
+}
+
+// Frame sink used instead of the display while transcoding
+// Frames are packed into a record-sized buffer, the frame size is fixed by the first one
+static uint8_t *containerTarget(int width, int height) {
+  if (!containerPackBuf) {
+    containerOutHeader.width = width;
+    containerOutHeader.height = height;
+    containerOutHeader.recordSize = alignContainer(packedFrameSize(width, height));
+    containerPackBuf = memoryFit(&containerPackBuffer, containerOutHeader.recordSize);
+    memset(containerPackBuf, 0, containerOutHeader.recordSize);
+  }
+
+  if (width != containerOutHeader.width || height != containerOutHeader.height) {
+    printf("Frame size changed mid-stream, skipping record %u\n", containerOutRecord);
+    return NULL;
+  }
+
+  return containerPackBuf;
+}
+
+// Records are placed by frame number, so frames that fail to decode leave a blank record
+static void containerWriteFrame(const uint8_t *packedBuf, int width, int height) {
+  uint32_t record = containerOutRecord;
+  fseeko(containerOut, containerOutHeader.headerSize + (off_t) record * containerOutHeader.recordSize, SEEK_SET);
+  fwrite(packedBuf, containerOutHeader.recordSize, 1, containerOut);
+
+  if (record >= containerOutHeader.frameCount)
+    containerOutHeader.frameCount = record + 1;
+}
+
+static int containerFinish() {
+  if (!containerOutHeader.frameCount) {
+    printf("ERROR no frames written\n");
+    fclose(containerOut);
+    return -1;
+  }
+
+  fseeko(containerOut, 0, SEEK_SET);
+  fwrite(&containerOutHeader, sizeof(containerOutHeader), 1, containerOut);
+  fclose(containerOut);
+  memoryRelease(&containerPackBuffer);
+
+  printf("Wrote %u frames of %dx%d at %d bpp (%s)\n", containerOutHeader.frameCount,
+    containerOutHeader.width, containerOutHeader.height, containerOutHeader.bitsPerPixel, containerOutHeader.dither);
+  return 0;
+}
+
+// Checks that the header describes records that fit into the file and frames that fit onto the panel
+// Returns an error message or NULL if the container is usable
+static const char *containerCheck(const ContainerHeader *header, off_t fileSize) {
+  int panelWidth, panelHeight;
+  displaySize(&panelWidth, &panelHeight);
+
+  if (header->headerSize < sizeof(ContainerHeader) || !header->frameCount || !header->frameStep)
+    return "container header is damaged";
+  if (!header->width || !header->height || (panelWidth && (header->width > panelWidth || header->height > panelHeight)))
+    return "container frames don't fit onto the panel";
+  if (header->recordSize < packedFrameSize(header->width, header->height))
+    return "container records are smaller than a frame";
+  if ((uint64_t) fileSize < header->headerSize + (uint64_t) header->frameCount * header->recordSize)
+    return "container file is truncated";
+  return NULL;
+}
+
+// Maps the given file if it is a vsmp container
+// Returns 1 for a usable container, 0 if the file is no container and -1 on errors
+static int containerOpen(const char *path) {
+  char magic[8];
+  struct stat st;
+  const char *error;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  if (read(fd, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, CONTAINER_MAGIC, sizeof(magic)) != 0) {
+    close(fd);
+    return 0;
+  }
+
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(ContainerHeader)) {
+    printf("ERROR container file is truncated\n");
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("ERROR could not map container file\n");
+    return -1;
+  }
+
+  const ContainerHeader *header = map;
+
+  // The transfer format is baked into the records, so it overrides the configured one
+  // It has to be known before the record size can be checked
+  if (header->transportBpp != 2 && header->transportBpp != 4 && header->transportBpp != 8) {
+    printf("ERROR container has unsupported transport bpp %d\n", header->transportBpp);
+    munmap(map, st.st_size);
+    return -1;
+  }
+  if (header->transportBpp != config.transportBpp) {
+    printf("Container was built for transport bpp %d, using that\n", header->transportBpp);
+    config.transportBpp = header->transportBpp;
+  }
+
+  if ((error = containerCheck(header, st.st_size))) {
+    printf("ERROR %s\n", error);
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  containerHeader = header;
+  printf("Playing container of %u frames, %dx%d at %d bpp (%s)\n", header->frameCount,
+    header->width, header->height, header->bitsPerPixel, header->dither);
+  return 1;
+}
+
+// Returns the packed frame of a record, NULL if there is no such record
+static const uint8_t *containerRecord(int frame) {
+  if (frame < 0 || frame >= containerHeader->frameCount)
+    return NULL;
+  return (const uint8_t *) containerHeader + containerHeader->headerSize + (off_t) frame * containerHeader->recordSize;
+}
+
+// Displays one record and asks the kernel to read ahead the next one while we sleep
+static void containerDisplayFrame(int frame) {
+  const uint8_t *record = containerRecord(frame);
+  const uint8_t *next = containerRecord(frame + 1);
+
+  if (!record) {
+    printf("ERROR the container has no record %d\n", frame);
+    return;
+  }
+  pixelPushPacked(record, containerHeader->width, containerHeader->height);
+
+  if (next)
+    madvise((void *) ((uintptr_t) next & ~(uintptr_t) (CONTAINER_ALIGN - 1)), containerHeader->recordSize, MADV_WILLNEED);
+}
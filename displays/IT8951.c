@@ -9,18 +9,163 @@ some features have been added or optimized
 #include "IT8951.h"
 #include "../vsmp.h"
 
+#include <time.h>
+
+#if EVENT_WAIT
+	#include <fcntl.h>
+	#include <poll.h>
+	#include <unistd.h>
+	#include <sys/ioctl.h>
+	#include <linux/gpio.h>
+#endif
+
 //Global varivale
 IT8951DevInfo gstI80DevInfo;
 uint32_t gulImgBufAddr; //IT8951 Image buffer address
 
+#if EVENT_WAIT
+	// Rising edges on HRDY are reported as events on this file descriptor, -1 if they aren't available
+	static int hrdyEvents = -1;
+
+	// Requests edge events for HRDY from the kernel's gpiochip character device
+	// The bcm2835 library keeps driving the pins, this only asks the kernel to watch HRDY
+	static void LCDWaitSetup()
+	{
+		struct gpioevent_request stRequest;
+		int chip;
+
+		#ifdef BCM2835_EMULATOR
+			// HRDY only exists in the emulator (emulator/bcm2835.c), the kernel can't watch it
+			return;
+		#endif
+
+		chip = open(HRDY_GPIOCHIP, O_RDONLY);
+		if (chip < 0) {
+			printf("Can't open %s, busy waiting for HRDY instead\n", HRDY_GPIOCHIP);
+			return;
+		}
+
+		memset(&stRequest, 0, sizeof(stRequest));
+		stRequest.lineoffset = HRDY;
+		stRequest.handleflags = GPIOHANDLE_REQUEST_INPUT;
+		stRequest.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+		strcpy(stRequest.consumer_label, "vsmp HRDY");
+
+		if (ioctl(chip, GPIO_GET_LINEEVENT_IOCTL, &stRequest) < 0)
+			printf("Can't get edge events for HRDY, busy waiting for it instead\n");
+		else
+			hrdyEvents = stRequest.fd;
+		close(chip);
+	}
+#endif
+
 //-----------------------------------------------------------
 //Host controller function 1---Wait for host data Bus Ready
 //-----------------------------------------------------------
-void LCDWaitForReady()
+// HRDY is usually back within microseconds, so it is polled for a bit first. If it takes longer,
+// we sleep until the next rising edge, which the kernel queues even if it happens before poll is called
+// Returns -1 if the controller stays busy for HRDY_TIMEOUT_MS. The controller is then considered hung,
+// and every transaction is dropped until IT8951Reset, see gbLCDTimedOut
+uint8_t gbLCDTimedOut = 0;
+
+int LCDWaitForReady()
 {
 	uint8_t ulData = bcm2835_gpio_lev(HRDY);
-	while(ulData == 0) {
+	struct timespec stStart, stNow;
+	uint32_t i;
+
+	if (gbLCDTimedOut)
+		return -1;
+
+	#if EVENT_WAIT
+		struct gpioevent_data stEvent;
+
+		for (i = 0; i < HRDY_SPINS && ulData == 0; i++)
+			ulData = bcm2835_gpio_lev(HRDY);
+
+		while (ulData == 0 && hrdyEvents >= 0) {
+			struct pollfd stPoll = { hrdyEvents, POLLIN, 0 };
+			int ready = poll(&stPoll, 1, HRDY_TIMEOUT_MS);
+
+			if (ready == 0)
+				break;
+			// Events may be left over from earlier waits, the level decides
+			if (ready > 0)
+				read(hrdyEvents, &stEvent, sizeof(stEvent));
+			ulData = bcm2835_gpio_lev(HRDY);
+		}
+	#endif
+
+	// Busy waiting, the clock is only looked at every few thousand reads
+	clock_gettime(CLOCK_MONOTONIC, &stStart);
+	for (i = 1; ulData == 0; i++) {
 		ulData = bcm2835_gpio_lev(HRDY);
+		if (ulData == 0 && (i & 0xfff) == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &stNow);
+			if ((stNow.tv_sec - stStart.tv_sec) * 1000 + (stNow.tv_nsec - stStart.tv_nsec) / 1000000 >= HRDY_TIMEOUT_MS)
+				break;
+		}
+	}
+
+	if (ulData == 0) {
+		printf("Timed out waiting for HRDY\n");
+		gbLCDTimedOut = 1;
+		return -1;
+	}
+	return 0;
+}
+
+// Transactions
+// Every transaction starts with a preamble telling the controller what follows (command, data or a read),
+// after which as many words as needed can be sent or received while CS stays low
+// The original waveshare code sends every command argument as a transaction of its own and transfers
+// single bytes; here arguments are sent as one data transaction and words are moved with one bulk transfer each
+#define LCD_PREAMBLE_CMD   0x6000
+#define LCD_PREAMBLE_WRITE 0x0000
+#define LCD_PREAMBLE_READ  0x1000
+
+// Number of transactions since the last reset, to keep track of command overhead
+uint32_t gulLCDTransactions = 0;
+
+// Returns -1 without starting the transaction, or with CS already high again, if the controller doesn't get ready
+static int LCDBeginTransaction(uint16_t wPreamble)
+{
+	uint8_t pPreamble[2] = { wPreamble >> 8, wPreamble & 0xff };
+
+	if (LCDWaitForReady())
+		return -1;
+
+	bcm2835_gpio_write(CS,LOW);
+	bcm2835_spi_writenb((const char*)pPreamble, 2);
+	gulLCDTransactions++;
+
+	if (LCDWaitForReady()) {
+		bcm2835_gpio_write(CS,HIGH);
+		return -1;
+	}
+	return 0;
+}
+
+static void LCDEndTransaction()
+{
+	bcm2835_gpio_write(CS,HIGH);
+}
+
+// Sends words in big endian byte order, in batches to keep the stack buffer small
+static void LCDWriteWords(const uint16_t* pwBuf, uint32_t ulSizeWordCnt)
+{
+	uint8_t pBytes[256];
+	uint32_t i, ulBatch;
+
+	while (ulSizeWordCnt) {
+		ulBatch = ulSizeWordCnt < sizeof(pBytes) / 2 ? ulSizeWordCnt : sizeof(pBytes) / 2;
+		for (i = 0; i < ulBatch; i++) {
+			pBytes[2 * i] = pwBuf[i] >> 8;
+			pBytes[2 * i + 1] = pwBuf[i] & 0xff;
+		}
+		bcm2835_spi_writenb((const char*)pBytes, 2 * ulBatch);
+		pwBuf += ulBatch;
+		ulSizeWordCnt -= ulBatch;
 	}
 }
 
@@ -29,22 +174,10 @@ void LCDWaitForReady()
 //-----------------------------------------------------------
 void LCDWriteCmdCode(uint16_t usCmdCode)
 {
-	//Set Preamble for Write Command
-	uint16_t wPreamble = 0x6000; 
-	
-	LCDWaitForReady();	
-
-	bcm2835_gpio_write(CS,LOW);
-	
-	bcm2835_spi_transfer(wPreamble>>8);
-	bcm2835_spi_transfer(wPreamble);
-	
-	LCDWaitForReady();	
-	
-	bcm2835_spi_transfer(usCmdCode>>8);
-	bcm2835_spi_transfer(usCmdCode);
-	
-	bcm2835_gpio_write(CS,HIGH); 
+	if (LCDBeginTransaction(LCD_PREAMBLE_CMD))
+		return;
+	LCDWriteWords(&usCmdCode, 1);
+	LCDEndTransaction();
 }
 
 //-----------------------------------------------------------
@@ -52,43 +185,27 @@ void LCDWriteCmdCode(uint16_t usCmdCode)
 //-----------------------------------------------------------
 void LCDWriteData(uint16_t usData)
 {
-	//Set Preamble for Write Data
-	uint16_t wPreamble	= 0x0000;
-
-	LCDWaitForReady();
-
-	bcm2835_gpio_write(CS,LOW);
+	LCDWriteNWords(&usData, 1);
+}
 
-	bcm2835_spi_transfer(wPreamble>>8);
-	bcm2835_spi_transfer(wPreamble);
-	
-	LCDWaitForReady();
-			
-	bcm2835_spi_transfer(usData>>8);
-	bcm2835_spi_transfer(usData);
-	
-	bcm2835_gpio_write(CS,HIGH); 
+// Writes any number of words in a single data transaction
+void LCDWriteNWords(const uint16_t* pwBuf, uint32_t ulSizeWordCnt)
+{
+	if (LCDBeginTransaction(LCD_PREAMBLE_WRITE))
+		return;
+	LCDWriteWords(pwBuf, ulSizeWordCnt);
+	LCDEndTransaction();
 }
 
 // This is the preformance-improved modified write method by Naluhh
 // From here: https://github.com/waveshare/IT8951/pull/3/commits/6dc34e3469ed3a72046ca2b69d162133aa0acc30
-void LCDWriteNData(uint8_t *data, uint32_t len)
+// Uses a write-only transfer, so data is left untouched and may point to read-only memory
+void LCDWriteNData(const uint8_t *data, uint32_t len)
 {
-	//Set Preamble for Write Data
-	uint16_t wPreamble	= 0x0000;
-
-	LCDWaitForReady();
-
-	bcm2835_gpio_write(CS,LOW);
-
-	bcm2835_spi_transfer(wPreamble>>8);
-	bcm2835_spi_transfer(wPreamble);
-
-	LCDWaitForReady();
-
-	bcm2835_spi_transfern(data, len);
-
-	bcm2835_gpio_write(CS,HIGH); 
+	if (LCDBeginTransaction(LCD_PREAMBLE_WRITE))
+		return;
+	bcm2835_spi_writenb((const char*)data, len);
+	LCDEndTransaction();
 }
 
 //-----------------------------------------------------------
@@ -96,75 +213,50 @@ void LCDWriteNData(uint8_t *data, uint32_t len)
 //-----------------------------------------------------------
 uint16_t LCDReadData()
 {
-	uint16_t wRData; 
-	
-	uint16_t wPreamble = 0x1000;
-
-	LCDWaitForReady();
-
-	bcm2835_gpio_write(CS,LOW);
-		
-	bcm2835_spi_transfer(wPreamble>>8);
-	bcm2835_spi_transfer(wPreamble);
-
-	LCDWaitForReady();
-	
-	wRData=bcm2835_spi_transfer(0x00);//dummy
-	wRData=bcm2835_spi_transfer(0x00);//dummy
-	
-	LCDWaitForReady();
-	
-	wRData = bcm2835_spi_transfer(0x00)<<8;
-	wRData |= bcm2835_spi_transfer(0x00);
-		
-	bcm2835_gpio_write(CS,HIGH); 
-		
+	uint16_t wRData;
+	LCDReadNData(&wRData, 1);
 	return wRData;
 }
 
 //-----------------------------------------------------------
 //  Read Burst N words Data
 //-----------------------------------------------------------
+// All words are clocked in with a single transfer into pwBuf and converted from big endian in place
+// If the controller times out, pwBuf is all zeros, which ends the register polling loops
 void LCDReadNData(uint16_t* pwBuf, uint32_t ulSizeWordCnt)
 {
+	uint8_t pDummy[2] = { 0, 0 };
+	uint8_t* pBytes = (uint8_t*)pwBuf;
 	uint32_t i;
-	
-	uint16_t wPreamble = 0x1000;
 
-	LCDWaitForReady();
-	
-	bcm2835_gpio_write(CS,LOW);
+	memset(pwBuf, 0, ulSizeWordCnt * 2);
+	if (LCDBeginTransaction(LCD_PREAMBLE_READ))
+		return;
 
-	bcm2835_spi_transfer(wPreamble>>8);
-	bcm2835_spi_transfer(wPreamble);
-	
-	LCDWaitForReady();
-	
-	pwBuf[0]=bcm2835_spi_transfer(0x00);//dummy
-	pwBuf[0]=bcm2835_spi_transfer(0x00);//dummy
-	
-	LCDWaitForReady();
-	
-	for(i=0;i<ulSizeWordCnt;i++) {
-		pwBuf[i] = bcm2835_spi_transfer(0x00)<<8;
-		pwBuf[i] |= bcm2835_spi_transfer(0x00);
+	bcm2835_spi_transfern((char*)pDummy, 2);
+
+	if (LCDWaitForReady()) {
+		LCDEndTransaction();
+		return;
 	}
-	
-	bcm2835_gpio_write(CS,HIGH); 
+
+	bcm2835_spi_transfern((char*)pBytes, ulSizeWordCnt * 2);
+	for (i = 0; i < ulSizeWordCnt; i++)
+		pwBuf[i] = (pBytes[2 * i] << 8) | pBytes[2 * i + 1];
+
+	LCDEndTransaction();
 }
 
 //-----------------------------------------------------------
 //Host controller function 5---Write command to host data Bus with aruments
 //-----------------------------------------------------------
+// The arguments follow the command as a single data transaction
 void LCDSendCmdArg(uint16_t usCmdCode,uint16_t* pArg, uint16_t usNumArg)
 {
-    uint16_t i;
     //Send Cmd code
     LCDWriteCmdCode(usCmdCode);
     //Send Data
-    for(i=0;i<usNumArg;i++) {
-        LCDWriteData(pArg[i]);
-    }
+    LCDWriteNWords(pArg, usNumArg);
 }
 
 //-----------------------------------------------------------
@@ -214,10 +306,9 @@ uint16_t IT8951ReadReg(uint16_t usRegAddr)
 //-----------------------------------------------------------
 void IT8951WriteReg(uint16_t usRegAddr,uint16_t usValue)
 {
+	uint16_t usArg[2] = { usRegAddr, usValue };
 	//Send Cmd , Register Address and Write Value
-	LCDWriteCmdCode(IT8951_TCON_REG_WR);
-	LCDWriteData(usRegAddr);
-	LCDWriteData(usValue);
+	LCDSendCmdArg(IT8951_TCON_REG_WR, usArg, 2);
 }
 
 //-----------------------------------------------------------
@@ -279,10 +370,8 @@ uint16_t IT8951GetVCOM(void)
 
 void IT8951SetVCOM(uint16_t vcom)
 {
-	LCDWriteCmdCode(USDEF_I80_CMD_VCOM);
-	LCDWriteData(1);
-	//Read data from Host Data bus
-	LCDWriteData(vcom);
+	uint16_t usArg[2] = { 1, vcom };
+	LCDSendCmdArg(USDEF_I80_CMD_VCOM, usArg, 2);
 }
 
 //-----------------------------------------------------------
@@ -306,15 +395,11 @@ void IT8951SetVCOM(uint16_t vcom)
 void IT8951MemBurstWriteProc(uint32_t ulMemAddr , uint32_t ulWriteSize, uint16_t* pSrcBuf )
 {
     
-    uint32_t i;
- 
     //Send Burst Write Start Cmd and Args
     IT8951MemBurstWrite(ulMemAddr , ulWriteSize);
  
     //Burst Write Data
-    for(i=0;i<ulWriteSize;i++) {
-        LCDWriteData(pSrcBuf[i]);
-    }
+    LCDWriteNWords(pSrcBuf, ulWriteSize);
  
     //Send Burst End Cmd
     IT8951MemBurstEnd();
@@ -360,10 +445,8 @@ void IT8951LoadImgStart(IT8951LdImgInfo* pstLdImgInfo)
     usArg = (pstLdImgInfo->usEndianType << 8 )
     |(pstLdImgInfo->usPixelFormat << 4)
     |(pstLdImgInfo->usRotate);
-    //Send Cmd
-    LCDWriteCmdCode(IT8951_TCON_LD_IMG);
-    //Send Arg
-    LCDWriteData(usArg);
+    //Send Cmd and Arg
+    LCDSendCmdArg(IT8951_TCON_LD_IMG, &usArg, 1);
 }
 
 //-----------------------------------------------------------
@@ -438,10 +521,22 @@ void IT8951SetImgBufBaseAddr(uint32_t ulImgBufAddr)
 //Display function 1---Wait for LUT Engine Finish
 //                     Polling Display Engine Ready by LUTNo
 //-----------------------------------------------------------
+// Refreshes take hundreds of milliseconds, so with EVENT_WAIT the register is polled with
+// increasing pauses of up to DISPLAY_READY_MAX_POLL_MS, leaving the CPU to other work meanwhile
 void IT8951WaitForDisplayReady()
 {
 	//Check IT8951 Register LUTAFSR => NonZero Busy, 0 - Free
-	while(IT8951ReadReg(LUTAFSR));
+	#if EVENT_WAIT
+		long lPauseMs = 1;
+
+		while(IT8951ReadReg(LUTAFSR)) {
+			struct timespec stPause = { lPauseMs / 1000, (lPauseMs % 1000) * 1000000 };
+			nanosleep(&stPause, NULL);
+			lPauseMs = lPauseMs * 2 < DISPLAY_READY_MAX_POLL_MS ? lPauseMs * 2 : DISPLAY_READY_MAX_POLL_MS;
+		}
+	#else
+		while(IT8951ReadReg(LUTAFSR));
+	#endif
 }
 
 //-----------------------------------------------------------
@@ -449,8 +544,26 @@ void IT8951WaitForDisplayReady()
 //-----------------------------------------------------------
 // Copies data to the IT8951 internal buffer but does not refresh the display
 // This function is modified following Naluhh's version from https://github.com/waveshare/IT8951/pull/3/commits/6dc34e3469ed3a72046ca2b69d162133aa0acc30
-// It expects an 8bpp frame buffer (as produced by ffmpeg), which is converted to 4bpp and sent in a 4bpp packed format
-void IT8951HostAreaPackedPixelWrite(IT8951LdImgInfo* pstLdImgInfo, IT8951AreaImgInfo* pstAreaImgInfo)
+// It expects a frame buffer that is already packed to the transport bpp (see packRow)
+// The buffer is only read, so it may be e.g. a read-only memory mapping
+// The area is sent in one transfer, see IT8951HostAreaPackedWriteStart for sending it in pieces while it is being packed
+void IT8951HostAreaPackedWrite(IT8951LdImgInfo* pstLdImgInfo, IT8951AreaImgInfo* pstAreaImgInfo)
+{
+	const uint8_t* pusFrameBuf = (const uint8_t*)pstLdImgInfo->ulStartFBAddr;
+
+	IT8951HostAreaPackedWriteStart(pstLdImgInfo, pstAreaImgInfo);
+
+	// Copy buffer to IT8951
+	LCDWriteNData(pusFrameBuf, packedFrameSize(pstAreaImgInfo->usWidth, pstAreaImgInfo->usHeight));
+
+	//Send Load Img End Command
+	IT8951LoadImgEnd();
+}
+
+// Starts loading a packed image area
+// The data may then be sent in any number of LCDWriteNData calls of an even number of bytes,
+// followed by IT8951LoadImgEnd
+void IT8951HostAreaPackedWriteStart(IT8951LdImgInfo* pstLdImgInfo, IT8951AreaImgInfo* pstAreaImgInfo)
 {
 	// Pixel format explainer:
 	// Assume we want to transmit 8 consecutive pixels in 2 bpp mode
@@ -466,43 +579,12 @@ void IT8951HostAreaPackedPixelWrite(IT8951LdImgInfo* pstLdImgInfo, IT8951AreaImg
 	// pixel order
 	// Anyway, the given code appears to work...
 	pstLdImgInfo->usEndianType = IT8951_LDIMG_B_ENDIAN;
-	pstLdImgInfo->usPixelFormat = TRANSPORT_BPP_FLAG; 
-
-	uint8_t* pusFrameBuf = (uint8_t*)pstLdImgInfo->ulStartFBAddr;
-	uint8_t bpp = TRANSPORT_BPP;
-	uint8_t bpp_shift = 8 - bpp;
-	uint8_t ppb = 8 / bpp;
-
-	// Convert 8bpp buffer to x bpp buffer
-	uint32_t i = 0, j = 0, ldiff;
-	uint8_t b = 0;
-	uint8_t tmp;
-	ldiff = pstAreaImgInfo->usLinesize - pstAreaImgInfo->usWidth;
-	while (i < pstAreaImgInfo->usHeight * pstAreaImgInfo->usLinesize) {
-		tmp = 0;
-		for (b = 0; b < ppb; ++b){
-			// Intra-byte order should be [12345678], not [87654321]
-			tmp |= (pusFrameBuf[i] >> bpp_shift) << ((ppb - b - 1) * bpp);
-			i += 1;
-			// Skip dead space in ffmpeg frame
-			if(i % pstAreaImgInfo->usLinesize == pstAreaImgInfo->usWidth)
-				i += ldiff;
-		}
-
-		pusFrameBuf[j] = tmp;
-		j += 1;
-	}
+	pstLdImgInfo->usPixelFormat = config.transportBpp == 2 ? IT8951_2BPP : config.transportBpp == 4 ? IT8951_4BPP : IT8951_8BPP;
 
 	//Set Image buffer(IT8951) Base address
 	IT8951SetImgBufBaseAddr(pstLdImgInfo->ulImgBufBaseAddr);
 	//Send Load Image start Cmd
 	IT8951LoadImgAreaStart(pstLdImgInfo, pstAreaImgInfo);
-	
-	// Copy buffer to IT8951
-	LCDWriteNData(pusFrameBuf, pstAreaImgInfo->usHeight * pstAreaImgInfo->usWidth / ppb);
-
-	//Send Load Img End Command
-	IT8951LoadImgEnd();
 }
 
 void IT8951Clear() {
@@ -517,14 +599,9 @@ void IT8951Clear() {
 // Set a given area to what is in the IT8951 buffer
 void IT8951DisplayArea(uint16_t usX, uint16_t usY, uint16_t usW, uint16_t usH, uint16_t usDpyMode)
 {
-	//Send I80 Display Command (User defined command of IT8951)
-	LCDWriteCmdCode(USDEF_I80_CMD_DPY_AREA); //0x0034
-	//Write arguments
-	LCDWriteData(usX);
-	LCDWriteData(usY);
-	LCDWriteData(usW);
-	LCDWriteData(usH);
-	LCDWriteData(usDpyMode);
+	uint16_t usArg[5] = { usX, usY, usW, usH, usDpyMode };
+	//Send I80 Display Command (User defined command of IT8951) and arguments
+	LCDSendCmdArg(USDEF_I80_CMD_DPY_AREA, usArg, 5); //0x0034
 }
 
 //-------------------------------------------------------------------------------------------------------------
@@ -537,17 +614,13 @@ void IT8951DisplayArea(uint16_t usX, uint16_t usY, uint16_t usW, uint16_t usH, u
 //-------------------------------------------------------------------------------------------------------------
 void IT8951DisplayAreaBuf(uint16_t usX, uint16_t usY, uint16_t usW, uint16_t usH, uint16_t usDpyMode, uint32_t ulDpyBufAddr)
 {
-    //Send I80 Display Command (User defined command of IT8951)
-    LCDWriteCmdCode(USDEF_I80_CMD_DPY_BUF_AREA); //0x0037
-    
-    //Write arguments
-    LCDWriteData(usX);
-    LCDWriteData(usY);
-    LCDWriteData(usW);
-    LCDWriteData(usH);
-    LCDWriteData(usDpyMode);
-    LCDWriteData((uint16_t)ulDpyBufAddr);       //Display Buffer Base address[15:0]
-    LCDWriteData((uint16_t)(ulDpyBufAddr>>16)); //Display Buffer Base address[26:16]
+    uint16_t usArg[7] = {
+        usX, usY, usW, usH, usDpyMode,
+        (uint16_t)ulDpyBufAddr,       //Display Buffer Base address[15:0]
+        (uint16_t)(ulDpyBufAddr>>16)  //Display Buffer Base address[26:16]
+    };
+    //Send I80 Display Command (User defined command of IT8951) and arguments
+    LCDSendCmdArg(USDEF_I80_CMD_DPY_BUF_AREA, usArg, 7); //0x0037
 }
 
 //-----------------------------------------------------------
@@ -563,7 +636,7 @@ uint8_t IT8951_Init()
 	bcm2835_spi_begin();
 	bcm2835_spi_setBitOrder(BCM2835_SPI_BIT_ORDER_MSBFIRST);   		//default
 	bcm2835_spi_setDataMode(BCM2835_SPI_MODE0);               		//default
-	bcm2835_spi_setClockDivider(BCM2835_SPI_CLOCK_DIVIDER_32);		//default
+	bcm2835_spi_setClockDivider((uint16_t) SPI_CLOCK_DIVIDER);	// 65536 is passed as 0
 	
 	bcm2835_gpio_fsel(CS, BCM2835_GPIO_FSEL_OUTP);  
 	bcm2835_gpio_fsel(HRDY, BCM2835_GPIO_FSEL_INPT);
@@ -571,14 +644,36 @@ uint8_t IT8951_Init()
 	
 	bcm2835_gpio_write(CS, HIGH);
 
+	#if EVENT_WAIT
+		LCDWaitSetup();
+	#endif
+
 	//printf("****** IT8951 ******\n");
-	
+
+	if (IT8951Reset()) {
+		printf("The IT8951 doesn't respond\n");
+		return 1;
+	}
+	return 0;
+}
+
+// Resets the controller through its reset pin and sets it up again, also after it timed out (see LCDWaitForReady)
+// Returns non-zero if it still doesn't respond
+int IT8951Reset()
+{
+	IT8951DevInfo stDevInfo;
+
+	gbLCDTimedOut = 0;
+
 	bcm2835_gpio_write(RESET, LOW);
 	bcm2835_delay(100);
 	bcm2835_gpio_write(RESET, HIGH);
 
-	//Get Device Info
-	GetIT8951SystemInfo(&gstI80DevInfo);
+	//Get Device Info, the last one is kept if the controller doesn't answer
+	GetIT8951SystemInfo(&stDevInfo);
+	if (gbLCDTimedOut)
+		return 1;
+	gstI80DevInfo = stDevInfo;
 	
  	gulImgBufAddr = gstI80DevInfo.usImgBufAddrL | (gstI80DevInfo.usImgBufAddrH << 16);
  	
@@ -590,10 +685,15 @@ uint8_t IT8951_Init()
 		//printf("VCOM = -%.02fV\n",(float)IT8951GetVCOM()/1000);
 	}
 	
-	return 0;
+	return gbLCDTimedOut;
 }
 
 void IT8951_Cancel() {
+	#if EVENT_WAIT
+		if (hrdyEvents >= 0)
+			close(hrdyEvents);
+		hrdyEvents = -1;
+	#endif
 	bcm2835_spi_end();
 	bcm2835_close();
 }
\ No newline at end of file
@@ -19,7 +19,7 @@ typedef struct IT8951LdImgInfo
     uint16_t usEndianType; //little or Big Endian
     uint16_t usPixelFormat; //bpp
     uint16_t usRotate; //Rotate mode
-    uint32_t ulStartFBAddr; //Start address of source Frame buffer
+    uintptr_t ulStartFBAddr; //Start address of source Frame buffer
     uint32_t ulImgBufBaseAddr;//Base address of target image buffer
     
 }IT8951LdImgInfo;
@@ -86,6 +86,11 @@ typedef struct
 #define IT8951_MODE_2   2
 #define IT8951_MODE_3   3
 #define IT8951_MODE_4   4
+//Waveforms found on most LUTs, the A2 mode number depends on the LUT
+#define IT8951_MODE_INIT 0
+#define IT8951_MODE_DU   1
+#define IT8951_MODE_GC16 2
+#define IT8951_MODE_GL16 3
 //Endian Type
 #define IT8951_LDIMG_L_ENDIAN   0
 #define IT8951_LDIMG_B_ENDIAN   1
@@ -126,25 +131,36 @@ typedef struct
 #define MCSR (MCSR_BASE_ADDR  + 0x0000)
 #define LISAR (MCSR_BASE_ADDR + 0x0008)
 
-uint32_t gulImgBufAddr; //IT8951 Image buffer address
-IT8951DevInfo gstI80DevInfo;
+//Memory addresses have 26 bits
+#define IT8951_MEM_ADDR_LIMIT 0x04000000
+
+extern uint32_t gulImgBufAddr; //IT8951 Image buffer address
+extern IT8951DevInfo gstI80DevInfo;
 
 uint8_t IT8951_Init(void);
+int IT8951Reset(void);
 void IT8951_Cancel(void);
 void IT8951Sleep(void);
 void IT8951SystemRun(void);
 
+extern uint32_t gulLCDTransactions;
+void LCDWriteNWords(const uint16_t* pwBuf, uint32_t ulSizeWordCnt);
+void LCDReadNData(uint16_t* pwBuf, uint32_t ulSizeWordCnt);
+
 uint16_t IT8951ReadReg(uint16_t usRegAddr);
 void IT8951SetImgBufBaseAddr(uint32_t ulImgBufAddr);
-void LCDWaitForReady(void);
+int LCDWaitForReady(void);
+extern uint8_t gbLCDTimedOut;
 void IT8951WaitForDisplayReady();
 void GetIT8951SystemInfo(void* pBuf);
 void gpio_i80_16b_cmd_out(uint16_t usCmd);
 void GPIO_Configuration_Out(void);
 void GPIO_Configuration_In(void);
-void IT8951HostAreaPackedPixelWrite(IT8951LdImgInfo* pstLdImgInfo, IT8951AreaImgInfo* pstAreaImgInfo);
+void IT8951HostAreaPackedWrite(IT8951LdImgInfo* pstLdImgInfo, IT8951AreaImgInfo* pstAreaImgInfo);
+void IT8951HostAreaPackedWriteStart(IT8951LdImgInfo* pstLdImgInfo, IT8951AreaImgInfo* pstAreaImgInfo);
 void IT8951HostAreaClear(IT8951LdImgInfo* pstLdImgInfo, IT8951AreaImgInfo* pstAreaImgInfo);
 void IT8951DisplayArea(uint16_t usX, uint16_t usY, uint16_t usW, uint16_t usH, uint16_t usDpyMode);
+void IT8951DisplayAreaBuf(uint16_t usX, uint16_t usY, uint16_t usW, uint16_t usH, uint16_t usDpyMode, uint32_t ulDpyBufAddr);
 
 void IT8951Clear(void);
 
@@ -1,25 +1,42 @@
+#include <fcntl.h>
+
 static int initDisplay() { return 0; }
 static void teardownDisplay() {}
 static void clearDisplay() {}
 
-static void pixelPush(unsigned char *frameBuf, int linesize, int width, int height) {
+// There is no panel, frames are only scaled to scale-width x scale-height
+static void displaySize(int *width, int *height) {
+	*width = *height = 0;
+}
+
+// Written without stdio streams, which would allocate for every frame
+static void writePgm(const unsigned char *frameBuf, int linesize, int width, int height) {
 	static uint index = 0;
-	FILE *f;
-	int i;
-	char frame_filename[1024];
+	int f, i;
+	char frame_filename[1024], header[32];
 
 	snprintf(frame_filename, sizeof(frame_filename), "%s-%d.pgm", "frame", index);
 	index++;
-	f = fopen(frame_filename,"w");
+	f = open(frame_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f < 0)
+		return;
 
 	// writing the minimal required header for a pgm file format
 	// portable graymap format -> https://en.wikipedia.org/wiki/Netpbm_format#PGM_example
-	fprintf(f, "P5\n%d %d\n%d\n", width, height, 255);
+	write(f, header, snprintf(header, sizeof(header), "P5\n%d %d\n%d\n", width, height, 255));
 
 	// writing line by line
 	for (i = 0; i < height; i++)
-	    fwrite(frameBuf + i * linesize, 1, width, f);
-	fclose(f);
+	    write(f, frameBuf + i * linesize, width);
+	close(f);
 
 	printf("Wrote frame pgm file\n");
 }
+
+static void pixelPushPacked(const uint8_t *packedBuf, int width, int height) {
+	static MemoryBuffer frameBuffer = MEMORY_BUFFER("unpacked frame");
+	unsigned char *frameBuf = memoryFit(&frameBuffer, width * height);
+
+	unpackFrame(packedBuf, width, height, frameBuf);
+	writePgm(frameBuf, width, width, height);
+}
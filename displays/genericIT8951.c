@@ -1,8 +1,23 @@
+#include <pthread.h>
+#include <time.h>
 #include "IT8951.h"
 #include "IT8951.c"
 
+// This driver can start sending a frame before it has been dithered completely, see pixelStreamBegin
+#define DISPLAY_STREAMING
+#define DISPLAY_SPI_SELFTEST
+
+static void preloadSetup();
+static void waveformSetup();
+static int streamSetup();
+static int checkDisplay();
+
 static int initDisplay() {
-	return IT8951_Init();
+	if (IT8951_Init())
+		return 1;
+	waveformSetup();
+	preloadSetup();
+	return streamSetup();
 }
 
 static void teardownDisplay() {
@@ -10,43 +25,680 @@ static void teardownDisplay() {
 }
 
 static void wakeDisplay() {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	IT8951SystemRun();
 	IT8951WaitForDisplayReady();
+	timeStage(STAGE_WAKE, &start);
 }
 
-static void standbyDisplay() {
+// Returns non-zero if the controller stopped responding during the refresh, see checkDisplay
+static int standbyDisplay() {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	IT8951WaitForDisplayReady();
+	timeStage(STAGE_READY, &start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	IT8951Sleep();
+	timeStage(STAGE_SLEEP, &start);
+
+	// Every refresh ends here
+	refreshTiming.transactions = gulLCDTransactions;
+	gulLCDTransactions = 0;
+	return checkDisplay();
 }
 
+static void displaySize(int *width, int *height) {
+	*width = gstI80DevInfo.usPanelW;
+	*height = gstI80DevInfo.usPanelH;
+}
+
+static void forgetPreviousFrame();
+static void forgetWaveforms();
+static void forgetPreloads();
+
 static void clearDisplay() {
 	IT8951Clear();
+	forgetPreviousFrame();
+	forgetWaveforms();
 }
 
-static void pixelPush(unsigned char *frameBuf, int linesize, int width, int height) {
-	IT8951LdImgInfo stLdImgInfo;
-	IT8951AreaImgInfo stAreaImgInfo;
-
+static void setupArea(IT8951LdImgInfo *stLdImgInfo, IT8951AreaImgInfo *stAreaImgInfo, const uint8_t *frameBuf, int linesize, int width, int height) {
 	//Setting Load image information
-	stLdImgInfo.ulStartFBAddr    = (uint32_t) frameBuf; // Pointer to frame buffer
-	stLdImgInfo.usRotate         = IT8951_ROTATE_0;
-	stLdImgInfo.ulImgBufBaseAddr = gulImgBufAddr; // just leave as is i guess
+	stLdImgInfo->ulStartFBAddr    = (uintptr_t) frameBuf; // Pointer to frame buffer
+	stLdImgInfo->usRotate         = IT8951_ROTATE_0;
+	stLdImgInfo->ulImgBufBaseAddr = gulImgBufAddr; // just leave as is i guess
 
 	//Set Load Area
 	// center the frame on the panel as well as possible
-	stAreaImgInfo.usX      = ((gstI80DevInfo.usPanelW - width) >> 2) << 1; // Uneven x-offsets mess things up
-	stAreaImgInfo.usY      = (gstI80DevInfo.usPanelH - height) / 2;
-	stAreaImgInfo.usWidth  = width;
-	stAreaImgInfo.usHeight = height;
-	stAreaImgInfo.usLinesize = linesize;
+	stAreaImgInfo->usX      = ((gstI80DevInfo.usPanelW - width) >> 2) << 1; // Uneven x-offsets mess things up
+	stAreaImgInfo->usY      = (gstI80DevInfo.usPanelH - height) / 2;
+	stAreaImgInfo->usWidth  = width;
+	stAreaImgInfo->usHeight = height;
+	stAreaImgInfo->usLinesize = linesize;
+}
+
+static void reportTransfer(uint32_t bytes, double spiMs) {
+	printf("Sent %u bytes in %.0f ms (%.2f MB/s)\n", bytes, spiMs, bytes / spiMs / 1000.0);
+}
+
+// Differential refresh
+// The last frame that went to the display is kept and compared to the next one in tiles of
+// PARTIAL_REFRESH_TILE x PARTIAL_REFRESH_TILE pixels. Consecutive rows of tiles with changes are merged
+// into rectangles, and only those are uploaded and refreshed. If too many tiles changed,
+// or the frame size doesn't allow for word-aligned rectangles, the whole frame is refreshed
+#define MAX_REFRESH_AREAS 16
+
+typedef struct {
+	int x, y, w, h; // in frame pixels
+} RefreshArea;
+
+static MemoryBuffer previousBuffer = MEMORY_BUFFER("previous frame");
+static uint8_t *previousFrame = NULL;
+static int previousWidth = 0, previousHeight = 0;
+
+// Frames are numbered as they are remembered, so it's known whether previousFrame is what's on the panel
+// With preloading, previousFrame is the last frame sent to the controller, which may not have been displayed yet
+static uint32_t previousId = 0;
+static uint32_t panelId = 0;       // frame on the panel, 0 if unknown
+static uint32_t imageBufferId = 0; // frame in the controller's image buffer, preloaded frames are elsewhere
+
+static void forgetPreviousFrame() {
+	previousWidth = previousHeight = 0;
+	panelId = 0;
+}
+
+// Once the controller timed out (see LCDWaitForReady), everything sent to it is dropped, so the refresh
+// comes to an end quickly and is aborted here. The controller is reset, which loses what it held, so the
+// next frame is uploaded and refreshed in full. Returns non-zero if the refresh was aborted
+static int checkDisplay() {
+	if (!gbLCDTimedOut)
+		return 0;
+
+	printf("The display controller stopped responding, aborting the refresh and resetting it\n");
+	if (IT8951Reset())
+		printf("Resetting the display controller failed, trying again on the next refresh\n");
+	forgetPreviousFrame();
+	forgetWaveforms();
+	forgetPreloads();
+	imageBufferId = 0;
+	return -1;
+}
+
+static void rememberFrame(const uint8_t *packedBuf, int width, int height) {
+	previousId++;
+	#if PARTIAL_REFRESH
+		previousFrame = memoryFit(&previousBuffer, packedFrameSize(width, height));
+		memcpy(previousFrame, packedBuf, packedFrameSize(width, height));
+		countCopy(packedFrameSize(width, height));
+		previousWidth = width;
+		previousHeight = height;
+	#endif
+}
+
+// Finds the areas that changed since the previous frame
+// Returns their number, or -1 if the whole frame should be refreshed
+static int changedAreas(const uint8_t *packedBuf, int width, int height, RefreshArea *areas) {
+	const int tileBytes = PARTIAL_REFRESH_TILE * config.transportBpp / 8;
+	const int lineBytes = width * config.transportBpp / 8;
+	const int tilesX = (width + PARTIAL_REFRESH_TILE - 1) / PARTIAL_REFRESH_TILE;
+	const int tilesY = (height + PARTIAL_REFRESH_TILE - 1) / PARTIAL_REFRESH_TILE;
+	static MemoryBuffer changedBuffer = MEMORY_BUFFER("changed tiles");
+	int changedTiles = 0, count = 0;
+	int tx, ty, y;
+
+	// Rectangles have to start and end on 16 bit words in every line
+	if (!PARTIAL_REFRESH || !previousWidth || width != previousWidth || height != previousHeight || (width * config.transportBpp) % 16)
+		return -1;
+
+	uint8_t *changed = memoryFit(&changedBuffer, tilesX);
+	RefreshArea *current = NULL;
+
+	for (ty = 0; ty < tilesY; ty++) {
+		int y0 = ty * PARTIAL_REFRESH_TILE;
+		int y1 = y0 + PARTIAL_REFRESH_TILE < height ? y0 + PARTIAL_REFRESH_TILE : height;
+		int first = tilesX, last = -1;
+
+		memset(changed, 0, tilesX);
+		for (y = y0; y < y1; y++) {
+			for (tx = 0; tx < tilesX; tx++) {
+				if (changed[tx])
+					continue;
+
+				uint32_t offset = y * lineBytes + tx * tileBytes;
+				int len = tx == tilesX - 1 ? lineBytes - tx * tileBytes : tileBytes;
+				if (memcmp(packedBuf + offset, previousFrame + offset, len)) {
+					changed[tx] = 1;
+					changedTiles++;
+					first = tx < first ? tx : first;
+					last = tx > last ? tx : last;
+				}
+			}
+		}
+
+		if (last < 0) {
+			current = NULL;
+			continue;
+		}
+
+		int x0 = first * PARTIAL_REFRESH_TILE;
+		int x1 = (last + 1) * PARTIAL_REFRESH_TILE < width ? (last + 1) * PARTIAL_REFRESH_TILE : width;
+
+		// Extend the area of the row of tiles above, or start a new one
+		if (current) {
+			int right = current->x + current->w > x1 ? current->x + current->w : x1;
+			current->x = current->x < x0 ? current->x : x0;
+			current->w = right - current->x;
+			current->h = y1 - current->y;
+		}
+		else if (count < MAX_REFRESH_AREAS) {
+			current = &areas[count++];
+			*current = (RefreshArea) { x0, y0, x1 - x0, y1 - y0 };
+		}
+		else {
+			// Too fragmented, just refresh the whole thing
+			changedTiles = tilesX * tilesY;
+			break;
+		}
+	}
+
+	if (changedTiles * 100 > tilesX * tilesY * PARTIAL_REFRESH_THRESHOLD)
+		return -1;
+
+	printf("%d of %d tiles changed, refreshing %d area(s)\n", changedTiles, tilesX * tilesY, count);
+	return count;
+}
+
+// Areas that changed compared to what is on the panel and in the image buffer, -1 for a full refresh if that isn't known
+static int changedPanelAreas(const uint8_t *packedBuf, int width, int height, RefreshArea *areas) {
+	return previousId == panelId && previousId == imageBufferId ? changedAreas(packedBuf, width, height, areas) : -1;
+}
+
+// Waveforms
+// GC16 shows all grey levels, but takes the longest and flashes the panel. Frames with only black and white pixels
+// can use DU instead, which drives any pixel to black or white, or A2, which is faster still but only works
+// on pixels that are black or white already, so it is only used if the panel showed such a frame before
+// Mode numbers depend on the waveform LUT, A2 is mode 4 on M641 LUTs and mode 6 on the others
+// Partial refreshes and the fast waveforms leave ghosting behind, so every WAVEFORM_CLEAR_INTERVAL refreshes
+// the whole frame is refreshed with GC16
+static uint16_t waveformA2 = 6;
+static int panelBilevel = 0;        // the panel shows a black and white frame
+static int refreshesSinceClear = 0; // refreshes since the whole frame was last refreshed with GC16
+
+static void waveformSetup() {
+	char lutVersion[sizeof(gstI80DevInfo.usLUTVersion) + 1];
+
+	memcpy(lutVersion, gstI80DevInfo.usLUTVersion, sizeof(gstI80DevInfo.usLUTVersion));
+	lutVersion[sizeof(gstI80DevInfo.usLUTVersion)] = 0;
+	waveformA2 = strcmp(lutVersion, "M641") ? 6 : 4;
+	printf("Waveform LUT %s, A2 is mode %d\n", lutVersion, waveformA2);
+}
+
+static void forgetWaveforms() {
+	panelBilevel = 0;
+	refreshesSinceClear = 0;
+}
+
+// Whether a packed frame only has black and white pixels
+static int isBilevel(const uint8_t *packedBuf, int width, int height) {
+	static uint8_t bilevelBytes[256];
+	static int tableReady = 0;
+	const int max = (1 << config.transportBpp) - 1;
+	uint32_t size = packedFrameSize(width, height);
+	uint32_t i;
+	int b, shift;
+
+	if (!tableReady) {
+		for (b = 0; b < 256; b++) {
+			bilevelBytes[b] = 1;
+			for (shift = 0; shift < 8; shift += config.transportBpp) {
+				int v = (b >> shift) & max;
+				if (v != 0 && v != max)
+					bilevelBytes[b] = 0;
+			}
+		}
+		tableReady = 1;
+	}
+
+	for (i = 0; i < size; i++) {
+		if (!bilevelBytes[packedBuf[i]])
+			return 0;
+	}
+	return 1;
+}
+
+// Picks the waveform for refreshing a frame, which may turn the refresh into a full one by setting count to -1
+static uint16_t chooseWaveform(int bilevel, int *count) {
+	uint16_t mode = IT8951_MODE_GC16;
+
+	if (WAVEFORM_CLEAR_INTERVAL && ++refreshesSinceClear >= WAVEFORM_CLEAR_INTERVAL)
+		*count = -1;
+	else if (FAST_WAVEFORMS && bilevel)
+		mode = panelBilevel ? waveformA2 : IT8951_MODE_DU;
+
+	if (mode == IT8951_MODE_GC16 && *count < 0)
+		refreshesSinceClear = 0;
+	panelBilevel = bilevel;
+
+	printf("Refreshing %s with %s\n", *count < 0 ? "the whole frame" : "changed areas",
+		mode == IT8951_MODE_GC16 ? "GC16" : mode == IT8951_MODE_DU ? "DU" : "A2");
+	return mode;
+}
+
+// Uploads the given area of a packed frame to the image buffer at bufAddr
+static void uploadArea(const uint8_t *packedBuf, int width, int height, const RefreshArea *area, uint32_t bufAddr) {
+	static MemoryBuffer areaBuffer = MEMORY_BUFFER("refresh area");
+	IT8951LdImgInfo stLdImgInfo;
+	IT8951AreaImgInfo stAreaImgInfo;
+	int lineBytes = width * config.transportBpp / 8;
+	int areaLineBytes = area->w * config.transportBpp / 8;
+	int y;
+
+	const uint8_t *src = packedBuf + area->y * lineBytes;
+
+	// Areas spanning whole lines are contiguous already
+	if (area->w != width) {
+		// Sized for the whole frame, so it doesn't have to grow with the areas
+		uint8_t *areaBuf = memoryFit(&areaBuffer, packedFrameSize(width, height));
+
+		for (y = 0; y < area->h; y++)
+			memcpy(areaBuf + y * areaLineBytes, packedBuf + (area->y + y) * lineBytes + area->x * config.transportBpp / 8, areaLineBytes);
+		countCopy(area->h * areaLineBytes);
+		src = areaBuf;
+	}
+
+	setupArea(&stLdImgInfo, &stAreaImgInfo, src, area->w, width, height);
+	stLdImgInfo.ulImgBufBaseAddr = bufAddr;
+	stAreaImgInfo.usX += area->x;
+	stAreaImgInfo.usY += area->y;
+	stAreaImgInfo.usWidth = area->w;
+	stAreaImgInfo.usHeight = area->h;
+	IT8951HostAreaPackedWrite(&stLdImgInfo, &stAreaImgInfo);
+}
+
+// Refreshes the given areas of the frame, which is centered on the panel like in setupArea,
+// from the image buffer at bufAddr, or the whole frame if count is -1
+static void displayAreas(int width, int height, const RefreshArea *areas, int count, uint32_t bufAddr, uint16_t mode) {
+	IT8951LdImgInfo stLdImgInfo;
+	IT8951AreaImgInfo stAreaImgInfo;
+	RefreshArea full = { 0, 0, width, height };
+	setupArea(&stLdImgInfo, &stAreaImgInfo, NULL, width, width, height);
+
+	if (count < 0) {
+		areas = &full;
+		count = 1;
+	}
+
+	//Display Area (x,y,w,h) with the given waveform mode
+	for (int i = 0; i < count; i++) {
+		if (bufAddr == gulImgBufAddr)
+			IT8951DisplayArea(stAreaImgInfo.usX + areas[i].x, stAreaImgInfo.usY + areas[i].y, areas[i].w, areas[i].h, mode);
+		else
+			IT8951DisplayAreaBuf(stAreaImgInfo.usX + areas[i].x, stAreaImgInfo.usY + areas[i].y, areas[i].w, areas[i].h, mode, bufAddr);
+	}
+}
+
+// Writes a frame that has been packed to the transport bpp to the display and displays it
+static void pixelPushPacked(const uint8_t *packedBuf, int width, int height) {
+	RefreshArea areas[MAX_REFRESH_AREAS];
+	RefreshArea full = { 0, 0, width, height };
+	int count = changedPanelAreas(packedBuf, width, height, areas);
+	uint32_t bytes = 0;
+	int i;
+
+	if (count == 0) {
+		printf("Frame unchanged, skipping refresh\n");
+		return;
+	}
 
 	wakeDisplay();
-	
+
 	//Load Image from Host to IT8951 Image Buffer
-	IT8951HostAreaPackedPixelWrite(&stLdImgInfo, &stAreaImgInfo);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (count < 0) {
+		uploadArea(packedBuf, width, height, &full, gulImgBufAddr);
+		bytes = packedFrameSize(width, height);
+	}
+	else {
+		for (i = 0; i < count; i++) {
+			uploadArea(packedBuf, width, height, &areas[i], gulImgBufAddr);
+			bytes += packedFrameSize(areas[i].w, areas[i].h);
+		}
+	}
+	refreshTiming.ms[STAGE_UPLOAD] = msSince(&start);
+	reportTransfer(bytes, refreshTiming.ms[STAGE_UPLOAD]);
+
+	// The image buffer holds the whole frame now, so a refresh of all of it works even if only areas were uploaded
+	uint16_t mode = chooseWaveform(isBilevel(packedBuf, width, height), &count);
+	displayAreas(width, height, areas, count, gulImgBufAddr, mode);
+
+	if (standbyDisplay())
+		return;
+	rememberFrame(packedBuf, width, height);
+	panelId = imageBufferId = previousId;
+}
+
+// Streaming transfer
+// When frames go straight to the display, pixelStreamBegin is called before the frame is dithered
+// and pixelStreamLines after every packed line. A sender thread transfers the frame in chunks as soon as
+// they are complete, so the transfer mostly overlaps with dithering the rest of the frame
+// The sender is started once with the display and waits for the next frame in between
+// pixelStreamEnd waits for the last chunk and refreshes the display
+// As the upload starts before the frame is known, only the refresh is limited to areas that changed
+static struct {
+	IT8951LdImgInfo stLdImgInfo;
+	IT8951AreaImgInfo stAreaImgInfo;
+	const uint8_t *buf;
+	uint32_t size;
+	uint32_t ready;  // bytes packed so far
+	double spiMs;    // time spent sending
+	int sending;     // set from pixelStreamBegin until the whole frame has been sent
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // signalled to the sender when a frame starts or lines are ready
+	pthread_cond_t sent; // signalled to pixelStreamEnd when the frame has been sent
+} stream = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .sent = PTHREAD_COND_INITIALIZER };
+
+// Sends one frame while it is being packed
+static void streamFrame() {
+	uint32_t sent = 0, ready, len;
+	struct timespec start;
+
+	wakeDisplay();
+	IT8951HostAreaPackedWriteStart(&stream.stLdImgInfo, &stream.stAreaImgInfo);
+
+	while (sent < stream.size) {
+		pthread_mutex_lock(&stream.lock);
+		while (stream.ready - sent < SPI_CHUNK_SIZE && stream.ready < stream.size)
+			pthread_cond_wait(&stream.cond, &stream.lock);
+		ready = stream.ready;
+		pthread_mutex_unlock(&stream.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		while (sent < ready) {
+			len = ready - sent < SPI_CHUNK_SIZE ? ready - sent : SPI_CHUNK_SIZE;
+			LCDWriteNData(stream.buf + sent, len);
+			sent += len;
+		}
+		stream.spiMs += msSince(&start);
+	}
+
+	IT8951LoadImgEnd();
+}
+
+static void *streamWorker(void *arg) {
+	pthread_mutex_lock(&stream.lock);
+	while (1) {
+		while (!stream.sending)
+			pthread_cond_wait(&stream.cond, &stream.lock);
+		pthread_mutex_unlock(&stream.lock);
+
+		streamFrame();
+
+		pthread_mutex_lock(&stream.lock);
+		stream.sending = 0;
+		pthread_cond_signal(&stream.sent);
+	}
+	return NULL;
+}
+
+static int streamSetup() {
+	if (pthread_create(&stream.thread, NULL, streamWorker, NULL)) {
+		printf("ERROR could not start the display transfer thread\n");
+		return 1;
+	}
+	return 0;
+}
+
+static void pixelStreamBegin(const uint8_t *packedBuf, int width, int height) {
+	pthread_mutex_lock(&stream.lock);
+	setupArea(&stream.stLdImgInfo, &stream.stAreaImgInfo, packedBuf, width, width, height);
+	stream.buf = packedBuf;
+	stream.size = packedFrameSize(width, height);
+	stream.ready = 0;
+	stream.spiMs = 0;
+	stream.sending = 1;
+	pthread_cond_signal(&stream.cond);
+	pthread_mutex_unlock(&stream.lock);
+}
+
+static void pixelStreamLines(int lines) {
+	// Only whole 16 bit words can be sent, the last line completes the frame
+	uint32_t ready = lines == stream.stAreaImgInfo.usHeight ? stream.size :
+		((uint64_t) lines * stream.stAreaImgInfo.usWidth * config.transportBpp / 8) & ~1;
+
+	pthread_mutex_lock(&stream.lock);
+	stream.ready = ready;
+	pthread_cond_signal(&stream.cond);
+	pthread_mutex_unlock(&stream.lock);
+}
+
+static void pixelStreamEnd(const uint8_t *packedBuf, int width, int height) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&stream.lock);
+	while (stream.sending)
+		pthread_cond_wait(&stream.sent, &stream.lock);
+	pthread_mutex_unlock(&stream.lock);
+
+	refreshTiming.ms[STAGE_UPLOAD] = stream.spiMs;
+	reportTransfer(stream.size, stream.spiMs);
+	printf("Waited %.0f ms for the transfer after dithering\n", msSince(&start));
+
+	// The whole frame has been uploaded already, but unchanged parts of the panel don't need to be redrawn
+	RefreshArea areas[MAX_REFRESH_AREAS];
+	int count = changedPanelAreas(packedBuf, width, height, areas);
+	uint16_t mode = chooseWaveform(isBilevel(packedBuf, width, height), &count);
+	displayAreas(width, height, areas, count, gulImgBufAddr, mode);
+
+	if (standbyDisplay())
+		return;
+	rememberFrame(packedBuf, width, height);
+	panelId = imageBufferId = previousId;
+}
 
-	//Display Area (x,y,w,h) with mode 2 for fast gray clear mode - depends on current waveform 
-	IT8951DisplayArea(stAreaImgInfo.usX, stAreaImgInfo.usY, stAreaImgInfo.usWidth, stAreaImgInfo.usHeight, 2);
+// Preloading
+// The controller has more memory than its one image buffer needs, so upcoming frames are uploaded ahead of time
+// into panel-sized buffers of their own behind it, while the display would otherwise be idle
+// Showing a preloaded frame then only takes a display command pointing at its buffer (IT8951DisplayAreaBuf)
+// The areas to refresh are found when a frame is uploaded, by comparing it to the frame uploaded before,
+// and are only used if that frame is still on the panel when it's shown
+#if PRELOAD_FRAMES > 0
+	#define DISPLAY_PRELOAD
 
+	typedef struct {
+		uint32_t addr;
+		int frame;       // frame number held, -1 if none
+		int width, height;
+		uint32_t id;     // previousId of the frame
+		uint32_t baseId; // previousId of the frame the areas were found against
+		int count;       // number of areas, -1 for a full refresh
+		RefreshArea areas[MAX_REFRESH_AREAS];
+		int bilevel;     // black and white only, see chooseWaveform
+	} PreloadBuffer;
+
+	static PreloadBuffer preloadBuffers[PRELOAD_FRAMES];
+	static int preloadCount = 0; // buffers that fit into the controller's memory
+
+	// Finds out how many buffers fit into the controller's memory
+	// The controller keeps images at 8 bpp with the panel's dimensions, whatever the transport format
+	// Every buffer has a test pattern written to its end and read back, so memory that isn't there isn't used
+	static void preloadSetup() {
+		uint32_t size = ((uint32_t) gstI80DevInfo.usPanelW * gstI80DevInfo.usPanelH + 15) & ~15u;
+		uint16_t pattern[2], readback[2];
+		int i, count;
+
+		for (count = 0; count < PRELOAD_FRAMES; count++) {
+			uint64_t addr = gulImgBufAddr + (uint64_t) (count + 1) * size;
+			if (addr + size > CONTROLLER_MEMORY_SIZE || addr + size > IT8951_MEM_ADDR_LIMIT)
+				break;
+			preloadBuffers[count] = (PreloadBuffer) { .addr = addr, .frame = -1 };
+		}
+
+		for (i = 0; i < count; i++) {
+			pattern[0] = 0xa500 | i;
+			pattern[1] = 0x5a00 | i;
+			IT8951MemBurstWriteProc(preloadBuffers[i].addr + size - 4, 2, pattern);
+		}
+		for (i = 0; i < count; i++) {
+			IT8951MemBurstReadProc(preloadBuffers[i].addr + size - 4, 2, readback);
+			if (readback[0] != (0xa500 | i) || readback[1] != (0x5a00 | i))
+				break;
+		}
+
+		preloadCount = i;
+		printf("Controller memory holds %d preloaded frame(s) of %u bytes\n", preloadCount, size);
+	}
+
+	// Number of frames that can be preloaded at once
+	static int pixelPreloadCapacity() {
+		return preloadCount;
+	}
+
+	static PreloadBuffer *findPreloaded(int frame) {
+		for (int i = 0; i < preloadCount; i++) {
+			if (preloadBuffers[i].frame == frame)
+				return &preloadBuffers[i];
+		}
+		return NULL;
+	}
+
+	static int pixelPreloaded(int frame) {
+		return findPreloaded(frame) != NULL;
+	}
+
+	// Uploads a frame that will be shown later, replacing the lowest frame number held
+	// Returns non-zero if all buffers hold later frames or the controller had to be reset
+	static int pixelPreload(const uint8_t *packedBuf, int width, int height, int frame) {
+		RefreshArea full = { 0, 0, width, height };
+		PreloadBuffer *buffer = NULL;
+		struct timespec start;
+		int i;
+
+		for (i = 0; i < preloadCount; i++) {
+			if (!buffer || preloadBuffers[i].frame < buffer->frame)
+				buffer = &preloadBuffers[i];
+		}
+		if (!buffer || buffer->frame > frame)
+			return -1;
+		buffer->frame = -1;
+
+		// This happens between refreshes, so it doesn't count towards the timing of one
+		// Its transactions are counted with the refresh that follows, which usually shows this frame
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		IT8951SystemRun();
+		IT8951WaitForDisplayReady();
+		uploadArea(packedBuf, width, height, &full, buffer->addr);
+		IT8951Sleep();
+		if (checkDisplay())
+			return -1;
+
+		buffer->count = changedAreas(packedBuf, width, height, buffer->areas);
+		buffer->baseId = previousId;
+		buffer->bilevel = isBilevel(packedBuf, width, height);
+		rememberFrame(packedBuf, width, height);
+		buffer->id = previousId;
+		buffer->frame = frame;
+		buffer->width = width;
+		buffer->height = height;
+
+		printf("Preloaded frame %d into controller buffer %d in %.0f ms\n", frame, (int) (buffer - preloadBuffers), msSince(&start));
+		return 0;
+	}
+
+	static void forgetPreloads() {
+		for (int i = 0; i < preloadCount; i++)
+			preloadBuffers[i].frame = -1;
+	}
+
+	// Shows a preloaded frame, returns non-zero if the frame isn't preloaded
+	// or the controller had to be reset, which loses the preloaded frames
+	static int pixelShowPreloaded(int frame) {
+		PreloadBuffer *buffer = findPreloaded(frame);
+
+		if (!buffer)
+			return -1;
+
+		if (buffer->baseId == panelId && buffer->count == 0) {
+			printf("Frame unchanged, skipping refresh\n");
+			panelId = buffer->id;
+			return 0;
+		}
+
+		printf("Showing frame %d from controller buffer %d\n", frame, (int) (buffer - preloadBuffers));
+		int count = buffer->baseId == panelId ? buffer->count : -1;
+		uint16_t mode = chooseWaveform(buffer->bilevel, &count);
+
+		wakeDisplay();
+		displayAreas(buffer->width, buffer->height, buffer->areas, count, buffer->addr, mode);
+		if (standbyDisplay())
+			return -1;
+
+		panelId = buffer->id;
+		return 0;
+	}
+#else
+	static void preloadSetup() {}
+	static void forgetPreloads() {}
+#endif
+
+// Finds the fastest working SPI clock, run with `vsmp --spi-selftest`
+// A test pattern is burst-written to the controller's image buffer and read back,
+// stepping the clock up until the data read back doesn't match
+static int spiSelftest() {
+	const uint16_t dividers[] = { 128, 64, 48, 40, 32, 28, 24, 20, 16, 14, 12, 10, 8, 6, 4, 2 };
+	const uint32_t words = 32768;
+	uint8_t *pattern = malloc(words * 2);
+	uint16_t *readback = malloc(words * 2);
+	uint16_t fastest = 0;
+	uint32_t i;
+	int d;
+
+	wakeDisplay();
+
+	for (d = 0; d < sizeof(dividers) / sizeof(dividers[0]); d++) {
+		struct timespec start;
+
+		// Different data for every step, so a stale buffer can't pass
+		for (i = 0; i < words * 2; i++)
+			pattern[i] = (i * 131 + d * 71 + (i >> 8)) & 0xff;
+
+		bcm2835_spi_setClockDivider(dividers[d]);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		IT8951MemBurstWrite(gulImgBufAddr, words);
+		LCDWriteNData(pattern, words * 2);
+		IT8951MemBurstEnd();
+		double writeMs = msSince(&start);
+
+		IT8951MemBurstReadProc(gulImgBufAddr, words, readback);
+
+		uint32_t errors = 0;
+		for (i = 0; i < words; i++)
+			errors += readback[i] != ((pattern[2 * i] << 8) | pattern[2 * i + 1]);
+
+		printf("Divider %5d (%6.2f MHz at a 250 MHz core clock): %s, write %.2f MB/s\n", dividers[d], 250.0 / dividers[d],
+			errors ? "FAILED" : "ok", words * 2 / writeMs / 1000.0);
+		if (errors) {
+			printf("%u of %u words read back wrong\n", errors, words);
+			break;
+		}
+		fastest = dividers[d];
+	}
+
+	bcm2835_spi_setClockDivider((uint16_t) SPI_CLOCK_DIVIDER);
 	standbyDisplay();
+	free(pattern);
+	free(readback);
+
+	if (!fastest) {
+		printf("No divider worked, check the wiring\n");
+		return -1;
+	}
+
+	printf("Fastest working SPI_CLOCK_DIVIDER is %d (currently %d)\n", fastest, SPI_CLOCK_DIVIDER);
+	printf("Leave some headroom, e.g. use the next slower step\n");
+	return 0;
 }
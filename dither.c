@@ -1,7 +1,8 @@
 static unsigned char nearestPaletteColor(unsigned char pixel) {
-  if(pixel > BPP_CLIP)
+  const int bpp = config.bitsPerPixel;
+  if(pixel > BPP_CLIP(bpp))
     return 255;
-  return ((pixel + BPP_BIAS) / BPP_MUL) * BPP_MUL;
+  return ((pixel + BPP_BIAS(bpp)) / BPP_MUL(bpp)) * BPP_MUL(bpp);
 }
 
 static unsigned char clippedAdd(unsigned char base, int8_t bias) {
@@ -22,99 +23,651 @@ static int8_t quantizePixel(unsigned char *buf, uint idx) {
   return (int8_t) oldpixel - newpixel;
 }
 
-static void diffuseError(unsigned char *buf, uint idx, int8_t error, int8_t weight, int8_t base) {
-  buf[idx] = clippedAdd(buf[idx], (int8_t) ((((int) error) * weight) / base));
+// nearestPaletteColor for every possible value, contrastLut is built in tone.c
+static unsigned char paletteLut[256];
+
+// Fills the tables for the configured bpp and tone settings, unless they already are
+static void initDitherLuts() {
+  static int lutBpp = 0;
+
+  toneSetup();
+  if (lutBpp == config.bitsPerPixel)
+    return;
+
+  for (int i = 0; i < 256; i++)
+    paletteLut[i] = nearestPaletteColor(i);
+  lutBpp = config.bitsPerPixel;
+}
+
+// Called after every line with the number of lines packed so far, see FrameSink in vsmp.c
+static void (*linePacked)(int lines) = NULL;
+
+static void packLine(const unsigned char *line, int width, int j, uint8_t *packed) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  packRow(line, width, j * width, packed);
+  atomic_fetch_add_explicit(&packNs, nsSince(&start), memory_order_relaxed);
+  if (linePacked)
+    linePacked(j + 1);
 }
 
-static uint8_t* loadNoise() {
-  FILE *in = fopen("bluenoise.bin", "r");
-  if (!in) {
-    printf("Failed to open noise file bluenoise.bin\n");
-    exit(0);
+// Copies line j of the frame into line, mapping it through the tone curve
+static void loadLine(const unsigned char *frameBuf, int linesize, int width, int j, unsigned char *line) {
+  const unsigned char *src = frameBuf + j * linesize;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (contrastIdentity)
+    memcpy(line, src, width);
+  else {
+    for (int i = 0; i < width; i++)
+      line[i] = contrastLut[src[i]];
   }
+  atomic_fetch_add_explicit(&contrastNs, nsSince(&start), memory_order_relaxed);
+}
+
+// All dithering functions stream the frame one line at a time: a line is read into a small buffer
+// with its contrast adjusted, dithered there and packed straight into the output buffer with packLine
+// The frame buffer itself is only ever read
+static unsigned char *readLine(const unsigned char *frameBuf, int linesize, int width, int j) {
+  static MemoryBuffer lineBuffer = MEMORY_BUFFER("dither line");
+  unsigned char *line = memoryFit(&lineBuffer, width);
 
-  uint8_t *buffer = malloc(128 * 128 * sizeof(uint8_t));
-  fread(buffer, sizeof(uint8_t), 128 * 128, in);
-  fclose(in);
-  return buffer;
+  loadLine(frameBuf, linesize, width, j, line);
+  return line;
 }
 
-// Floyd-Steinberg dithering
-static void floydSteinberg(unsigned char *frameBuf, int linesize, int width, int height) {
-  uint32_t i,j,idx;
-  int8_t quantError;
-    
-  for(j = 0; j < height; j++) {
-    for(i = 0; i < width; i++) {
-      idx = j * linesize + i;
-      quantError = quantizePixel(frameBuf, idx);
+// Error diffusion engine
+// Kernels are given as tables of taps (offset and weight) plus a divisor and specialized by DIFFUSION_DITHER
+// Instead of writing diffused error back into the 8-bit frame after every tap, weighted errors are summed up
+// in int16 row buffers (the current row and the two below) and only divided, by a fixed-point multiply
+// and shift, once the target pixel is quantized
+// The row buffers are padded by DIFFUSION_PAD on both ends, so taps leaving the frame need no boundary checks
+
+#define DIFFUSION_ROWS 3
+#define DIFFUSION_PAD 2
+#define DIFFUSION_SHIFT 16
+
+typedef struct {
+  int8_t dx;
+  int8_t dy;
+  int8_t weight;
+} DiffusionTap;
+
+static inline __attribute__((always_inline)) void diffusePixel(
+  unsigned char *pixel,
+  int16_t *rows[DIFFUSION_ROWS],
+  int carry[DIFFUSION_PAD + 1],
+  int i,
+  int direction,
+  const DiffusionTap *taps,
+  int tapCount,
+  int32_t reciprocal
+) {
+  int accumulated = rows[0][i] + carry[0];
+  int value = *pixel + ((accumulated * reciprocal + (1 << (DIFFUSION_SHIFT - 1))) >> DIFFUSION_SHIFT);
+  value = value < 0 ? 0 : (value > 255 ? 255 : value);
+
+  unsigned char newpixel = paletteLut[value];
+  int error = value - newpixel;
+  *pixel = newpixel;
+
+  // Taps in the current row are carried along in registers, the pixel right next to us is up immediately
+  for (int d = 0; d < DIFFUSION_PAD; d++)
+    carry[d] = carry[d + 1];
+  carry[DIFFUSION_PAD] = 0;
+
+  #pragma GCC unroll 16
+  for (int t = 0; t < tapCount; t++) {
+    if (taps[t].dy == 0)
+      carry[taps[t].dx - 1] += error * taps[t].weight;
+    else
+      rows[taps[t].dy][i + direction * taps[t].dx] += error * taps[t].weight;
+  }
+}
 
-      if(i != width-1)
-        diffuseError(frameBuf, idx + 1, quantError, 7, 16);
+// Wavefront-parallel error diffusion, used for DITHER_THREADS > 1 (see wavefront.c)
+// Taps reach at most DIFFUSION_PAD pixels to either side and two rows down, so pixel i of a row can be
+// dithered as soon as the row above has finished pixel i + WAVEFRONT_LAG - 1: all error for pixel i has arrived
+// by then, and the parts of the rows below that the two rows diffuse into don't overlap
+// Row j is dithered by thread j % threads, which publishes j * width + (pixels done) as its progress
+// every WAVEFRONT_BLOCK pixels. The end of a row is only published once it has been packed and its error
+// row cleared, so lines are still packed and reported to linePacked in order
+// The output is identical to the serial version, serpentine kernels always run serially
+// as they alternate direction from row to row
+
+#define WAVEFRONT_LAG (2 * DIFFUSION_PAD + 1)
+#define WAVEFRONT_BLOCK 32
+
+static struct {
+  const unsigned char *frameBuf;
+  int linesize;
+  int width;
+  int height;
+  uint8_t *packed;
+  int16_t *errorBuf;    // ring of threads + DIFFUSION_ROWS - 1 error rows
+  unsigned char *lines; // one line buffer per thread
+} wavefront;
+
+static inline __attribute__((always_inline)) void wavefrontRows(
+  int thread,
+  int threads,
+  const DiffusionTap *taps,
+  int tapCount,
+  int32_t reciprocal
+) {
+  int width = wavefront.width;
+  int rowLength = width + 2 * DIFFUSION_PAD;
+  int ringRows = threads + DIFFUSION_ROWS - 1;
+  int above = (thread + threads - 1) % threads;
+  unsigned char *line = wavefront.lines + thread * width;
+  int16_t *rows[DIFFUSION_ROWS];
+  int i, j, r, start;
+
+  for (j = thread; j < wavefront.height; j += threads) {
+    int carry[DIFFUSION_PAD + 1] = { 0 };
+    int aboveStart = (j - 1) * width;
+    int ready = j > 0 ? 0 : width; // pixels of the row above known to be done
+
+    loadLine(wavefront.frameBuf, wavefront.linesize, width, j, line);
+    for (r = 0; r < DIFFUSION_ROWS; r++)
+      rows[r] = wavefront.errorBuf + ((j + r) % ringRows) * rowLength + DIFFUSION_PAD;
+
+    for (start = 0; start < width; start += WAVEFRONT_BLOCK) {
+      int end = start + WAVEFRONT_BLOCK < width ? start + WAVEFRONT_BLOCK : width;
+      int needed = end - 1 + WAVEFRONT_LAG < width ? end - 1 + WAVEFRONT_LAG : width;
+
+      if (ready < needed)
+        ready = wavefrontWait(above, aboveStart + needed) - aboveStart;
+
+      for (i = start; i < end; i++)
+        diffusePixel(line + i, rows, carry, i, 1, taps, tapCount, reciprocal);
+
+      if (end < width)
+        wavefrontPublish(thread, j * width + end);
+    }
 
-      if(j != height-1) {
-        diffuseError(frameBuf, idx + linesize, quantError, 5, 16);
+    packLine(line, width, j, wavefront.packed);
 
-        if(i != width-1)
-          diffuseError(frameBuf, idx + linesize + 1, quantError, 1, 16);
-        if(i != 0)
-          diffuseError(frameBuf, idx + linesize - 1, quantError, 3, 16);
-      }
+    // The current error row has received all its error, it becomes row j + ringRows
+    memset(rows[0] - DIFFUSION_PAD, 0, rowLength * sizeof(int16_t));
+    wavefrontPublish(thread, (j + 1) * width);
+  }
+}
+
+static void wavefrontDiffusion(
+  const unsigned char *frameBuf,
+  int linesize,
+  int width,
+  int height,
+  uint8_t *packed,
+  void (*job)(int thread, int threads)
+) {
+  static MemoryBuffer errorBuffer = MEMORY_BUFFER("wavefront error rows");
+  static MemoryBuffer linesBuffer = MEMORY_BUFFER("wavefront lines");
+  int threads = ditherThreads < WAVEFRONT_MAX_THREADS ? ditherThreads : WAVEFRONT_MAX_THREADS;
+  int rowLength = width + 2 * DIFFUSION_PAD;
+
+  wavefront.errorBuf = memoryFit(&errorBuffer, (threads + DIFFUSION_ROWS - 1) * rowLength * sizeof(int16_t));
+  wavefront.lines = memoryFit(&linesBuffer, threads * width);
+
+  memset(wavefront.errorBuf, 0, (threads + DIFFUSION_ROWS - 1) * rowLength * sizeof(int16_t));
+  wavefront.frameBuf = frameBuf;
+  wavefront.linesize = linesize;
+  wavefront.width = width;
+  wavefront.height = height;
+  wavefront.packed = packed;
+
+  wavefrontRun(job, threads);
+}
+
+static inline __attribute__((always_inline)) void errorDiffusion(
+  const unsigned char *frameBuf,
+  int linesize,
+  int width,
+  int height,
+  uint8_t *packed,
+  const DiffusionTap *taps,
+  int tapCount,
+  int32_t reciprocal,
+  int serpentine,
+  void (*wavefrontJob)(int thread, int threads)
+) {
+  static MemoryBuffer errorBuffer = MEMORY_BUFFER("dither error rows");
+  int rowLength = width + 2 * DIFFUSION_PAD;
+  int16_t *rows[DIFFUSION_ROWS];
+  int i, j, r;
+
+  initDitherLuts();
+
+  if (!serpentine && ditherThreads > 1 && height > 1) {
+    wavefrontDiffusion(frameBuf, linesize, width, height, packed, wavefrontJob);
+    return;
+  }
+
+  int16_t *errorBuf = memoryFit(&errorBuffer, DIFFUSION_ROWS * rowLength * sizeof(int16_t));
+  memset(errorBuf, 0, DIFFUSION_ROWS * rowLength * sizeof(int16_t));
+  for (r = 0; r < DIFFUSION_ROWS; r++)
+    rows[r] = errorBuf + r * rowLength + DIFFUSION_PAD;
+
+  for (j = 0; j < height; j++) {
+    unsigned char *line = readLine(frameBuf, linesize, width, j);
+    int carry[DIFFUSION_PAD + 1] = { 0 };
+
+    // Serpentine kernels process every other line right to left with mirrored taps
+    if (serpentine && (j & 1)) {
+      for (i = width - 1; i >= 0; i--)
+        diffusePixel(line + i, rows, carry, i, -1, taps, tapCount, reciprocal);
+    }
+    else {
+      for (i = 0; i < width; i++)
+        diffusePixel(line + i, rows, carry, i, 1, taps, tapCount, reciprocal);
     }
+    packLine(line, width, j, packed);
+
+    // Move on to the next row, recycling the current error row as the lowest one
+    int16_t *done = rows[0];
+    for (r = 0; r < DIFFUSION_ROWS - 1; r++)
+      rows[r] = rows[r + 1];
+    rows[DIFFUSION_ROWS - 1] = done;
+    memset(done - DIFFUSION_PAD, 0, rowLength * sizeof(int16_t));
   }
 }
 
+// Defines a dithering function for the given kernel, along with the row worker used with DITHER_THREADS > 1
+#define DIFFUSION_DITHER(name, taps, divisor, serpentine) \
+  static __attribute__((unused)) void name##Rows(int thread, int threads) { \
+    wavefrontRows(thread, threads, taps, sizeof(taps) / sizeof(DiffusionTap), \
+      ((1 << DIFFUSION_SHIFT) + (divisor) / 2) / (divisor)); \
+  } \
+  static void name(const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *packed) { \
+    errorDiffusion(frameBuf, linesize, width, height, packed, taps, sizeof(taps) / sizeof(DiffusionTap), \
+      ((1 << DIFFUSION_SHIFT) + (divisor) / 2) / (divisor), serpentine, name##Rows); \
+  }
+
+// Floyd-Steinberg dithering
+//        X   7
+//    3   5   1     (1/16)
+static const DiffusionTap floydSteinbergTaps[] = {
+  { 1, 0, 7 },
+  { -1, 1, 3 }, { 0, 1, 5 }, { 1, 1, 1 }
+};
+DIFFUSION_DITHER(floydSteinberg, floydSteinbergTaps, 16, 0)
+
 // Serpentine Floyd-Steinberg dithering
 // Essentially reverses dithering direction every line for more even texture
-static void floydSteinbergSerpentine(unsigned char *frameBuf, int linesize, int width, int height) {
-  uint32_t i,j,idx;
-  int8_t quantError;
-    
-  for(j = 0; j < height; j++) {
-    for(i = 0; i < width; i++) {
-      idx = j * linesize + i;
-      quantError = quantizePixel(frameBuf, idx);
+DIFFUSION_DITHER(floydSteinbergSerpentine, floydSteinbergTaps, 16, 1)
+
+// Ordered dithering
+// Ordered dithers add a threshold to every pixel and quantize it, independently of all other pixels,
+// so whole lines are processed at once using SSE2 on x86 or NEON on ARM builds that enable it (-mfpu=neon, Pi 2 and newer)
+// The ARMv6 of the Pi Zero has neither and uses the scalar loops
+// Thresholds are split into a positive and a negative part, adding one and subtracting the other
+// with saturating byte arithmetic gives the same result as clippedAdd
+// Quantization multiplies by the rounded-up reciprocal of BPP_MUL, which is exact for all values up to 255 + BPP_BIAS
+// These constants depend on the bits per pixel, so the ordered dithers take bpp as an argument that is always
+// a constant: DITHER_PER_BPP instantiates them once for every bpp, and ditherSetup picks one at startup
+// The original per-pixel implementations are kept as a reference for `vsmp --dither-selftest`
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+  #define ORDERED_SIMD "SSE2"
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define ORDERED_SIMD "NEON"
+#else
+  #define ORDERED_SIMD "scalar"
+#endif
+
+#define QUANTIZE_RECIPROCAL(bpp) ((65536 + BPP_MUL(bpp) - 1) / BPP_MUL(bpp))
+
+// Interleaved gradient noise constants
+#define GRADIENT_C1 52.9829189f
+#define GRADIENT_CX 0.06711056f
+#define GRADIENT_CY 0.00583715f
+
+static inline __attribute__((always_inline)) void splitThreshold(int noise, uint8_t *add, uint8_t *sub, const int bpp) {
+  int bias = noise - BPP_BIAS(bpp);
+  *add = bias > 0 ? bias : 0;
+  *sub = bias < 0 ? -bias : 0;
+}
+
+#if defined(__SSE2__)
+// Quantizes eight 16 bit values, like nearestPaletteColor, only used if BPP_MUL(bpp) > 1
+static inline __attribute__((always_inline)) __m128i quantizeWords(__m128i v, const int bpp) {
+  __m128i level = _mm_mulhi_epu16(_mm_add_epi16(v, _mm_set1_epi16(BPP_BIAS(bpp))), _mm_set1_epi16(QUANTIZE_RECIPROCAL(bpp)));
+  __m128i clipped = _mm_and_si128(_mm_cmpgt_epi16(v, _mm_set1_epi16(BPP_CLIP(bpp))), _mm_set1_epi16(255));
+  return _mm_or_si128(_mm_mullo_epi16(level, _mm_set1_epi16(BPP_MUL(bpp))), clipped);
+}
+
+// Interleaved gradient noise for four pixels, using the same float operations as the scalar code
+static inline __attribute__((always_inline)) __m128i gradientNoise(__m128 x, __m128 yTerm, const int bpp) {
+  __m128 inner = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(GRADIENT_CX), x), yTerm);
+  inner = _mm_sub_ps(inner, _mm_cvtepi32_ps(_mm_cvttps_epi32(inner)));
+  __m128 outer = _mm_mul_ps(_mm_set1_ps(GRADIENT_C1), inner);
+  outer = _mm_sub_ps(outer, _mm_cvtepi32_ps(_mm_cvttps_epi32(outer)));
+  return _mm_cvttps_epi32(_mm_mul_ps(outer, _mm_set1_ps(BPP_MUL(bpp))));
+}
+#elif defined(__ARM_NEON)
+static inline __attribute__((always_inline)) uint16x8_t quantizeWords(uint16x8_t v, const int bpp) {
+  uint16x8_t biased = vaddq_u16(v, vdupq_n_u16(BPP_BIAS(bpp)));
+  uint16x4_t levelLow = vshrn_n_u32(vmull_u16(vget_low_u16(biased), vdup_n_u16(QUANTIZE_RECIPROCAL(bpp))), 16);
+  uint16x4_t levelHigh = vshrn_n_u32(vmull_u16(vget_high_u16(biased), vdup_n_u16(QUANTIZE_RECIPROCAL(bpp))), 16);
+  uint16x8_t clipped = vandq_u16(vcgtq_u16(v, vdupq_n_u16(BPP_CLIP(bpp))), vdupq_n_u16(255));
+  return vorrq_u16(vmulq_u16(vcombine_u16(levelLow, levelHigh), vdupq_n_u16(BPP_MUL(bpp))), clipped);
+}
+
+static inline __attribute__((always_inline)) int32x4_t gradientNoise(float32x4_t x, float32x4_t yTerm, const int bpp) {
+  float32x4_t inner = vaddq_f32(vmulq_f32(vdupq_n_f32(GRADIENT_CX), x), yTerm);
+  inner = vsubq_f32(inner, vcvtq_f32_s32(vcvtq_s32_f32(inner)));
+  float32x4_t outer = vmulq_f32(vdupq_n_f32(GRADIENT_C1), inner);
+  outer = vsubq_f32(outer, vcvtq_f32_s32(vcvtq_s32_f32(outer)));
+  return vcvtq_s32_f32(vmulq_f32(outer, vdupq_n_f32(BPP_MUL(bpp))));
+}
+#endif
+
+#if defined(__SSE2__)
+// Quantizes sixteen pixels
+static inline __attribute__((always_inline)) __m128i quantizeBytes(__m128i v, const int bpp) {
+  if (BPP_MUL(bpp) == 1)
+    return v;
+  __m128i low = quantizeWords(_mm_unpacklo_epi8(v, _mm_setzero_si128()), bpp);
+  __m128i high = quantizeWords(_mm_unpackhi_epi8(v, _mm_setzero_si128()), bpp);
+  return _mm_packus_epi16(low, high);
+}
+#elif defined(__ARM_NEON)
+static inline __attribute__((always_inline)) uint8x16_t quantizeBytes(uint8x16_t v, const int bpp) {
+  if (BPP_MUL(bpp) == 1)
+    return v;
+  uint16x8_t low = quantizeWords(vmovl_u8(vget_low_u8(v)), bpp);
+  uint16x8_t high = quantizeWords(vmovl_u8(vget_high_u8(v)), bpp);
+  return vcombine_u8(vqmovn_u16(low), vqmovn_u16(high));
+}
+#endif
+
+// Adds the thresholds to one line of pixels and quantizes them
+static inline __attribute__((always_inline)) void ditherRowOrdered(
+  unsigned char *row,
+  const uint8_t *add,
+  const uint8_t *sub,
+  int width,
+  const int bpp
+) {
+  int i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 16 <= width; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (row + i));
+    v = _mm_adds_epu8(v, _mm_loadu_si128((const __m128i *) (add + i)));
+    v = _mm_subs_epu8(v, _mm_loadu_si128((const __m128i *) (sub + i)));
+    _mm_storeu_si128((__m128i *) (row + i), quantizeBytes(v, bpp));
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 16 <= width; i += 16) {
+    uint8x16_t v = vqsubq_u8(vqaddq_u8(vld1q_u8(row + i), vld1q_u8(add + i)), vld1q_u8(sub + i));
+    vst1q_u8(row + i, quantizeBytes(v, bpp));
+  }
+#endif
+
+  for (; i < width; i++) {
+    int value = row[i] + add[i] - sub[i];
+    row[i] = paletteLut[value < 0 ? 0 : (value > 255 ? 255 : value)];
+  }
+}
+
+// Interleaved gradient noise thresholds for line j
+static inline __attribute__((always_inline)) void gradientNoiseRow(uint32_t j, int width, uint8_t *add, uint8_t *sub, const int bpp) {
+  const float c1 = GRADIENT_C1;
+  const float cx = GRADIENT_CX;
+  const float cy = GRADIENT_CY;
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128 yTerm = _mm_set1_ps(cy * j);
+  __m128 x = _mm_setr_ps(0, 1, 2, 3);
+  for (; i + 8 <= width; i += 8) {
+    __m128i low = gradientNoise(x, yTerm, bpp);
+    x = _mm_add_ps(x, _mm_set1_ps(4));
+    __m128i high = gradientNoise(x, yTerm, bpp);
+    x = _mm_add_ps(x, _mm_set1_ps(4));
+
+    __m128i bias = _mm_sub_epi16(_mm_packs_epi32(low, high), _mm_set1_epi16(BPP_BIAS(bpp)));
+    __m128i positive = _mm_max_epi16(bias, _mm_setzero_si128());
+    __m128i negative = _mm_max_epi16(_mm_sub_epi16(_mm_setzero_si128(), bias), _mm_setzero_si128());
+    _mm_storel_epi64((__m128i *) (add + i), _mm_packus_epi16(positive, positive));
+    _mm_storel_epi64((__m128i *) (sub + i), _mm_packus_epi16(negative, negative));
+  }
+#elif defined(__ARM_NEON)
+  const float32x4_t yTerm = vdupq_n_f32(cy * j);
+  const float xStart[4] = { 0, 1, 2, 3 };
+  float32x4_t x = vld1q_f32(xStart);
+  for (; i + 8 <= width; i += 8) {
+    int32x4_t low = gradientNoise(x, yTerm, bpp);
+    x = vaddq_f32(x, vdupq_n_f32(4));
+    int32x4_t high = gradientNoise(x, yTerm, bpp);
+    x = vaddq_f32(x, vdupq_n_f32(4));
+
+    int16x8_t bias = vsubq_s16(vcombine_s16(vmovn_s32(low), vmovn_s32(high)), vdupq_n_s16(BPP_BIAS(bpp)));
+    vst1_u8(add + i, vqmovun_s16(vmaxq_s16(bias, vdupq_n_s16(0))));
+    vst1_u8(sub + i, vqmovun_s16(vmaxq_s16(vnegq_s16(bias), vdupq_n_s16(0))));
+  }
+#endif
+
+  for (; i < width; i++) {
+    float inner = cx * i + cy * j;
+    float outer = c1 * (inner - (int) inner);
+    uint8_t noise = (uint8_t) ((outer - (int) outer) * BPP_MUL(bpp));
+    splitThreshold(noise, add + i, sub + i, bpp);
+  }
+}
+
+// White noise
+// Every group of four pixels takes its four thresholds from the 32 bits of one hash (lowbias32 by Chris Wellons)
+// of a counter: the group's position in its line plus a key for the line, which is a hash of the line number and
+// of the frame's key. That is made from the noise seed and the number of the video frame (noiseFrame), so the same
+// seed always gives the same noise for a frame, however it is reached. The counters of a line are hashed four at a time
+// with SIMD, with the same results as the scalar code
+
+static uint32_t noiseSeed = 0;  // set by ditherSetup, from noise-seed or at random
+static uint32_t noiseFrame = 0; // number of the video frame that is dithered, set while decoding
+
+static inline uint32_t noiseHash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+// Takes the seed from the configuration, without one every run gets different noise
+static void noiseSetup() {
+  noiseSeed = config.noiseSeed;
+  if (!noiseSeed) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    noiseSeed = noiseHash(now.tv_sec) ^ now.tv_nsec;
+  }
+}
+
+// Key for the lines of the current frame
+static uint32_t noiseFrameKey() {
+  return noiseHash(noiseSeed ^ noiseHash(noiseFrame));
+}
 
-      if(i != width-1)
-        diffuseError(frameBuf, idx + 1, quantError, 7, 16);
+static inline uint32_t noiseLineKey(uint32_t frameKey, uint32_t j) {
+  return noiseHash(frameKey + j * 0x9e3779b9U);
+}
+
+#if defined(__SSE2__)
+// Multiplies four 32 bit values by a constant, keeping the low 32 bits like the scalar multiply (SSE2 has no pmulld)
+static inline __attribute__((always_inline)) __m128i mulConstant32(__m128i a, uint32_t c) {
+  const __m128i factor = _mm_set1_epi32(c);
+  __m128i even = _mm_mul_epu32(a, factor);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), factor);
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __attribute__((always_inline)) __m128i noiseHash4(__m128i x) {
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+  x = mulConstant32(x, 0x7feb352dU);
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+  x = mulConstant32(x, 0x846ca68bU);
+  return _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+}
+
+// Scales eight random bytes to thresholds, BPP_MUL(bpp) * 255 fits into 16 bits
+static inline __attribute__((always_inline)) __m128i noiseWords(__m128i bytes, const int bpp) {
+  __m128i scaled = _mm_srli_epi16(_mm_mullo_epi16(bytes, _mm_set1_epi16(BPP_MUL(bpp))), 8);
+  return _mm_sub_epi16(scaled, _mm_set1_epi16(BPP_BIAS(bpp)));
+}
+#elif defined(__ARM_NEON)
+static inline __attribute__((always_inline)) uint32x4_t noiseHash4(uint32x4_t x) {
+  x = veorq_u32(x, vshrq_n_u32(x, 16));
+  x = vmulq_n_u32(x, 0x7feb352dU);
+  x = veorq_u32(x, vshrq_n_u32(x, 15));
+  x = vmulq_n_u32(x, 0x846ca68bU);
+  return veorq_u32(x, vshrq_n_u32(x, 16));
+}
 
-      if(j != height-1) {
-        diffuseError(frameBuf, idx + linesize, quantError, 5, 16);
+static inline __attribute__((always_inline)) int16x8_t noiseWords(uint8x8_t bytes, const int bpp) {
+  uint16x8_t scaled = vshrq_n_u16(vmulq_n_u16(vmovl_u8(bytes), BPP_MUL(bpp)), 8);
+  return vsubq_s16(vreinterpretq_s16_u16(scaled), vdupq_n_s16(BPP_BIAS(bpp)));
+}
+#endif
+
+// Adds white noise to line j and quantizes it, without going through a threshold buffer like the other ordered dithers
+static inline __attribute__((always_inline)) void whiteNoiseLine(uint32_t frameKey, uint32_t j, unsigned char *line, int width, const int bpp) {
+  const uint32_t lineKey = noiseLineKey(frameKey, j);
+  int i = 0, b;
+
+#if defined(__SSE2__)
+  __m128i counter = _mm_add_epi32(_mm_set1_epi32(lineKey), _mm_setr_epi32(0, 1, 2, 3));
+  for (; i + 16 <= width; i += 16) {
+    __m128i bytes = noiseHash4(counter);
+    counter = _mm_add_epi32(counter, _mm_set1_epi32(4));
+
+    __m128i low = noiseWords(_mm_unpacklo_epi8(bytes, _mm_setzero_si128()), bpp);
+    __m128i high = noiseWords(_mm_unpackhi_epi8(bytes, _mm_setzero_si128()), bpp);
+    __m128i positive = _mm_packus_epi16(_mm_max_epi16(low, _mm_setzero_si128()), _mm_max_epi16(high, _mm_setzero_si128()));
+    __m128i negative = _mm_packus_epi16(_mm_max_epi16(_mm_sub_epi16(_mm_setzero_si128(), low), _mm_setzero_si128()),
+      _mm_max_epi16(_mm_sub_epi16(_mm_setzero_si128(), high), _mm_setzero_si128()));
+
+    __m128i v = _mm_loadu_si128((const __m128i *) (line + i));
+    v = _mm_subs_epu8(_mm_adds_epu8(v, positive), negative);
+    _mm_storeu_si128((__m128i *) (line + i), quantizeBytes(v, bpp));
+  }
+#elif defined(__ARM_NEON)
+  const uint32_t lanes[4] = { 0, 1, 2, 3 };
+  uint32x4_t counter = vaddq_u32(vdupq_n_u32(lineKey), vld1q_u32(lanes));
+  for (; i + 16 <= width; i += 16) {
+    uint8x16_t bytes = vreinterpretq_u8_u32(noiseHash4(counter));
+    counter = vaddq_u32(counter, vdupq_n_u32(4));
+
+    int16x8_t low = noiseWords(vget_low_u8(bytes), bpp);
+    int16x8_t high = noiseWords(vget_high_u8(bytes), bpp);
+    uint8x16_t positive = vcombine_u8(vqmovun_s16(vmaxq_s16(low, vdupq_n_s16(0))), vqmovun_s16(vmaxq_s16(high, vdupq_n_s16(0))));
+    uint8x16_t negative = vcombine_u8(vqmovun_s16(vmaxq_s16(vnegq_s16(low), vdupq_n_s16(0))),
+      vqmovun_s16(vmaxq_s16(vnegq_s16(high), vdupq_n_s16(0))));
+
+    uint8x16_t v = vqsubq_u8(vqaddq_u8(vld1q_u8(line + i), positive), negative);
+    vst1q_u8(line + i, quantizeBytes(v, bpp));
+  }
+#endif
 
-        if(i != width-1)
-          diffuseError(frameBuf, idx + linesize + 1, quantError, 1, 16);
-        if(i != 0)
-          diffuseError(frameBuf, idx + linesize - 1, quantError, 3, 16);
-      }
+  for (; i < width; i += 4) {
+    uint32_t bits = noiseHash(lineKey + i / 4);
+    for (b = 0; b < 4 && i + b < width; b++, bits >>= 8) {
+      int value = line[i + b] + (int) (((bits & 0xff) * BPP_MUL(bpp)) >> 8) - BPP_BIAS(bpp);
+      line[i + b] = paletteLut[value < 0 ? 0 : (value > 255 ? 255 : value)];
     }
+  }
+}
+
+static inline __attribute__((always_inline)) void interleavedGradientBpp(
+  const unsigned char *frameBuf,
+  int linesize,
+  int width,
+  int height,
+  uint8_t *packed,
+  const int bpp
+) {
+  static MemoryBuffer thresholdBuffer = MEMORY_BUFFER("dither thresholds");
+  uint8_t *thresholds = memoryFit(&thresholdBuffer, 2 * width * sizeof(uint8_t));
+  uint32_t j;
+
+  initDitherLuts();
+
+  for (j = 0; j < height; j++) {
+    unsigned char *line = readLine(frameBuf, linesize, width, j);
+    gradientNoiseRow(j, width, thresholds, thresholds + width, bpp);
+    ditherRowOrdered(line, thresholds, thresholds + width, width, bpp);
+    packLine(line, width, j, packed);
+  }
+}
 
-    j++;
-    if(j == height)
-      continue;
+// Blue noise
+// The mask is generated by bluenoise.c while building vsmp and tiles seamlessly, so its size being a power of two
+// lets pixels find their threshold with a mask instead of a modulo. With blue-noise-offset, every frame uses it
+// from a different place, taken from a hash of the frame number so a frame always looks the same
 
-    for(i = width; i > 0; i--) {
-      idx = j * linesize + i - 1;
-      quantError = quantizePixel(frameBuf, idx); // For cool glitch, quantize everything to 0 here
+#include "bluenoise.h"
 
-      if(i != 0)
-        diffuseError(frameBuf, idx - 1, quantError, 7, 16);
+#if BLUE_NOISE_MASK_SIZE != BLUE_NOISE_SIZE
+  #error "bluenoise.h is for another BLUE_NOISE_SIZE, run make to generate it again"
+#endif
 
-      if(j != height-1) {
-        diffuseError(frameBuf, idx + linesize, quantError, 5, 16);
+#define BLUE_NOISE_MASK (BLUE_NOISE_SIZE - 1)
 
-        if(i != 0)
-          diffuseError(frameBuf, idx + linesize - 1, quantError, 1, 16);
-        if(i != width - 1)
-          diffuseError(frameBuf, idx + linesize + 1, quantError, 3, 16);
-      }
+static void blueNoiseOffset(uint32_t *x, uint32_t *y) {
+  uint32_t offset = config.blueNoiseOffset ? noiseHash(noiseFrame + 1) : 0;
+  *x = offset & BLUE_NOISE_MASK;
+  *y = (offset >> 16) & BLUE_NOISE_MASK;
+}
+
+static inline __attribute__((always_inline)) void blueNoiseBpp(
+  const unsigned char *frameBuf,
+  int linesize,
+  int width,
+  int height,
+  uint8_t *packed,
+  const int bpp
+) {
+  // Thresholds for the noise mask, positive parts followed by negative parts
+  static uint8_t thresholds[2 * BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+  static int thresholdBpp = 0;
+  uint32_t i, j, x, y, start, run;
+
+  if (thresholdBpp != bpp) {
+    for (i = 0; i < BLUE_NOISE_SIZE * BLUE_NOISE_SIZE; i++)
+      splitThreshold((((int) blueNoiseMask[i]) * BPP_MUL(bpp)) >> 8, thresholds + i,
+        thresholds + BLUE_NOISE_SIZE * BLUE_NOISE_SIZE + i, bpp);
+    thresholdBpp = bpp;
+  }
+
+  initDitherLuts();
+  blueNoiseOffset(&x, &y);
+
+  for (j = 0; j < height; j++) {
+    unsigned char *line = readLine(frameBuf, linesize, width, j);
+    const uint8_t *add = thresholds + ((j + y) & BLUE_NOISE_MASK) * BLUE_NOISE_SIZE;
+
+    // In runs up to where the mask wraps around
+    for (i = 0; i < width; i += run) {
+      start = (i + x) & BLUE_NOISE_MASK;
+      run = BLUE_NOISE_SIZE - start < width - i ? BLUE_NOISE_SIZE - start : width - i;
+      ditherRowOrdered(line + i, add + start, add + BLUE_NOISE_SIZE * BLUE_NOISE_SIZE + start, run, bpp);
     }
+    packLine(line, width, j, packed);
   }
 }
 
-static void interleavedGradient(unsigned char *frameBuf, int linesize, int width, int height) {
-  const float c1 = 52.9829189;
-  const float cx = 0.06711056;
-  const float cy = 0.00583715;
+// Per-pixel reference implementations of the ordered dithers above and whiteNoise
+static void interleavedGradientReference(unsigned char *frameBuf, int linesize, int width, int height) {
+  const int bpp = config.bitsPerPixel;
+  const float c1 = GRADIENT_C1;
+  const float cx = GRADIENT_CX;
+  const float cy = GRADIENT_CY;
   uint32_t i,j,idx;
   uint8_t noise;
   float inner, outer;
@@ -124,210 +677,270 @@ static void interleavedGradient(unsigned char *frameBuf, int linesize, int width
       idx = j * linesize + i;
       inner = cx * i + cy * j;
       outer = c1 * (inner - (int) inner);
-      noise = (uint8_t) ((outer - (int) outer) * BPP_MUL);
+      noise = (uint8_t) ((outer - (int) outer) * BPP_MUL(bpp));
 
-      frameBuf[idx] = clippedAdd(frameBuf[idx], noise - BPP_BIAS);
+      frameBuf[idx] = clippedAdd(frameBuf[idx], noise - BPP_BIAS(bpp));
       quantizePixel(frameBuf, idx);
     }
   }
 }
 
-static void blueNoise(unsigned char *frameBuf, int linesize, int width, int height) {
-  static uint8_t initialized = 0;
-  static uint8_t *noiseBuf;
-  // uhh pretty sure that's not how you're supposed to do things
-  // allocating memory that's never freed? I'm sure it'll be fine...
-  if(!initialized) {
-    noiseBuf = loadNoise();
-    initialized = 1;
-  }
-
-  uint32_t i,j,idx,noiseidx;
+static void blueNoiseReference(unsigned char *frameBuf, int linesize, int width, int height) {
+  const int bpp = config.bitsPerPixel;
+  uint32_t i,j,idx,noiseidx,x,y;
   uint8_t noise;
 
+  blueNoiseOffset(&x, &y);
+
   for(j = 0; j < height; j++) {
     for(i = 0; i < width; i++) {
       idx = j * linesize + i;
-      noiseidx = (j % 128) * 128 + (i % 128);
+      noiseidx = ((j + y) & BLUE_NOISE_MASK) * BLUE_NOISE_SIZE + ((i + x) & BLUE_NOISE_MASK);
       
-      noise = (((int) noiseBuf[noiseidx]) * BPP_MUL) >> 8;
-      frameBuf[idx] = clippedAdd(frameBuf[idx], noise - BPP_BIAS);
+      noise = (((int) blueNoiseMask[noiseidx]) * BPP_MUL(bpp)) >> 8;
+      frameBuf[idx] = clippedAdd(frameBuf[idx], noise - BPP_BIAS(bpp));
       quantizePixel(frameBuf, idx);
     }
   }
 }
 
-static void whiteNoise(unsigned char *frameBuf, int linesize, int width, int height) {
+static void whiteNoiseReference(unsigned char *frameBuf, int linesize, int width, int height) {
+  const int bpp = config.bitsPerPixel;
+  const uint32_t frameKey = noiseFrameKey();
   uint32_t i,j,idx;
   uint8_t noise;
 
-  int8_t *randomMask = (int8_t *) malloc(width * height * sizeof(int8_t));
-  FILE *devRandom = fopen("/dev/urandom", "r");  
-
-  fread(randomMask, sizeof(int8_t), width * height, devRandom);
-  fclose(devRandom);
-  
-    
   for(j = 0; j < height; j++) {
     for(i = 0; i < width; i++) {
       idx = j * linesize + i;
-      noise = (((int) randomMask[j * width + i]) * BPP_MUL) >> 8;
-      frameBuf[idx] = clippedAdd(frameBuf[idx], noise - BPP_BIAS);
+      noise = (((noiseHash(noiseLineKey(frameKey, j) + i / 4) >> (8 * (i % 4))) & 0xff) * BPP_MUL(bpp)) >> 8;
+      frameBuf[idx] = clippedAdd(frameBuf[idx], noise - BPP_BIAS(bpp));
       quantizePixel(frameBuf, idx);
     }
   }
+}
 
-  free(randomMask);
+static inline __attribute__((always_inline)) void whiteNoiseBpp(
+  const unsigned char *frameBuf,
+  int linesize,
+  int width,
+  int height,
+  uint8_t *packed,
+  const int bpp
+) {
+  const uint32_t frameKey = noiseFrameKey();
+  uint32_t j;
+
+  initDitherLuts();
+
+  for (j = 0; j < height; j++) {
+    unsigned char *line = readLine(frameBuf, linesize, width, j);
+    whiteNoiseLine(frameKey, j, line, width, bpp);
+    packLine(line, width, j, packed);
+  }
 }
 
-static void atkinson(unsigned char *frameBuf, int linesize, int width, int height) {
-  uint32_t i,j,idx;
-  int8_t quantError;
-    
-  for(j = 0; j < height; j++) {
-    for(i = 0; i < width; i++) {
-      idx = j * linesize + i;
-      quantError = quantizePixel(frameBuf, idx);
-
-      // Same row diffusion
-      if(i != width-1)
-        diffuseError(frameBuf, idx+1, quantError, 1, 8);
-      if(i < width-2)
-        diffuseError(frameBuf, idx+2, quantError, 1, 8);
-
-      if(j == height-1)
-        continue;
-
-      // Next row diffusion      
-      diffuseError(frameBuf, idx + linesize, quantError, 1, 8);
-      if(i != 0)
-        diffuseError(frameBuf, idx + linesize - 1, quantError, 1, 8);
-      if(i != width-1)
-        diffuseError(frameBuf, idx + linesize + 1, quantError, 1, 8);
-
-      // Third row diffusion
-      if(j != height-2)
-        diffuseError(frameBuf, idx + linesize * 2, quantError, 1, 8);
-    }
+// Defines name1 to name8, the dither nameBpp specialized for every bpp
+#define DITHER_BPP(name, bpp) \
+  static void name##bpp(const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *packed) { \
+    name##Bpp(frameBuf, linesize, width, height, packed, bpp); \
+  }
+#define DITHER_PER_BPP(name) \
+  DITHER_BPP(name, 1) DITHER_BPP(name, 2) DITHER_BPP(name, 3) DITHER_BPP(name, 4) \
+  DITHER_BPP(name, 5) DITHER_BPP(name, 6) DITHER_BPP(name, 7) DITHER_BPP(name, 8)
+
+DITHER_PER_BPP(interleavedGradient)
+DITHER_PER_BPP(blueNoise)
+DITHER_PER_BPP(whiteNoise)
+
+// Atkinson dithering, only diffuses 6/8 of the error
+//        X   1   1
+//    1   1   1
+//        1         (1/8)
+static const DiffusionTap atkinsonTaps[] = {
+  { 1, 0, 1 }, { 2, 0, 1 },
+  { -1, 1, 1 }, { 0, 1, 1 }, { 1, 1, 1 },
+  { 0, 2, 1 }
+};
+DIFFUSION_DITHER(atkinson, atkinsonTaps, 8, 0)
+
+//            X   5   3
+//    2   4   5   4   2
+//        2   3   2       (1/32)
+static const DiffusionTap fullSierraTaps[] = {
+  { 1, 0, 5 }, { 2, 0, 3 },
+  { -2, 1, 2 }, { -1, 1, 4 }, { 0, 1, 5 }, { 1, 1, 4 }, { 2, 1, 2 },
+  { -1, 2, 2 }, { 0, 2, 3 }, { 1, 2, 2 }
+};
+DIFFUSION_DITHER(fullSierra, fullSierraTaps, 32, 0)
+
+//            X   4   3
+//    1   2   3   2   1   (1/16)
+static const DiffusionTap twoRowSierraTaps[] = {
+  { 1, 0, 4 }, { 2, 0, 3 },
+  { -2, 1, 1 }, { -1, 1, 2 }, { 0, 1, 3 }, { 1, 1, 2 }, { 2, 1, 1 }
+};
+DIFFUSION_DITHER(twoRowSierra, twoRowSierraTaps, 16, 0)
+
+//            X   8   4
+//    2   4   8   4   2
+//    1   2   4   2   1   (1/42)
+// 42 is no power of two, so its reciprocal is slightly rounded
+static const DiffusionTap stuckiTaps[] = {
+  { 1, 0, 8 }, { 2, 0, 4 },
+  { -2, 1, 2 }, { -1, 1, 4 }, { 0, 1, 8 }, { 1, 1, 4 }, { 2, 1, 2 },
+  { -2, 2, 1 }, { -1, 2, 2 }, { 0, 2, 4 }, { 1, 2, 2 }, { 2, 2, 1 }
+};
+DIFFUSION_DITHER(stucki, stuckiTaps, 42, 0)
+
+typedef void (*DitherFunction)(const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *packed);
+
+// All dithering algorithms by name, with their function for every bpp from 1 to 8
+// Error diffusion only depends on the bpp through paletteLut, so all bpp share one function
+typedef struct {
+  const char *name;
+  DitherFunction perBpp[8];
+  int seeded; // output depends on the noise seed
+} DitherAlgorithm;
+
+#define ANY_BPP(name) { name, name, name, name, name, name, name, name }
+#define PER_BPP(name) { name##1, name##2, name##3, name##4, name##5, name##6, name##7, name##8 }
+
+static const DitherAlgorithm ditherAlgorithms[] = {
+  { "floydSteinberg", ANY_BPP(floydSteinberg), 0 },
+  { "floydSteinbergSerpentine", ANY_BPP(floydSteinbergSerpentine), 0 },
+  { "interleavedGradient", PER_BPP(interleavedGradient), 0 },
+  { "blueNoise", PER_BPP(blueNoise), 0 },
+  { "whiteNoise", PER_BPP(whiteNoise), 1 },
+  { "fullSierra", ANY_BPP(fullSierra), 0 },
+  { "twoRowSierra", ANY_BPP(twoRowSierra), 0 },
+  { "stucki", ANY_BPP(stucki), 0 },
+  { "atkinson", ANY_BPP(atkinson), 0 }
+};
+
+#define DITHER_ALGORITHM_COUNT (sizeof(ditherAlgorithms) / sizeof(DitherAlgorithm))
+
+// Dithers a frame with the configured algorithm and bpp, set by ditherSetup
+static DitherFunction ditherFrame = NULL;
+
+// Returns the function of the named algorithm for the given bpp, NULL if there is no such algorithm
+static DitherFunction findDither(const char *name, int bpp) {
+  for (int a = 0; a < DITHER_ALGORITHM_COUNT; a++) {
+    if (strcmp(ditherAlgorithms[a].name, name) == 0)
+      return ditherAlgorithms[a].perBpp[bpp - 1];
   }
+  return NULL;
 }
 
-static void fullSierra(unsigned char *frameBuf, int linesize, int width, int height) {
-  uint32_t i,j,idx;
-  int8_t quantError;
-    
-  for(j = 0; j < height; j++) {
-    for(i = 0; i < width; i++) {
-      idx = j * linesize + i;
-      quantError = quantizePixel(frameBuf, idx);
-
-      // Same row diffusion
-      if(i != width-1)
-        diffuseError(frameBuf, idx+1, quantError, 5, 32);
-      if(i < width-2)
-        diffuseError(frameBuf, idx+2, quantError, 3, 32);
-
-      if(j == height-1)
-        continue;
-
-      // Next row diffusion      
-      diffuseError(frameBuf, idx + linesize, quantError, 5, 32);
-      if(i != 0)
-        diffuseError(frameBuf, idx + linesize - 1, quantError, 4, 32);
-      if(i > 1)
-        diffuseError(frameBuf, idx + linesize - 2, quantError, 2, 32);
-      if(i != width-1)
-        diffuseError(frameBuf, idx + linesize + 1, quantError, 4, 32);
-      if(i < width-2)
-        diffuseError(frameBuf, idx + linesize + 2, quantError, 2, 32);
-
-      if(j == height-2)
-        continue;
-
-      // Third row diffusion
-      diffuseError(frameBuf, idx + linesize * 2, quantError, 3, 32);
-      if(i != 0)
-        diffuseError(frameBuf, idx + linesize * 2 - 1, quantError, 2, 32);
-      if(i != width-1)
-        diffuseError(frameBuf, idx + linesize * 2 + 1, quantError, 2, 32);
-    }
+// Picks the dithering function for the configuration, returns -1 if the algorithm doesn't exist
+static int ditherSetup() {
+  ditherFrame = findDither(config.dither, config.bitsPerPixel);
+  if (!ditherFrame) {
+    printf("Unknown dithering algorithm %s, choose one of:", config.dither);
+    for (int a = 0; a < DITHER_ALGORITHM_COUNT; a++)
+      printf(" %s", ditherAlgorithms[a].name);
+    printf("\n");
+    return -1;
   }
+
+  if (toneInit())
+    return -1;
+
+  noiseSetup();
+
+  printf("Dithering with %s at %d bpp, transport %d bpp, white value %d\n", config.dither, config.bitsPerPixel,
+    config.transportBpp, config.whiteValue);
+  if (config.blackValue || config.gamma != 100 || config.sCurve || config.autoLevels)
+    printf("Tone curve: black value %d, gamma %.2f, S-curve %d%%%s\n", config.blackValue, config.gamma / 100.0, config.sCurve,
+      config.autoLevels ? ", black and white value from every frame (auto-levels)" : "");
+  return 0;
 }
 
-static void twoRowSierra(unsigned char *frameBuf, int linesize, int width, int height) {
-  uint32_t i,j,idx;
-  int8_t quantError;
-    
-  for(j = 0; j < height; j++) {
-    for(i = 0; i < width; i++) {
-      idx = j * linesize + i;
-      quantError = quantizePixel(frameBuf, idx);
-
-      // Same row diffusion
-      if(i != width-1)
-        diffuseError(frameBuf, idx+1, quantError, 4, 16);
-      if(i < width-2)
-        diffuseError(frameBuf, idx+2, quantError, 3, 16);
-
-      if(j == height-1)
-        continue;
-
-      // Next row diffusion      
-      diffuseError(frameBuf, idx + linesize, quantError, 3, 16);
-      if(i != 0)
-        diffuseError(frameBuf, idx + linesize - 1, quantError, 2, 16);
-      if(i > 1)
-        diffuseError(frameBuf, idx + linesize - 2, quantError, 1, 16);
-      if(i != width-1)
-        diffuseError(frameBuf, idx + linesize + 1, quantError, 2, 16);
-      if(i < width-2)
-        diffuseError(frameBuf, idx + linesize + 2, quantError, 1, 16);
+// Dithers the frame with the given number of threads and returns the time it took in ms
+static double timedDither(DitherFunction dither, int threads,
+  const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *packed) {
+  struct timespec start;
+  int previousThreads = ditherThreads;
+
+  ditherThreads = threads;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  dither(frameBuf, linesize, width, height, packed);
+  double ms = msSince(&start);
+  ditherThreads = previousThreads;
+
+  return ms;
+}
+
+// Checks that the vectorized ordered dithers match their reference implementations and that the
+// wavefront-parallel error diffusion matches the serial version, run with `vsmp --dither-selftest`
+// Uses a random frame of roughly panel size, with a width that exercises the scalar tails of every loop
+// The reference runs on a contrast adjusted copy of the frame which is packed afterwards,
+// so this covers the complete streaming pipeline
+// Returns the number of mismatching algorithms
+static int ditherSelftest() {
+  const int width = 1875, height = 1404, linesize = 1920;
+  const char *names[] = { "interleavedGradient", "blueNoise", "whiteNoise" };
+  void (*reference[])(unsigned char*, int, int, int) = { interleavedGradientReference, blueNoiseReference, whiteNoiseReference };
+  const char *diffusionNames[] = { "floydSteinberg", "atkinson", "fullSierra", "twoRowSierra", "stucki" };
+  uint32_t packedSize = packedFrameSize(width, height);
+  int a, i, t, failures = 0;
+
+  unsigned char *source = malloc(linesize * height);
+  unsigned char *adjusted = malloc(linesize * height);
+  uint8_t *expected = calloc(packedSize, 1);
+  uint8_t *actual = calloc(packedSize, 1);
+
+  initDitherLuts();
+  srand(1);
+  for (i = 0; i < linesize * height; i++)
+    source[i] = rand() & 0xff;
+
+  printf("Ordered dithering uses %s at %d bpp\n", ORDERED_SIMD, config.bitsPerPixel);
+
+  for (a = 0; a < 3; a++) {
+    for (i = 0; i < linesize * height; i++)
+      adjusted[i] = contrastLut[source[i]];
+    reference[a](adjusted, linesize, width, height);
+    packFrame(adjusted, linesize, width, height, expected);
+    findDither(names[a], config.bitsPerPixel)(source, linesize, width, height, actual);
+
+    int mismatches = 0;
+    for (i = 0; i < packedSize; i++)
+      mismatches += expected[i] != actual[i];
+
+    if (mismatches) {
+      printf("%s: %d packed bytes differ\n", names[a], mismatches);
+      failures++;
     }
+    else
+      printf("%s: identical\n", names[a]);
   }
-}
 
-static void stucki(unsigned char *frameBuf, int linesize, int width, int height) {
-  uint32_t i,j,idx;
-  int8_t quantError;
-    
-  for(j = 0; j < height; j++) {
-    for(i = 0; i < width; i++) {
-      idx = j * linesize + i;
-      quantError = quantizePixel(frameBuf, idx);
-
-      // Same row diffusion
-      if(i != width-1)
-        diffuseError(frameBuf, idx+1, quantError, 8, 42);
-      if(i < width-2)
-        diffuseError(frameBuf, idx+2, quantError, 4, 42);
-
-      if(j == height-1)
-        continue;
-
-      // Next row diffusion      
-      diffuseError(frameBuf, idx + linesize, quantError, 8, 42);
-      if(i != 0)
-        diffuseError(frameBuf, idx + linesize - 1, quantError, 4, 42);
-      if(i > 1)
-        diffuseError(frameBuf, idx + linesize - 2, quantError, 2, 42);
-      if(i != width-1)
-        diffuseError(frameBuf, idx + linesize + 1, quantError, 4, 42);
-      if(i < width-2)
-        diffuseError(frameBuf, idx + linesize + 2, quantError, 2, 42);
-
-      if(j == height-2)
-        continue;
-
-      // Third row diffusion
-      diffuseError(frameBuf, idx + linesize * 2, quantError, 4, 42);
-      if(i != 0)
-        diffuseError(frameBuf, idx + linesize * 2 - 1, quantError, 2, 42);
-      if(i > 1)
-        diffuseError(frameBuf, idx + linesize * 2 - 2, quantError, 1, 42);
-      if(i != width-1)
-        diffuseError(frameBuf, idx + linesize * 2 + 1, quantError, 2, 42);
-      if(i < width-2)
-        diffuseError(frameBuf, idx + linesize * 2 + 2, quantError, 1, 42);
+  printf("Wavefront error diffusion, %dx%d, time per frame with 1 to 4 threads:\n", width, height);
+
+  for (a = 0; a < 5; a++) {
+    DitherFunction diffusion = findDither(diffusionNames[a], config.bitsPerPixel);
+    int mismatches = 0;
+
+    printf("%s:", diffusionNames[a]);
+    printf(" %.0f ms", timedDither(diffusion, 1, source, linesize, width, height, expected));
+    for (t = 2; t <= 4; t++) {
+      printf(" %.0f ms", timedDither(diffusion, t, source, linesize, width, height, actual));
+      for (i = 0; i < packedSize; i++)
+        mismatches += expected[i] != actual[i];
     }
+
+    if (mismatches) {
+      printf(", %d packed bytes differ\n", mismatches);
+      failures++;
+    }
+    else
+      printf(", identical\n");
   }
-}
\ No newline at end of file
+
+  free(source);
+  free(adjusted);
+  free(expected);
+  free(actual);
+  return failures;
+}
@@ -0,0 +1,185 @@
+// bcm2835 library stand-in with an emulated IT8951 on the SPI bus, built by `make emu`
+// Lets the real display driver (displays/IT8951.c and genericIT8951.c) run on any Linux machine, e.g. to
+// profile or regression test changes to the transfer without a Pi and a display. See controller.c for the controller
+//
+// SPI transfers take as long as they would on a Pi with a 250 MHz core clock at the configured clock divider,
+// refreshes as long as on a real panel, and HRDY goes low while the controller is busy with a command
+// The emulator is set up with environment variables:
+//   VSMP_EMU_PANEL   panel size, default 1872x1404
+//   VSMP_EMU_MEMORY  controller memory in bytes, default 0x800000
+//   VSMP_EMU_LUT     waveform LUT version reported by the controller, default M641
+//   VSMP_EMU_SPEED   factor for all modelled delays, default 1, 0 to not wait at all
+//   VSMP_EMU_OUTPUT  panel images are written to [this]-[refresh].pgm, default panel, empty for none
+//   VSMP_EMU_STRICT  set to 1 to exit with status 2 on the first error, e.g. on CI
+
+#include <bcm2835.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "controller.c"
+
+#define EMU_CORE_CLOCK 250000000.0
+#define EMU_MIN_SLEEP_MS 0.5 // shorter delays are collected until they add up to this
+
+// The driver is used from the main and the prefetch thread, like the real library every call is atomic
+static pthread_mutex_t emuLock = PTHREAD_MUTEX_INITIALIZER;
+static double emuOwed = 0; // modelled time that hasn't been waited for yet
+
+static void emuWait(double ms) {
+  emuOwed += ms * emu.speed;
+  if (emuOwed < EMU_MIN_SLEEP_MS)
+    return;
+
+  struct timespec pause = { emuOwed / 1000, ((long) (emuOwed * 1000000)) % 1000000000 };
+  nanosleep(&pause, NULL);
+  emuOwed = 0;
+}
+
+static const char *emuSetting(const char *name, const char *fallback) {
+  const char *value = getenv(name);
+  return value ? value : fallback;
+}
+
+int bcm2835_init(void) {
+  pthread_mutex_lock(&emuLock);
+  if (sscanf(emuSetting("VSMP_EMU_PANEL", "1872x1404"), "%dx%d", &emu.width, &emu.height) != 2
+    || emu.width < 1 || emu.height < 1 || emu.width > 0xffff || emu.height > 0xffff) {
+    printf("IT8951 emulator: VSMP_EMU_PANEL should be [width]x[height]\n");
+    pthread_mutex_unlock(&emuLock);
+    return 0;
+  }
+  emu.memorySize = strtoul(emuSetting("VSMP_EMU_MEMORY", "0x800000"), NULL, 0);
+  snprintf(emu.lut, sizeof(emu.lut), "%s", emuSetting("VSMP_EMU_LUT", "M641"));
+  emu.speed = atof(emuSetting("VSMP_EMU_SPEED", "1"));
+  emu.output = emuSetting("VSMP_EMU_OUTPUT", "panel");
+  emu.strict = atoi(emuSetting("VSMP_EMU_STRICT", "0"));
+
+  if (emu.memorySize < EMU_IMAGE_BUFFER + (uint64_t) emu.width * emu.height) {
+    printf("IT8951 emulator: VSMP_EMU_MEMORY is too small for the image buffer of a %dx%d panel\n", emu.width, emu.height);
+    pthread_mutex_unlock(&emuLock);
+    return 0;
+  }
+
+  free(emu.memory);
+  free(emu.panel);
+  emu.memory = calloc(emu.memorySize, 1);
+  emu.panel = malloc(emu.width * emu.height);
+  memset(emu.panel, 255, emu.width * emu.height);
+  emu.divider = 65535;
+  emu.cs = HIGH;
+  emuReset();
+
+  printf("IT8951 emulator: %dx%d panel, %u bytes of memory, LUT %s, delays x%g\n",
+    emu.width, emu.height, emu.memorySize, emu.lut, emu.speed);
+  pthread_mutex_unlock(&emuLock);
+  return 1;
+}
+
+int bcm2835_close(void) {
+  pthread_mutex_lock(&emuLock);
+  emuSettle(1);
+  printf("IT8951 emulator: %d refresh(es), %u transactions, %llu bytes, %.1f ms of SPI time, %u error(s)\n",
+    emu.refreshes, emu.total.transactions, (unsigned long long) emu.total.bytes, emu.total.spiMs, emu.errors);
+  pthread_mutex_unlock(&emuLock);
+  return 1;
+}
+
+void bcm2835_delay(unsigned int millis) {
+  struct timespec pause = { 0, 0 };
+  double ms = millis * emu.speed;
+
+  pause.tv_sec = ms / 1000;
+  pause.tv_nsec = ((long) (ms * 1000000)) % 1000000000;
+  nanosleep(&pause, NULL);
+}
+
+void bcm2835_gpio_fsel(uint8_t pin, uint8_t mode) {}
+void bcm2835_gpio_set_pud(uint8_t pin, uint8_t pud) {}
+
+void bcm2835_gpio_write(uint8_t pin, uint8_t on) {
+  pthread_mutex_lock(&emuLock);
+  emuSettle(0);
+
+  if (pin == EMU_PIN_CS && on != emu.cs) {
+    if (on == HIGH && !pthread_equal(emu.owner, pthread_self()))
+      emuError("CS raised by a different thread than the one that lowered it");
+    emu.cs = on;
+    emu.owner = pthread_self();
+    emuChipSelect(on == LOW);
+  } else if (pin == EMU_PIN_RESET && on == HIGH) {
+    emuReset();
+  }
+
+  pthread_mutex_unlock(&emuLock);
+}
+
+void bcm2835_gpio_clr(uint8_t pin) {
+  bcm2835_gpio_write(pin, LOW);
+}
+
+// HRDY follows the controller, anything else (i.e. the light sensor) always reads high
+uint8_t bcm2835_gpio_lev(uint8_t pin) {
+  uint8_t level = HIGH;
+
+  pthread_mutex_lock(&emuLock);
+  if (pin == EMU_PIN_HRDY)
+    level = emuHrdy(emuNow()) ? HIGH : LOW;
+  pthread_mutex_unlock(&emuLock);
+  return level;
+}
+
+int bcm2835_spi_begin(void) { return 1; }
+void bcm2835_spi_end(void) {}
+void bcm2835_spi_setBitOrder(uint8_t order) {}
+void bcm2835_spi_setDataMode(uint8_t mode) {}
+
+void bcm2835_spi_setClockDivider(uint16_t divider) {
+  pthread_mutex_lock(&emuLock);
+  emu.divider = divider ? divider : 65535; // 0 stands for 65536, close enough
+  pthread_mutex_unlock(&emuLock);
+}
+
+void bcm2835_spi_transfernb(char *tbuf, char *rbuf, uint32_t len) {
+  double now = emuNow();
+  uint32_t i;
+
+  pthread_mutex_lock(&emuLock);
+  emuSettle(0);
+
+  if (emu.cs == LOW && !pthread_equal(emu.owner, pthread_self()))
+    emuError("SPI transfer from a different thread while CS is low");
+
+  for (i = 0; i < len; i++) {
+    uint8_t out = emuTransfer(tbuf ? tbuf[i] : 0, now);
+    if (rbuf)
+      rbuf[i] = out;
+  }
+
+  double ms = len * 8.0 * emu.divider / EMU_CORE_CLOCK * 1000.0;
+  emu.traffic.bytes += len;
+  emu.traffic.spiMs += ms;
+  emu.total.bytes += len;
+  emu.total.spiMs += ms;
+  emuWait(ms);
+  pthread_mutex_unlock(&emuLock);
+}
+
+void bcm2835_spi_transfern(char *buf, uint32_t len) {
+  bcm2835_spi_transfernb(buf, buf, len);
+}
+
+void bcm2835_spi_writenb(const char *buf, uint32_t len) {
+  bcm2835_spi_transfernb((char *) buf, NULL, len);
+}
+
+uint8_t bcm2835_spi_transfer(uint8_t value) {
+  char in = value, out;
+  bcm2835_spi_transfernb(&in, &out, 1);
+  return out;
+}
@@ -0,0 +1,53 @@
+// Stand-in for the bcm2835 library header, used by `make emu`
+// Declares the part of the bcm2835 API vsmp uses, with the same signatures and constants as the real library.
+// SPI and GPIO calls go to the IT8951 emulator in bcm2835.c instead of the hardware
+
+#ifndef BCM2835_H
+#define BCM2835_H
+
+#include <stdint.h>
+
+// Lets the display driver know that there is no real HRDY pin to watch
+#define BCM2835_EMULATOR 1
+
+#define LOW  0x0
+#define HIGH 0x1
+
+#define BCM2835_GPIO_FSEL_INPT 0x00
+#define BCM2835_GPIO_FSEL_OUTP 0x01
+
+#define BCM2835_GPIO_PUD_OFF  0x00
+#define BCM2835_GPIO_PUD_DOWN 0x01
+#define BCM2835_GPIO_PUD_UP   0x02
+
+#define BCM2835_SPI_BIT_ORDER_LSBFIRST 0
+#define BCM2835_SPI_BIT_ORDER_MSBFIRST 1
+
+#define BCM2835_SPI_MODE0 0
+#define BCM2835_SPI_MODE1 1
+#define BCM2835_SPI_MODE2 2
+#define BCM2835_SPI_MODE3 3
+
+#define RPI_V2_GPIO_P1_07 4
+
+int bcm2835_init(void);
+int bcm2835_close(void);
+void bcm2835_delay(unsigned int millis);
+
+void bcm2835_gpio_fsel(uint8_t pin, uint8_t mode);
+void bcm2835_gpio_set_pud(uint8_t pin, uint8_t pud);
+void bcm2835_gpio_write(uint8_t pin, uint8_t on);
+void bcm2835_gpio_clr(uint8_t pin);
+uint8_t bcm2835_gpio_lev(uint8_t pin);
+
+int bcm2835_spi_begin(void);
+void bcm2835_spi_end(void);
+void bcm2835_spi_setBitOrder(uint8_t order);
+void bcm2835_spi_setDataMode(uint8_t mode);
+void bcm2835_spi_setClockDivider(uint16_t divider);
+uint8_t bcm2835_spi_transfer(uint8_t value);
+void bcm2835_spi_transfern(char *buf, uint32_t len);
+void bcm2835_spi_transfernb(char *tbuf, char *rbuf, uint32_t len);
+void bcm2835_spi_writenb(const char *buf, uint32_t len);
+
+#endif
@@ -0,0 +1,575 @@
+// IT8951 controller model
+// Decodes what vsmp sends over SPI the way the controller would: preambles, commands and their arguments,
+// register and memory burst accesses, packed pixel data of image loads, and display commands, which update a
+// simulated panel that is written to a PGM file once the refresh is done
+// Anything the real controller would choke on or silently get wrong is reported as an error
+
+// Kept apart from the driver's definitions in displays/IT8951.h, so that mistakes there show up here
+#define EMU_PIN_CS    8
+#define EMU_PIN_HRDY  24
+#define EMU_PIN_RESET 17
+
+#define EMU_CMD_SYS_RUN      0x0001
+#define EMU_CMD_STANDBY      0x0002
+#define EMU_CMD_SLEEP        0x0003
+#define EMU_CMD_REG_RD       0x0010
+#define EMU_CMD_REG_WR       0x0011
+#define EMU_CMD_MEM_BST_RD_T 0x0012
+#define EMU_CMD_MEM_BST_RD_S 0x0013
+#define EMU_CMD_MEM_BST_WR   0x0014
+#define EMU_CMD_MEM_BST_END  0x0015
+#define EMU_CMD_LD_IMG       0x0020
+#define EMU_CMD_LD_IMG_AREA  0x0021
+#define EMU_CMD_LD_IMG_END   0x0022
+#define EMU_CMD_DPY_AREA     0x0034
+#define EMU_CMD_DPY_BUF_AREA 0x0037
+#define EMU_CMD_VCOM         0x0039
+#define EMU_CMD_GET_DEV_INFO 0x0302
+
+#define EMU_REG_I80CPCR 0x0004
+#define EMU_REG_LISAR   0x0208
+#define EMU_REG_LUTAFSR 0x1224
+
+#define EMU_PREAMBLE_CMD   0x6000
+#define EMU_PREAMBLE_WRITE 0x0000
+#define EMU_PREAMBLE_READ  0x1000
+
+#define EMU_FW_VERSION "vsmp emulator"
+#define EMU_IMAGE_BUFFER 0x119f00 // where real controllers put their image buffer
+#define EMU_ERRORS_SHOWN 20       // further errors are only counted
+
+// HRDY goes low for this long while the controller handles a preamble, a command or a word it has to look up
+#define EMU_HRDY_PREAMBLE_US 2
+#define EMU_HRDY_COMMAND_US 20
+#define EMU_HRDY_RESET_MS 10
+
+typedef enum { PHASE_IDLE, PHASE_PREAMBLE, PHASE_COMMAND, PHASE_COMMAND_SENT, PHASE_WRITE, PHASE_READ, PHASE_IGNORE } EmuPhase;
+typedef enum { STATE_RUN, STATE_STANDBY, STATE_SLEEP } EmuState;
+
+// Waveform modes, their numbers depend on the LUT. A2 is mode 4 on M641 LUTs and mode 6 on the others
+typedef struct {
+  const char *name;
+  int levels; // grey levels the waveform can drive pixels to, 0 clears to white
+  double ms;  // duration of a refresh
+} EmuWaveform;
+
+static const EmuWaveform emuWaveforms[] = {
+  { "INIT", 0, 2000 }, { "DU", 2, 260 }, { "GC16", 16, 450 }, { "GL16", 16, 450 },
+  { "GLR16", 16, 450 }, { "GLD16", 16, 450 }, { "A2", 2, 120 }, { "DU4", 4, 290 }
+};
+static const EmuWaveform emuWaveformsM641[] = {
+  { "INIT", 0, 2000 }, { "DU", 2, 260 }, { "GC16", 16, 450 }, { "GL16", 16, 450 }, { "A2", 2, 120 }
+};
+
+typedef struct {
+  uint32_t transactions;
+  uint64_t bytes;
+  double spiMs; // time the transfers take at the configured clock
+} EmuTraffic;
+
+static struct {
+  // Settings, from the VSMP_EMU_* environment variables
+  int width, height;
+  uint32_t memorySize;
+  char lut[17];
+  double speed;
+  const char *output;
+  int strict;
+
+  uint8_t *memory; // one byte per pixel, like the controller's image buffers
+  uint8_t *panel;  // what the panel shows
+  uint16_t regs[0x10000 / 2];
+  uint16_t vcom;
+  EmuState state;
+
+  // Host interface
+  uint16_t divider;
+  int cs;
+  pthread_t owner; // thread that pulled CS low
+  EmuPhase phase;
+  int half;        // number of bytes of the current word received or sent
+  uint16_t word;
+  int dummy;       // dummy bytes left at the start of a read
+  double hrdyUntil;
+
+  // Current command
+  uint16_t command;
+  uint16_t args[8];
+  int argCount, argsNeeded;
+  uint32_t readIndex;
+  uint32_t burstAddr, burstCount;
+  int bursting; // 1 during a burst write, 2 during a burst read
+
+  // Image load
+  int loading; // -1 while the data of a rejected load is discarded
+  int loadBpp, loadEndian;
+  int loadX, loadY, loadW, loadH;
+  int col, row;
+  uint32_t loadAddr;
+
+  // Refreshes
+  double busyUntil;
+  int pending; // set if the panel changed since it was last written out
+  const char *pendingMode; // waveform used for that, "several" if they differ
+  int refreshes;
+  uint32_t areas;
+  uint64_t unreachable; // pixels the waveform couldn't drive to their target
+  EmuTraffic traffic, total;
+  uint32_t errors;
+} emu;
+
+static double emuNow() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+static void emuError(const char *format, ...) {
+  va_list args;
+
+  if (++emu.errors <= EMU_ERRORS_SHOWN) {
+    printf("IT8951 emulator: ERROR ");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    if (emu.errors == EMU_ERRORS_SHOWN)
+      printf("IT8951 emulator: not showing further errors\n");
+  }
+  if (emu.strict) {
+    fflush(stdout);
+    exit(2);
+  }
+}
+
+static void emuHrdyLow(double us) {
+  double until = emuNow() + us / 1000.0 * emu.speed;
+  emu.hrdyUntil = until > emu.hrdyUntil ? until : emu.hrdyUntil;
+}
+
+static int emuHrdy(double now) {
+  return now >= emu.hrdyUntil;
+}
+
+static int emuBusy() {
+  return emuNow() < emu.busyUntil;
+}
+
+static const EmuWaveform *emuWaveform(uint16_t mode) {
+  if (strcmp(emu.lut, "M641") == 0)
+    return mode < sizeof(emuWaveformsM641) / sizeof(EmuWaveform) ? &emuWaveformsM641[mode] : NULL;
+  return mode < sizeof(emuWaveforms) / sizeof(EmuWaveform) ? &emuWaveforms[mode] : NULL;
+}
+
+static uint16_t emuDevInfo(uint32_t index) {
+  char text[16] = { 0 };
+
+  switch (index) {
+    case 0: return emu.width;
+    case 1: return emu.height;
+    case 2: return EMU_IMAGE_BUFFER & 0xffff;
+    case 3: return EMU_IMAGE_BUFFER >> 16;
+  }
+  if (index >= 20)
+    return 0;
+
+  // Strings are stored in memory order, first character in the low byte
+  const char *string = index < 12 ? EMU_FW_VERSION : emu.lut;
+  memcpy(text, string, strnlen(string, sizeof(text)));
+  index = (index - 4) % 8;
+  return text[2 * index] | (text[2 * index + 1] << 8);
+}
+
+// Writes out the panel once all refreshes are done, called before anything the host does
+// The file is written without stdio streams, so the emulator doesn't show up in vsmp's heap allocations
+static void emuSettle(int force) {
+  char filename[1024], header[32];
+  int f;
+
+  if (!emu.pending || (emuBusy() && !force))
+    return;
+
+  filename[0] = 0;
+  if (*emu.output) {
+    snprintf(filename, sizeof(filename), "%s-%d.pgm", emu.output, emu.refreshes);
+    if ((f = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+      write(f, header, snprintf(header, sizeof(header), "P5\n%d %d\n%d\n", emu.width, emu.height, 255));
+      write(f, emu.panel, emu.width * emu.height);
+      close(f);
+    } else {
+      printf("IT8951 emulator: could not write %s\n", filename);
+      filename[0] = 0;
+    }
+  }
+
+  printf("IT8951 emulator: refresh %d (%s, %u area(s)), %u transactions, %llu bytes, %.1f ms of SPI time",
+    emu.refreshes, emu.pendingMode, emu.areas, emu.traffic.transactions,
+    (unsigned long long) emu.traffic.bytes, emu.traffic.spiMs);
+  if (emu.unreachable)
+    printf(", %llu pixel(s) the waveform couldn't show", (unsigned long long) emu.unreachable);
+  printf(filename[0] ? ", wrote %s\n" : "\n", filename);
+
+  emu.refreshes++;
+  emu.pending = 0;
+  emu.areas = 0;
+  emu.unreachable = 0;
+  emu.traffic = (EmuTraffic) { 0 };
+}
+
+static void emuDisplay(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t mode, uint32_t addr) {
+  const EmuWaveform *waveform = emuWaveform(mode);
+  int i, j;
+
+  if (!waveform) {
+    emuError("display command with unknown waveform mode %d (LUT %s)", mode, emu.lut);
+    return;
+  }
+  if (!w || !h || x + w > emu.width || y + h > emu.height) {
+    emuError("display area %dx%d at %d,%d is outside the %dx%d panel", w, h, x, y, emu.width, emu.height);
+    return;
+  }
+  if ((uint64_t) addr + emu.width * emu.height > emu.memorySize) {
+    emuError("display buffer at 0x%x is outside the controller's memory", addr);
+    return;
+  }
+
+  for (j = y; j < y + h; j++) {
+    const uint8_t *source = emu.memory + addr + j * emu.width;
+    uint8_t *target = emu.panel + j * emu.width;
+
+    for (i = x; i < x + w; i++) {
+      int level = source[i] >> 4;
+      int current = target[i] / 17;
+
+      if (waveform->levels == 0) {
+        target[i] = 255;
+      } else if (waveform->levels == 16) {
+        target[i] = level * 17;
+      } else if (level % (15 / (waveform->levels - 1)) == 0 && (waveform->levels > 2 || !strcmp(waveform->name, "DU") || current % 15 == 0)) {
+        // DU drives any pixel to black or white, A2 only works from black or white
+        target[i] = level * 17;
+      } else {
+        emu.unreachable++;
+      }
+    }
+  }
+
+  double start = emuNow() > emu.busyUntil ? emuNow() : emu.busyUntil;
+  emu.busyUntil = start + waveform->ms * emu.speed;
+  emu.pendingMode = emu.pending && emu.pendingMode != waveform->name ? "several" : waveform->name;
+  emu.pending = 1;
+  emu.areas++;
+}
+
+static uint8_t *emuMemory(uint32_t addr, uint32_t size, const char *what) {
+  if ((uint64_t) addr + size > emu.memorySize) {
+    emuError("%s at 0x%x is outside the controller's %u bytes of memory", what, addr, emu.memorySize);
+    return NULL;
+  }
+  return emu.memory + addr;
+}
+
+static void emuLoadStart(uint16_t format, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+  const int bpp[] = { 2, 3, 4, 8 };
+
+  emu.loadBpp = bpp[(format >> 4) & 3];
+  emu.loadEndian = (format >> 8) & 1;
+  emu.loadX = x;
+  emu.loadY = y;
+  emu.loadW = w;
+  emu.loadH = h;
+  emu.col = emu.row = 0;
+  emu.loadAddr = emu.regs[EMU_REG_LISAR / 2] | (emu.regs[(EMU_REG_LISAR + 2) / 2] << 16);
+  emu.loading = 1;
+
+  if (!(emu.regs[EMU_REG_I80CPCR / 2] & 1))
+    emuError("image load without packed mode enabled in I80CPCR");
+  if (format & 3)
+    emuError("image load with rotation %d, only 0 is modelled", format & 3);
+  if (!w || !h || x + w > emu.width || y + h > emu.height) {
+    emuError("image area %dx%d at %d,%d is outside the %dx%d panel", w, h, x, y, emu.width, emu.height);
+    emu.loading = -1;
+  } else if (!emuMemory(emu.loadAddr, emu.width * emu.height, "image buffer")) {
+    emu.loading = -1;
+  }
+}
+
+// Every row starts on a new word, pixels are taken from the top bits of a word in big endian mode
+// (matching the byte order on the wire) and from the bottom bits in little endian mode
+static void emuLoadWord(uint16_t word) {
+  const int bpp = emu.loadBpp == 3 ? 4 : emu.loadBpp;
+  const int mask = (1 << bpp) - 1;
+  int k;
+
+  if (emu.loading < 0)
+    return;
+  if (emu.row >= emu.loadH) {
+    emuError("more image data than the %dx%d area holds", emu.loadW, emu.loadH);
+    emu.loading = -1;
+    return;
+  }
+
+  uint8_t *line = emu.memory + emu.loadAddr + (emu.loadY + emu.row) * emu.width + emu.loadX;
+  for (k = 0; k < 16 / bpp; k++) {
+    int value = (word >> (emu.loadEndian ? 16 - (k + 1) * bpp : k * bpp)) & mask;
+
+    line[emu.col] = bpp == 8 ? value : bpp == 4 ? (emu.loadBpp == 3 ? value & 0xe : value) * 0x11 : value * 0x55;
+    if (++emu.col == emu.loadW) {
+      emu.col = 0;
+      emu.row++;
+      break;
+    }
+  }
+}
+
+static void emuLoadEnd() {
+  if (emu.loading > 0 && emu.row < emu.loadH)
+    emuError("image load ended after %d of %d rows", emu.row, emu.loadH);
+  emu.loading = 0;
+}
+
+static int emuArgCount(uint16_t command) {
+  switch (command) {
+    case EMU_CMD_REG_RD: return 1;
+    case EMU_CMD_REG_WR: return 2;
+    case EMU_CMD_MEM_BST_RD_T: return 4;
+    case EMU_CMD_MEM_BST_WR: return 4;
+    case EMU_CMD_LD_IMG: return 1;
+    case EMU_CMD_LD_IMG_AREA: return 5;
+    case EMU_CMD_DPY_AREA: return 5;
+    case EMU_CMD_DPY_BUF_AREA: return 7;
+    case EMU_CMD_VCOM: return 1; // one more to set it
+    case EMU_CMD_SYS_RUN: case EMU_CMD_STANDBY: case EMU_CMD_SLEEP:
+    case EMU_CMD_MEM_BST_RD_S: case EMU_CMD_MEM_BST_END: case EMU_CMD_LD_IMG_END:
+    case EMU_CMD_GET_DEV_INFO:
+      return 0;
+  }
+  return -1;
+}
+
+// Runs a command once all of its arguments are there
+static void emuExecute() {
+  uint16_t *a = emu.args;
+
+  switch (emu.command) {
+    case EMU_CMD_SYS_RUN:
+      emu.state = STATE_RUN;
+      break;
+    case EMU_CMD_STANDBY:
+    case EMU_CMD_SLEEP:
+      if (emuBusy())
+        emuError("%s while a refresh is still running", emu.command == EMU_CMD_SLEEP ? "SLEEP" : "STANDBY");
+      emu.state = emu.command == EMU_CMD_SLEEP ? STATE_SLEEP : STATE_STANDBY;
+      break;
+    case EMU_CMD_REG_WR:
+      emu.regs[a[0] / 2] = a[1];
+      break;
+    case EMU_CMD_MEM_BST_RD_T:
+    case EMU_CMD_MEM_BST_WR:
+      emu.burstAddr = a[0] | (a[1] << 16);
+      emu.burstCount = a[2] | (a[3] << 16);
+      emu.bursting = emu.command == EMU_CMD_MEM_BST_WR ? 1 : 2;
+      if (!emuMemory(emu.burstAddr, emu.burstCount * 2, "memory burst"))
+        emu.bursting = 0;
+      break;
+    case EMU_CMD_MEM_BST_RD_S:
+      if (emu.bursting != 2)
+        emuError("MEM_BST_RD_S without MEM_BST_RD_T");
+      break;
+    case EMU_CMD_MEM_BST_END:
+      if (emu.bursting == 1 && emu.burstCount)
+        emuError("memory burst write ended %u words early", emu.burstCount);
+      emu.bursting = 0;
+      break;
+    case EMU_CMD_LD_IMG:
+      emuLoadStart(a[0], 0, 0, emu.width, emu.height);
+      break;
+    case EMU_CMD_LD_IMG_AREA:
+      emuLoadStart(a[0], a[1], a[2], a[3], a[4]);
+      break;
+    case EMU_CMD_LD_IMG_END:
+      emuLoadEnd();
+      break;
+    case EMU_CMD_DPY_AREA:
+      emuDisplay(a[0], a[1], a[2], a[3], a[4], EMU_IMAGE_BUFFER);
+      break;
+    case EMU_CMD_DPY_BUF_AREA:
+      emuDisplay(a[0], a[1], a[2], a[3], a[4], a[5] | (a[6] << 16));
+      break;
+    case EMU_CMD_VCOM:
+      if (a[0] == 1)
+        emu.vcom = a[1];
+      break;
+  }
+}
+
+static void emuCommand(uint16_t command) {
+  if (emu.loading && command != EMU_CMD_LD_IMG_END) {
+    emuError("command 0x%04x in the middle of an image load", command);
+    emuLoadEnd();
+  }
+  if (emu.bursting && command != EMU_CMD_MEM_BST_END && command != EMU_CMD_MEM_BST_RD_S) {
+    emuError("command 0x%04x in the middle of a memory burst", command);
+    emu.bursting = 0;
+  }
+
+  emu.command = command;
+  emu.argCount = 0;
+  emu.argsNeeded = emuArgCount(command);
+  emu.readIndex = 0;
+
+  if (emu.argsNeeded < 0) {
+    emuError("unknown command 0x%04x", command);
+    emu.command = 0;
+    return;
+  }
+
+  // Memory, image and display commands need the controller to be running
+  if (emu.state == STATE_SLEEP && (command & 0xfff0) != 0 && command != EMU_CMD_REG_RD
+    && command != EMU_CMD_REG_WR && command != EMU_CMD_GET_DEV_INFO && command != EMU_CMD_VCOM)
+    emuError("command 0x%04x while the controller is asleep", command);
+
+  emuHrdyLow(EMU_HRDY_COMMAND_US);
+  if (emu.argsNeeded == 0)
+    emuExecute();
+}
+
+static void emuData(uint16_t word) {
+  uint8_t *target;
+
+  if (emu.argCount < emu.argsNeeded) {
+    emu.args[emu.argCount++] = word;
+    if (emu.command == EMU_CMD_VCOM && emu.argCount == 1 && word == 1)
+      emu.argsNeeded = 2;
+    if (emu.argCount == emu.argsNeeded)
+      emuExecute();
+  } else if (emu.loading) {
+    emuLoadWord(word);
+  } else if (emu.bursting == 1 && emu.burstCount) {
+    // Words are stored little endian, like everything in the controller's memory
+    target = emu.memory + emu.burstAddr;
+    target[0] = word & 0xff;
+    target[1] = word >> 8;
+    emu.burstAddr += 2;
+    emu.burstCount--;
+  } else {
+    emuError("data word 0x%04x that command 0x%04x doesn't take", word, emu.command);
+  }
+}
+
+static uint16_t emuRead() {
+  const uint8_t *source;
+
+  switch (emu.command) {
+    case EMU_CMD_REG_RD:
+      if (emu.args[0] == EMU_REG_LUTAFSR)
+        return emuBusy() ? 0xffff : 0;
+      return emu.regs[emu.args[0] / 2];
+    case EMU_CMD_MEM_BST_RD_S:
+      if (emu.bursting != 2 || !emu.burstCount)
+        break;
+      source = emu.memory + emu.burstAddr;
+      emu.burstAddr += 2;
+      emu.burstCount--;
+      return source[0] | (source[1] << 8);
+    case EMU_CMD_VCOM:
+      if (emu.args[0] == 0)
+        return emu.vcom;
+      break;
+    case EMU_CMD_GET_DEV_INFO:
+      return emuDevInfo(emu.readIndex++);
+  }
+
+  emuError("read that command 0x%04x has nothing for", emu.command);
+  return 0;
+}
+
+static void emuReset() {
+  memset(emu.regs, 0, sizeof(emu.regs));
+  emu.vcom = 0;
+  emu.state = STATE_RUN;
+  emu.phase = PHASE_IDLE;
+  emu.command = 0;
+  emu.argCount = emu.argsNeeded = 0;
+  emu.loading = emu.bursting = 0;
+  emu.busyUntil = 0;
+  emu.hrdyUntil = emuNow() + EMU_HRDY_RESET_MS * emu.speed;
+}
+
+static void emuChipSelect(int low) {
+  if (low) {
+    emu.phase = PHASE_PREAMBLE;
+    emu.half = 0;
+    emu.traffic.transactions++;
+    emu.total.transactions++;
+    return;
+  }
+
+  if (emu.half && emu.phase != PHASE_READ && emu.phase != PHASE_IGNORE)
+    emuError("transaction ended in the middle of a word");
+  emu.phase = PHASE_IDLE;
+}
+
+// Handles one byte clocked out on MOSI, returns the byte clocked in on MISO
+// now is when the transfer the byte is part of started
+static uint8_t emuTransfer(uint8_t in, double now) {
+  uint8_t out = 0;
+
+  if (emu.phase == PHASE_IDLE) {
+    emuError("SPI transfer without chip select");
+    return 0;
+  }
+  if (!emuHrdy(now) && emu.phase != PHASE_IGNORE)
+    emuError("SPI transfer while HRDY is low");
+
+  if (emu.phase == PHASE_READ) {
+    if (emu.dummy) {
+      emu.dummy--;
+      return 0;
+    }
+    if (!emu.half)
+      emu.word = emuRead();
+    out = emu.half ? emu.word & 0xff : emu.word >> 8;
+    emu.half ^= 1;
+    return out;
+  }
+
+  if (!emu.half) {
+    emu.word = in << 8;
+    emu.half = 1;
+    return 0;
+  }
+  emu.word |= in;
+  emu.half = 0;
+
+  switch (emu.phase) {
+    case PHASE_PREAMBLE:
+      emuHrdyLow(EMU_HRDY_PREAMBLE_US);
+      if (emu.word == EMU_PREAMBLE_CMD) {
+        emu.phase = PHASE_COMMAND;
+      } else if (emu.word == EMU_PREAMBLE_WRITE) {
+        emu.phase = PHASE_WRITE;
+      } else if (emu.word == EMU_PREAMBLE_READ) {
+        emu.phase = PHASE_READ;
+        emu.dummy = 2;
+      } else {
+        emuError("unknown preamble 0x%04x", emu.word);
+        emu.phase = PHASE_IGNORE;
+      }
+      break;
+    case PHASE_COMMAND:
+      emuCommand(emu.word);
+      emu.phase = PHASE_COMMAND_SENT;
+      break;
+    case PHASE_COMMAND_SENT:
+      emuError("more than one word in a command transaction");
+      emu.phase = PHASE_IGNORE;
+      break;
+    case PHASE_WRITE:
+      emuData(emu.word);
+      break;
+    default:
+      break;
+  }
+  return out;
+}
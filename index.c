@@ -0,0 +1,252 @@
+// Sidecar frame index for exact, probe-free seeking
+// Built once with `vsmp --build-index [video file]` and stored next to the video as [video name].vsmpidx
+// The file is a small header followed by one entry per frame in presentation order,
+// it is memory-mapped at startup so looking up a frame is a plain array access
+// The header holds the size of the video and a hash of its beginning and end, so an index is only used with
+// the video it was built from
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_MAGIC "VSMPIDX2"
+#define INDEX_HASH_SIZE 65536 // bytes hashed at the beginning and at the end of the video
+
+typedef struct {
+  char magic[8];
+  uint32_t frameCount;
+  uint32_t streamIdx;
+  int64_t timeBase; // duration of one frame in stream time base units when the index was built
+  int64_t videoSize;
+  uint64_t videoHash;
+} IndexHeader;
+
+typedef struct {
+  int64_t pts;
+  uint32_t keyframe; // closest frame at or before this one that decoding can start from
+  uint32_t flags;    // AV_PKT_FLAG_* of the frame's packet
+} IndexEntry;
+
+// Used while building the index, packets are read in decode order
+typedef struct {
+  IndexEntry entry;
+  uint32_t decodeIdx;
+  uint32_t keyDecodeIdx;
+} IndexBuildEntry;
+
+const IndexHeader *indexHeader = NULL;
+const IndexEntry *indexEntries = NULL;
+
+static void indexPath(const char *videoPath, char *out, size_t len) {
+  const char *base = strrchr(videoPath, '/');
+  const char *ext = strrchr(videoPath, '.');
+
+  // Replace the file extension, if there is one
+  if (ext && (!base || ext > base + 1))
+    snprintf(out, len, "%.*s.vsmpidx", (int) (ext - videoPath), videoPath);
+  else
+    snprintf(out, len, "%s.vsmpidx", videoPath);
+}
+
+// Size and hash (FNV-1a) of the video file, returns -1 if it can't be read
+static int videoFingerprint(const char *videoPath, int64_t *size, uint64_t *hash) {
+  static uint8_t buffer[INDEX_HASH_SIZE];
+  struct stat st;
+  int fd = open(videoPath, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  *size = st.st_size;
+  *hash = 0xcbf29ce484222325ULL;
+  off_t offsets[2] = { 0, st.st_size > INDEX_HASH_SIZE ? st.st_size - INDEX_HASH_SIZE : 0 };
+  for (int part = 0; part < 2; part++) {
+    ssize_t length = pread(fd, buffer, sizeof(buffer), offsets[part]);
+    for (ssize_t i = 0; i < length; i++)
+      *hash = (*hash ^ buffer[i]) * 0x100000001b3ULL;
+  }
+
+  close(fd);
+  return 0;
+}
+
+// Duration of one frame in the stream's time base, 0 if the frame rate is unknown
+static int64_t frameDuration(const AVStream *stream) {
+  AVRational rate = stream->r_frame_rate.num && stream->r_frame_rate.den ? stream->r_frame_rate : stream->avg_frame_rate;
+  if (!rate.num || !rate.den || !stream->time_base.num)
+    return 0;
+  return ((int64_t) stream->time_base.den * rate.den) / ((int64_t) stream->time_base.num * rate.num);
+}
+
+static int comparePts(const void *a, const void *b) {
+  int64_t ptsA = ((const IndexBuildEntry *) a)->entry.pts;
+  int64_t ptsB = ((const IndexBuildEntry *) b)->entry.pts;
+  return (ptsA > ptsB) - (ptsA < ptsB);
+}
+
+// Reads every packet of the video stream once (without decoding) and writes the index file
+static int buildIndex(const char *videoPath) {
+  AVFormatContext *formatCtx = avformat_alloc_context();
+  if (!formatCtx || avformat_open_input(&formatCtx, videoPath, NULL, NULL) != 0) {
+    printf("ERROR could not open the file\n");
+    return -1;
+  }
+
+  if (avformat_find_stream_info(formatCtx, NULL) < 0) {
+    printf("ERROR could not get the stream info\n");
+    return -1;
+  }
+
+  // Same stream selection as in main: last video stream wins
+  int streamIdx = -1;
+  for (int i = 0; i < formatCtx->nb_streams; i++) {
+    if (formatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+      streamIdx = i;
+  }
+
+  if (streamIdx < 0) {
+    printf("ERROR no video stream found\n");
+    return -1;
+  }
+
+  AVStream *vidstream = formatCtx->streams[streamIdx];
+  AVPacket *packet = av_packet_alloc();
+  uint32_t count = 0, capacity = 4096;
+  IndexBuildEntry *entries = malloc(capacity * sizeof(IndexBuildEntry));
+
+  // Keyframes seen so far in decode order, to find the decoding start point of every frame
+  uint32_t keyCount = 0, keyCapacity = 256;
+  uint32_t *keys = malloc(keyCapacity * sizeof(uint32_t));
+
+  while (av_read_frame(formatCtx, packet) >= 0) {
+    if (packet->stream_index != streamIdx || packet->pts == AV_NOPTS_VALUE) {
+      av_packet_unref(packet);
+      continue;
+    }
+
+    if (count == capacity) {
+      capacity *= 2;
+      entries = realloc(entries, capacity * sizeof(IndexBuildEntry));
+    }
+
+    IndexBuildEntry *e = &entries[count];
+    e->entry.pts = packet->pts;
+    e->entry.flags = packet->flags;
+    e->decodeIdx = count;
+
+    if (packet->flags & AV_PKT_FLAG_KEY) {
+      if (keyCount == keyCapacity) {
+        keyCapacity *= 2;
+        keys = realloc(keys, keyCapacity * sizeof(uint32_t));
+      }
+      keys[keyCount++] = count;
+    }
+
+    // Leading frames of an open GOP come after their keyframe in decode order but are displayed before it,
+    // decoding them has to start at an earlier keyframe
+    int k = keyCount - 1;
+    while (k > 0 && entries[keys[k]].entry.pts > packet->pts)
+      k--;
+    e->keyDecodeIdx = keyCount ? keys[k < 0 ? 0 : k] : 0;
+
+    count++;
+    av_packet_unref(packet);
+  }
+
+  if (!count) {
+    printf("ERROR no video packets found\n");
+    return -1;
+  }
+
+  // Frame numbers follow presentation order
+  qsort(entries, count, sizeof(IndexBuildEntry), comparePts);
+
+  uint32_t *decodeToFrame = malloc(count * sizeof(uint32_t));
+  for (uint32_t i = 0; i < count; i++)
+    decodeToFrame[entries[i].decodeIdx] = i;
+
+  IndexHeader header;
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.frameCount = count;
+  header.streamIdx = streamIdx;
+  header.timeBase = frameDuration(vidstream);
+  if (header.timeBase <= 0) {
+    printf("ERROR the frame rate of the video is unknown\n");
+    return -1;
+  }
+  if (videoFingerprint(videoPath, &header.videoSize, &header.videoHash)) {
+    printf("ERROR could not read %s\n", videoPath);
+    return -1;
+  }
+
+  char path[1024];
+  indexPath(videoPath, path, sizeof(path));
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    printf("ERROR could not write index file %s\n", path);
+    return -1;
+  }
+
+  fwrite(&header, sizeof(header), 1, f);
+  for (uint32_t i = 0; i < count; i++) {
+    entries[i].entry.keyframe = decodeToFrame[entries[i].keyDecodeIdx];
+    fwrite(&entries[i].entry, sizeof(IndexEntry), 1, f);
+  }
+  fclose(f);
+
+  printf("Wrote index of %u frames (%u keyframes) to %s\n", count, keyCount, path);
+
+  free(decodeToFrame);
+  free(keys);
+  free(entries);
+  av_packet_free(&packet);
+  avformat_close_input(&formatCtx);
+  return 0;
+}
+
+// Maps the index file of the given video, if there is one and it was built from this video
+// Returns non-zero if an index is available afterwards
+static int loadIndex(const char *videoPath, const AVFormatContext *formatCtx) {
+  char path[1024];
+  struct stat st;
+  int64_t videoSize;
+  uint64_t videoHash;
+  indexPath(videoPath, path, sizeof(path));
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(IndexHeader)) {
+    close(fd);
+    return 0;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  const IndexHeader *header = map;
+  if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      st.st_size != sizeof(IndexHeader) + (off_t) header->frameCount * sizeof(IndexEntry)) {
+    printf("Ignoring invalid index file %s\n", path);
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  if (header->streamIdx >= formatCtx->nb_streams || header->timeBase <= 0 ||
+      videoFingerprint(videoPath, &videoSize, &videoHash) || videoSize != header->videoSize || videoHash != header->videoHash) {
+    printf("Ignoring index file %s, it was built from a different video\n", path);
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  indexHeader = header;
+  indexEntries = (const IndexEntry *) (header + 1);
+  printf("Loaded index of %u frames from %s\n", header->frameCount, path);
+  return 1;
+}
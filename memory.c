@@ -0,0 +1,263 @@
+// Buffers and heap allocations
+// Every buffer vsmp works with (the scaled frame, dithering rows and thresholds, packed frames
+// and the display driver's copies of them) is a MemoryBuffer, which only allocates when it has to grow. Their sizes
+// are set by the first frames, after MEMORY_WARMUP_REFRESHES refreshes all of them are listed in a report and a buffer
+// growing after that is warned about
+// With MEMORY_ARENA_SIZE set, buffers are carved from one block of that size, allocated and touched at startup,
+// so the footprint is fixed from the start and playback never takes memory from the heap or gives it back
+// With MEMORY_AUDIT, malloc and friends are replaced by versions counting every allocation. Allocations by vsmp
+// are logged with every refresh and warned about once the warm-up is over, as there should be none.
+// Those made by libav, inside its calls or on its own threads, are counted apart: packets are allocated as they are
+// read and decoded frames come from libav's own buffer pool, which vsmp can't change
+// Every thread counts as vsmp's, except while it is in a libav call (see memoryOwner). Threads start out like the
+// thread that created them, so the decoder threads libav starts are libav's and those vsmp starts are vsmp's
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#define MEMORY_ALIGN 64            // every buffer starts on a MEMORY_ALIGN byte boundary, enough for SIMD
+#define MEMORY_WARMUP_REFRESHES 2  // refreshes it takes until every buffer has been allocated
+
+typedef struct MemoryBuffer {
+  const char *name; // for the report, which adds up buffers of the same name
+  void *data;
+  size_t size;
+  int inArena;
+  struct MemoryBuffer *next; // list of all buffers allocated so far, for the report
+  int listed;
+} MemoryBuffer;
+
+#define MEMORY_BUFFER(name) { name, NULL, 0, 0, NULL, 0 }
+
+static MemoryBuffer *memoryBuffers = NULL;
+static pthread_mutex_t memoryLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t *memoryArena = NULL;
+static size_t memoryArenaUsed = 0;
+
+static int memorySteady = 0; // set once the warm-up is over
+
+// Heap allocations since the last refresh, by vsmp and by libav, see MEMORY_AUDIT
+static atomic_llong ownAllocations;
+static atomic_llong libavAllocations;
+
+// Cleared while the thread is in a libav call
+static __thread int memoryOwnThread = 1;
+
+// Returns the buffer's memory with room for at least size bytes, only allocating if it isn't large enough yet
+// The contents are lost when it grows. Running out of memory is fatal, as nothing could be shown anyway
+static void *memoryFit(MemoryBuffer *buffer, size_t size) {
+  if (buffer->data && buffer->size >= size)
+    return buffer->data;
+
+  pthread_mutex_lock(&memoryLock);
+  if (!buffer->inArena)
+    free(buffer->data);
+  buffer->data = NULL;
+  size = (size + MEMORY_ALIGN - 1) & ~(size_t) (MEMORY_ALIGN - 1);
+
+  // Memory of a buffer that outgrew its place in the arena isn't reused
+  if (memoryArena && MEMORY_ARENA_SIZE - memoryArenaUsed >= size) {
+    buffer->data = memoryArena + memoryArenaUsed;
+    buffer->inArena = 1;
+    memoryArenaUsed += size;
+  } else {
+    if (memoryArena)
+      printf("WARNING the memory arena is full, allocating %zu bytes for %s on the heap\n", size, buffer->name);
+    if (posix_memalign(&buffer->data, MEMORY_ALIGN, size ? size : MEMORY_ALIGN))
+      buffer->data = NULL;
+    buffer->inArena = 0;
+  }
+
+  if (!buffer->data) {
+    printf("ERROR could not allocate %zu bytes for %s\n", size, buffer->name);
+    exit(1);
+  }
+  if (memorySteady)
+    printf("WARNING %s grew to %zu bytes after the warm-up\n", buffer->name, size);
+
+  buffer->size = size;
+  if (!buffer->listed) {
+    buffer->next = memoryBuffers;
+    memoryBuffers = buffer;
+    buffer->listed = 1;
+  }
+  pthread_mutex_unlock(&memoryLock);
+  return buffer->data;
+}
+
+// Gives the buffer's memory back to the heap. Memory in the arena is kept for the next memoryFit
+static void memoryRelease(MemoryBuffer *buffer) {
+  if (buffer->inArena)
+    return;
+  pthread_mutex_lock(&memoryLock);
+  free(buffer->data);
+  buffer->data = NULL;
+  buffer->size = 0;
+  pthread_mutex_unlock(&memoryLock);
+}
+
+// Marks the calling thread as working for vsmp (1) or libav (0), which decides where its heap allocations are counted
+// Call it with 0 before libav calls that may allocate and with 1 after them
+static void memoryOwner(int own) {
+  memoryOwnThread = own;
+}
+
+// Sets up the arena, called on the main thread before anything else is allocated
+static int memoryInit() {
+  #if MEMORY_ARENA_SIZE
+    if (posix_memalign((void **) &memoryArena, MEMORY_ALIGN, MEMORY_ARENA_SIZE)) {
+      printf("ERROR could not allocate the memory arena of %d bytes\n", MEMORY_ARENA_SIZE);
+      return -1;
+    }
+    // Touching every page makes it resident now rather than in the middle of a refresh
+    memset(memoryArena, 0, MEMORY_ARENA_SIZE);
+    printf("Allocated a memory arena of %.1f MB\n", MEMORY_ARENA_SIZE / 1048576.0);
+  #endif
+  return 0;
+}
+
+// Lists every buffer with its size, the arena and the peak resident set size
+static void memoryReport() {
+  MemoryBuffer *buffer, *other;
+  size_t total = 0, size;
+  int count;
+
+  pthread_mutex_lock(&memoryLock);
+  printf("Memory after %d refreshes:\n", MEMORY_WARMUP_REFRESHES);
+  for (buffer = memoryBuffers; buffer; buffer = buffer->next) {
+    total += buffer->size;
+
+    // Buffers of the same name are listed once, where the first of them is
+    for (other = memoryBuffers; other != buffer && strcmp(other->name, buffer->name); other = other->next);
+    if (other != buffer)
+      continue;
+
+    size = 0;
+    count = 0;
+    for (; other; other = other->next) {
+      if (!strcmp(other->name, buffer->name) && other->size) {
+        size += other->size;
+        count++;
+      }
+    }
+    if (count)
+      printf("  %-24s %10zu bytes in %d buffer%s\n", buffer->name, size, count, count > 1 ? "s" : "");
+  }
+  printf("  %-24s %10zu bytes\n", "total", total);
+  if (memoryArena)
+    printf("  %-24s %10zu of %d bytes used\n", "arena", memoryArenaUsed, MEMORY_ARENA_SIZE);
+  pthread_mutex_unlock(&memoryLock);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("  %-24s %10ld kB\n", "peak resident set", usage.ru_maxrss);
+}
+
+// Called after every refresh with the heap allocations vsmp made since the last one
+// Prints the report once the warm-up is over and warns about allocations from then on
+static void memoryCheckRefresh(int frame, long long allocations) {
+  static int refreshes = 0;
+
+  if (memorySteady) {
+    #if MEMORY_AUDIT
+      if (allocations)
+        printf("WARNING vsmp allocated heap memory %lld times while preparing and showing frame %d\n", allocations, frame);
+    #endif
+    return;
+  }
+
+  if (++refreshes == MEMORY_WARMUP_REFRESHES) {
+    memorySteady = 1;
+    memoryReport();
+  }
+}
+
+#if MEMORY_AUDIT && defined(__GLIBC__)
+  // glibc's allocator under its internal names, which the replacements below call
+  // Calls from within glibc and libav end up here as well
+  extern void *__libc_malloc(size_t size);
+  extern void *__libc_calloc(size_t count, size_t size);
+  extern void *__libc_realloc(void *ptr, size_t size);
+  extern void *__libc_memalign(size_t alignment, size_t size);
+  extern void __libc_free(void *ptr);
+
+  static inline void memoryCount() {
+    atomic_fetch_add_explicit(memoryOwnThread ? &ownAllocations : &libavAllocations, 1, memory_order_relaxed);
+  }
+
+  void *malloc(size_t size) {
+    memoryCount();
+    return __libc_malloc(size);
+  }
+
+  void *calloc(size_t count, size_t size) {
+    memoryCount();
+    return __libc_calloc(count, size);
+  }
+
+  void *realloc(void *ptr, size_t size) {
+    memoryCount();
+    return __libc_realloc(ptr, size);
+  }
+
+  void *memalign(size_t alignment, size_t size) {
+    memoryCount();
+    return __libc_memalign(alignment, size);
+  }
+
+  void *aligned_alloc(size_t alignment, size_t size) {
+    memoryCount();
+    return __libc_memalign(alignment, size);
+  }
+
+  int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || alignment & (alignment - 1))
+      return EINVAL;
+    memoryCount();
+    void *data = __libc_memalign(alignment, size);
+    if (!data)
+      return ENOMEM;
+    *ptr = data;
+    return 0;
+  }
+
+  // Threads are started through a replacement as well, which passes memoryOwnThread on to the new thread
+  // Its bookkeeping goes straight to glibc, so it isn't counted for either side
+  #ifndef RTLD_NEXT
+    #define RTLD_NEXT ((void *) -1l) // glibc's value, which dlfcn.h only defines with _GNU_SOURCE
+  #endif
+
+  typedef struct {
+    void *(*start)(void *);
+    void *arg;
+    int own;
+  } MemoryThreadStart;
+
+  static void *memoryThreadStart(void *opaque) {
+    MemoryThreadStart start = *(MemoryThreadStart *) opaque;
+
+    __libc_free(opaque);
+    memoryOwnThread = start.own;
+    return start.start(start.arg);
+  }
+
+  int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start)(void *), void *arg) {
+    static int (*create)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+    MemoryThreadStart *threadStart;
+
+    if (!create && !(create = dlsym(RTLD_NEXT, "pthread_create")))
+      return EAGAIN;
+    if (!(threadStart = __libc_malloc(sizeof(MemoryThreadStart))))
+      return EAGAIN;
+    *threadStart = (MemoryThreadStart) { start, arg, memoryOwnThread };
+
+    int status = create(thread, attr, memoryThreadStart, threadStart);
+    if (status)
+      __libc_free(threadStart);
+    return status;
+  }
+#endif
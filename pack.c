@@ -0,0 +1,84 @@
+// Conversion between 8bpp frame buffers and the packed transport bpp format used for display transfer
+
+#define PIXELS_PER_BYTE (8 / config.transportBpp)
+
+// Size of a packed frame in bytes
+static uint32_t packedFrameSize(int width, int height) {
+  return (width * height + PIXELS_PER_BYTE - 1) / PIXELS_PER_BYTE;
+}
+
+// Packs one line of 8bpp pixels to bpp bits per pixel
+// The packed pixel stream is continuous, first is the index of the line's first pixel in it
+// If lines don't start on a byte boundary, the byte shared with the previous line is merged into
+// Intra-byte order is [12345678], not [87654321], see IT8951HostAreaPackedWrite
+static inline __attribute__((always_inline)) void packRowBpp(
+  const unsigned char *restrict row,
+  int width,
+  uint32_t first,
+  uint8_t *restrict packed,
+  const int bpp
+) {
+  const int pixelsPerByte = 8 / bpp;
+  const uint8_t bpp_shift = 8 - bpp;
+  const uint8_t mask = 0xff >> bpp_shift;
+  uint8_t *dst = packed + first / pixelsPerByte;
+  int i, b;
+
+  if (first % pixelsPerByte || width % pixelsPerByte) {
+    for (i = 0; i < width; i++) {
+      uint32_t p = first + i;
+      uint8_t shift = (pixelsPerByte - p % pixelsPerByte - 1) * bpp;
+      dst = packed + p / pixelsPerByte;
+      *dst = (*dst & ~(mask << shift)) | ((row[i] >> bpp_shift) << shift);
+    }
+    return;
+  }
+
+  for (i = 0; i < width / pixelsPerByte; i++) {
+    uint8_t tmp = 0;
+    for (b = 0; b < pixelsPerByte; b++)
+      tmp |= (row[i * pixelsPerByte + b] >> bpp_shift) << ((pixelsPerByte - b - 1) * bpp);
+    dst[i] = tmp;
+  }
+}
+
+// Packs one line to the configured transport bpp
+// Every transport bpp gets its own copy of the loops above, so the choice costs one branch per line
+static void packRow(const unsigned char *restrict row, int width, uint32_t first, uint8_t *restrict packed) {
+  switch (config.transportBpp) {
+    case 2:
+      packRowBpp(row, width, first, packed, 2);
+      break;
+    case 4:
+      packRowBpp(row, width, first, packed, 4);
+      break;
+    default:
+      packRowBpp(row, width, first, packed, 8);
+  }
+}
+
+// Packs an 8bpp frame buffer to the transport bpp, skipping dead space at the end of each line
+static void packFrame(const unsigned char *frameBuf, int linesize, int width, int height, uint8_t *dst) {
+  for (int j = 0; j < height; j++)
+    packRow(frameBuf + j * linesize, width, j * width, dst);
+}
+
+// Reused buffer holding the packed frame on its way to the display
+static uint8_t *transferBuffer(int width, int height) {
+  static MemoryBuffer buffer = MEMORY_BUFFER("transfer frame");
+  return memoryFit(&buffer, packedFrameSize(width, height));
+}
+
+// Expands a packed frame back to 8bpp with a linesize equal to width,
+// for display drivers that don't take packed data
+static void unpackFrame(const uint8_t *packed, int width, int height, unsigned char *frameBuf) {
+  uint8_t bpp = config.transportBpp;
+  uint8_t ppb = PIXELS_PER_BYTE;
+  uint8_t mask = (1 << bpp) - 1;
+  uint32_t i;
+
+  for (i = 0; i < width * height; i++) {
+    uint8_t level = (packed[i / ppb] >> ((ppb - i % ppb - 1) * bpp)) & mask;
+    frameBuf[i] = level * 255 / mask;
+  }
+}
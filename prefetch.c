@@ -0,0 +1,168 @@
+// Background frame preparation
+// While one frame is on display, a producer thread decodes, dithers and packs the next one into
+// the other half of a double buffer, so a refresh only has to transfer an already prepared frame
+// Decoder state is only ever touched by whichever thread is currently preparing a frame
+// Displays that can hold frames in their own memory (DISPLAY_PRELOAD) get several upcoming frames uploaded
+// by the producer instead, so showing one of them doesn't need the double buffer at all
+
+#include <pthread.h>
+
+typedef struct {
+  uint8_t *packed; // packed frame, allocated on first use and reused afterwards
+  MemoryBuffer buffer;
+  int width;
+  int height;
+  int frame;       // frame number held by this slot, -1 if none
+  int valid;       // set once the frame has been decoded and processed successfully
+  int skipped;     // set if the frame looked unchanged and wasn't processed, see sceneUnchanged
+  RefreshTiming timing; // how long preparing the frame took
+} PrefetchSlot;
+
+static PrefetchSlot prefetchSlots[2] = {
+  { .frame = -1, .buffer = MEMORY_BUFFER("prefetched frames") },
+  { .frame = -1, .buffer = MEMORY_BUFFER("prefetched frames") }
+};
+static int prefetchFill = 0; // slot the next frame is prepared in
+
+static void (*prefetchPrepare)(int frame);
+static int prefetchFrameCount;
+static int prefetchRequest = -1; // frame the producer should prepare, -1 if idle
+static int prefetchBusy = 0;
+
+static pthread_t prefetchThread;
+static pthread_mutex_t prefetchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetchCond = PTHREAD_COND_INITIALIZER;
+
+// Frame sink packing the processed frame right into the slot that is currently being filled
+static uint8_t *prefetchTarget(int width, int height) {
+  PrefetchSlot *slot = &prefetchSlots[prefetchFill];
+
+  slot->packed = memoryFit(&slot->buffer, packedFrameSize(width, height));
+  slot->width = width;
+  slot->height = height;
+
+  return slot->packed;
+}
+
+static void prefetchSink(const uint8_t *packedBuf, int width, int height) {
+  prefetchSlots[prefetchFill].valid = 1;
+}
+
+// Prepares frame in the fill slot, must only be called while the producer is idle
+static void prefetchFillSlot(int frame) {
+  PrefetchSlot *slot = &prefetchSlots[prefetchFill];
+  slot->frame = frame;
+  slot->valid = 0;
+  prefetchPrepare(frame);
+  slot->timing = frameTiming;
+  slot->skipped = sceneSkipped;
+}
+
+#ifdef DISPLAY_PRELOAD
+  // Frames found unchanged while preloading, so they aren't prepared again when they are due
+  #define PREFETCH_SKIPPED_FRAMES 64
+  static int prefetchSkippedFrames[PREFETCH_SKIPPED_FRAMES];
+  static int prefetchSkippedNext = 0;
+
+  static int prefetchWasSkipped(int frame) {
+    for (int i = 0; i < PREFETCH_SKIPPED_FRAMES; i++) {
+      if (prefetchSkippedFrames[i] == frame)
+        return 1;
+    }
+    return 0;
+  }
+
+  // Uploads frame and the ones following it to the display until it holds as many upcoming frames as it can
+  // Frames already on the display are skipped, the others are prepared one after the other in the fill slot
+  static void prefetchPreload(int frame) {
+    PrefetchSlot *slot = &prefetchSlots[prefetchFill];
+    int n;
+
+    for (n = 0; n < pixelPreloadCapacity() && frame < prefetchFrameCount; n++, frame += config.frameStepSize) {
+      if (pixelPreloaded(frame) || prefetchWasSkipped(frame))
+        continue;
+
+      prefetchFillSlot(frame);
+      if (slot->skipped) {
+        prefetchSkippedFrames[prefetchSkippedNext] = frame;
+        prefetchSkippedNext = (prefetchSkippedNext + 1) % PREFETCH_SKIPPED_FRAMES;
+        continue;
+      }
+      if (!slot->valid || pixelPreload(slot->packed, slot->width, slot->height, frame))
+        break;
+    }
+  }
+#endif
+
+static void *prefetchWorker(void *arg) {
+  pthread_mutex_lock(&prefetchLock);
+
+  while (1) {
+    while (prefetchRequest < 0)
+      pthread_cond_wait(&prefetchCond, &prefetchLock);
+
+    int frame = prefetchRequest;
+    prefetchBusy = 1;
+    pthread_mutex_unlock(&prefetchLock);
+
+    #ifdef DISPLAY_PRELOAD
+      if (pixelPreloadCapacity())
+        prefetchPreload(frame);
+      else
+    #endif
+    prefetchFillSlot(frame);
+
+    pthread_mutex_lock(&prefetchLock);
+    prefetchRequest = -1;
+    prefetchBusy = 0;
+    pthread_cond_broadcast(&prefetchCond);
+  }
+
+  return NULL;
+}
+
+// frameCount limits how far ahead frames are preloaded
+static int prefetchInit(void (*prepare)(int frame), int frameCount) {
+  prefetchPrepare = prepare;
+  prefetchFrameCount = frameCount;
+  #ifdef DISPLAY_PRELOAD
+    memset(prefetchSkippedFrames, -1, sizeof(prefetchSkippedFrames));
+  #endif
+  return pthread_create(&prefetchThread, NULL, prefetchWorker, NULL);
+}
+
+// Waits for the producer to finish what it's doing
+static void prefetchWait() {
+  pthread_mutex_lock(&prefetchLock);
+  while (prefetchBusy || prefetchRequest >= 0)
+    pthread_cond_wait(&prefetchCond, &prefetchLock);
+  pthread_mutex_unlock(&prefetchLock);
+}
+
+// Starts preparing frame in the background
+// The slot that isn't being filled stays untouched, so the frame just taken can still be displayed
+static void prefetchStart(int frame) {
+  pthread_mutex_lock(&prefetchLock);
+  while (prefetchBusy || prefetchRequest >= 0)
+    pthread_cond_wait(&prefetchCond, &prefetchLock);
+
+  prefetchRequest = frame;
+  pthread_cond_broadcast(&prefetchCond);
+  pthread_mutex_unlock(&prefetchLock);
+}
+
+// Returns the slot holding frame, waiting for the producer or preparing it synchronously if it wasn't prefetched
+// Returns NULL if the frame could not be decoded, skipped frames are returned with skipped set
+// Afterwards, the other slot becomes the fill slot
+static PrefetchSlot *prefetchTake(int frame) {
+  prefetchWait();
+
+  PrefetchSlot *slot = &prefetchSlots[prefetchFill];
+  if (slot->frame != frame) {
+    printf("Frame %d was not prefetched, preparing it now\n", frame);
+    prefetchFillSlot(frame);
+  }
+
+  prefetchFill ^= 1;
+  return slot->valid || slot->skipped ? slot : NULL;
+}
@@ -0,0 +1,296 @@
+// Scaling, cropping and grey conversion
+// Decoded frames are turned into 8 bit grey frames of the size they are shown at, so videos don't have to be
+// re-encoded for every panel. Only the luma plane is used, which is the grey picture of any YUV format
+// With scale set to fit, the frame is scaled to fit the panel (the display driver centers it), with fill it is scaled
+// to cover the panel and the center is cropped. The target size is the panel's unless scale-width / scale-height are set
+//
+// Scaling is separable: every source line that is needed is scaled horizontally once and kept in a small ring,
+// output lines are then weighted sums of those rows. Each output pixel takes a fixed number of taps with 14 bit
+// fixed point weights from a table built once per video. Axes that shrink use area averaging, where every
+// source pixel is weighted by how much of it the output pixel covers, axes that grow use bilinear interpolation
+// The vertical pass processes whole rows using SSE2 on x86 and NEON on ARM like the ordered dithers in dither.c,
+// the horizontal pass is plain C as its taps are different for every pixel
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+#endif
+
+enum { SCALE_OFF, SCALE_FIT, SCALE_FILL };
+enum { SCALE_AREA, SCALE_BILINEAR };
+
+#define SCALE_SHIFT 14    // fractional bits of the weights
+#define SCALE_ROW_SHIFT 7 // fractional bits of horizontally scaled rows, which have to fit into 15 bits
+
+typedef struct {
+  int size;         // output pixels
+  int taps;         // source pixels per output pixel
+  int *start;       // first source pixel of every output pixel
+  int16_t *weights; // taps weights for every output pixel, adding up to 1 << SCALE_SHIFT
+  MemoryBuffer startBuffer, weightBuffer;
+} ScaleAxis;
+
+// What the tables and rows below were set up for, compared as a whole so it has to be zeroed before it's filled in
+typedef struct {
+  int width, height, step; // source size, step is the distance between luma samples in bytes
+  int outWidth, outHeight;
+  int filterX, filterY;
+  double x, y, w, h;       // source window that is scaled to the output, may be fractional
+} ScaleGeometry;
+
+static ScaleGeometry scaleGeometry;
+static ScaleAxis scaleX = { .startBuffer = MEMORY_BUFFER("scale tables"), .weightBuffer = MEMORY_BUFFER("scale tables") };
+static ScaleAxis scaleY = { .startBuffer = MEMORY_BUFFER("scale tables"), .weightBuffer = MEMORY_BUFFER("scale tables") };
+static MemoryBuffer scaleRowBuffer = MEMORY_BUFFER("scale rows");
+static MemoryBuffer scaleSourceBuffer = MEMORY_BUFFER("scale tables");
+static MemoryBuffer scaleOutBuffer = MEMORY_BUFFER("scaled frame");
+static uint16_t *scaleRows = NULL; // ring of scaleY.taps horizontally scaled source rows
+static int *scaleRowSource = NULL; // source row held by every ring slot, -1 if none
+static uint8_t *scaleOut = NULL;   // converted frame
+static int scaleOutLinesize = 0;
+
+static int scaleTargetWidth = 0, scaleTargetHeight = 0;
+
+// Rounds down, also below zero where a cast would round up
+static int scaleFloor(double value) {
+  int i = (int) value;
+  return i > value ? i - 1 : i;
+}
+
+// Sets up the table scaling the source pixels from..from + length of an axis with size pixels to out pixels
+static void scaleAxisSetup(ScaleAxis *axis, int size, double from, double length, int out, int filter) {
+  double ratio = length / out;
+  double weights[(int) ratio + 3];
+  int i, k;
+
+  axis->size = out;
+  axis->taps = filter == SCALE_AREA ? scaleFloor(ratio) + (ratio > scaleFloor(ratio)) + 1 : 2;
+  if (axis->taps > size)
+    axis->taps = size;
+  axis->start = memoryFit(&axis->startBuffer, out * sizeof(int));
+  axis->weights = memoryFit(&axis->weightBuffer, out * axis->taps * sizeof(int16_t));
+
+  for (i = 0; i < out; i++) {
+    int first;
+
+    if (filter == SCALE_AREA) {
+      double x0 = from + i * ratio, x1 = x0 + ratio;
+      first = scaleFloor(x0);
+      for (k = 0; k < axis->taps; k++) {
+        double pixel0 = first + k > x0 ? first + k : x0;
+        double pixel1 = first + k + 1 < x1 ? first + k + 1 : x1;
+        weights[k] = pixel1 > pixel0 ? (pixel1 - pixel0) / ratio : 0;
+      }
+    }
+    else {
+      double center = from + (i + 0.5) * ratio - 0.5;
+      if (center < 0)
+        center = 0;
+      if (center > size - 1)
+        center = size - 1;
+      first = scaleFloor(center);
+      weights[0] = 1 - (center - first);
+      weights[1] = center - first;
+    }
+
+    // Near the edges, taps that would be outside of the frame are moved onto the edge pixels
+    int start = first < 0 ? 0 : (first > size - axis->taps ? size - axis->taps : first);
+    int16_t *fixed = axis->weights + i * axis->taps;
+    int sum = 0, largest = 0;
+
+    memset(fixed, 0, axis->taps * sizeof(int16_t));
+    for (k = 0; k < (filter == SCALE_AREA ? axis->taps : 2); k++) {
+      int pixel = first + k < 0 ? 0 : (first + k >= size ? size - 1 : first + k);
+      fixed[pixel - start] += (int) (weights[k] * (1 << SCALE_SHIFT) + 0.5);
+    }
+
+    // Rounding may leave the sum a little off, which the largest weight makes up for so flat areas stay flat
+    for (k = 0; k < axis->taps; k++) {
+      sum += fixed[k];
+      if (fixed[k] > fixed[largest])
+        largest = k;
+    }
+    fixed[largest] += (1 << SCALE_SHIFT) - sum;
+    axis->start[i] = start;
+  }
+}
+
+// Builds the tables for the given geometry, unless they are set up for it already
+static void scalePrepare(const ScaleGeometry *geometry) {
+  if (scaleRows && memcmp(geometry, &scaleGeometry, sizeof(ScaleGeometry)) == 0)
+    return;
+
+  scaleGeometry = *geometry;
+  scaleAxisSetup(&scaleX, geometry->width, geometry->x, geometry->w, geometry->outWidth, geometry->filterX);
+  scaleAxisSetup(&scaleY, geometry->height, geometry->y, geometry->h, geometry->outHeight, geometry->filterY);
+
+  scaleRows = memoryFit(&scaleRowBuffer, scaleY.taps * geometry->outWidth * sizeof(uint16_t));
+  scaleRowSource = memoryFit(&scaleSourceBuffer, scaleY.taps * sizeof(int));
+}
+
+// Scales one source row horizontally
+// taps and step are constants where this is inlined, so the inner loop is unrolled for the common cases
+static inline __attribute__((always_inline)) void scaleRowTaps(const uint8_t *src, uint16_t *row, const int taps, const int step) {
+  int x, k;
+
+  for (x = 0; x < scaleX.size; x++) {
+    const uint8_t *pixel = src + scaleX.start[x] * step;
+    const int16_t *weights = scaleX.weights + x * taps;
+    int32_t sum = 0;
+
+    for (k = 0; k < taps; k++)
+      sum += pixel[k * step] * weights[k];
+    row[x] = (sum + (1 << (SCALE_SHIFT - SCALE_ROW_SHIFT - 1))) >> (SCALE_SHIFT - SCALE_ROW_SHIFT);
+  }
+}
+
+static void scaleRow(const uint8_t *src, int step, uint16_t *row) {
+  if (step == 1 && scaleX.taps == 2)
+    scaleRowTaps(src, row, 2, 1);
+  else if (step == 1 && scaleX.taps == 3)
+    scaleRowTaps(src, row, 3, 1);
+  else if (step == 1)
+    scaleRowTaps(src, row, scaleX.taps, 1);
+  else
+    scaleRowTaps(src, row, scaleX.taps, step);
+}
+
+// Adds up the given rows with their weights into one output line
+static void scaleColumns(const uint16_t **rows, const int16_t *weights, uint8_t *out) {
+  const int width = scaleX.size, taps = scaleY.taps;
+  const int32_t round = 1 << (SCALE_SHIFT + SCALE_ROW_SHIFT - 1);
+  int x = 0, k;
+
+#if defined(__SSE2__)
+  for (; x + 8 <= width; x += 8) {
+    __m128i low = _mm_set1_epi32(round), high = low;
+    for (k = 0; k < taps; k++) {
+      // Rows are below 1 << 15 and weights at most 1 << 14, so the signed multiply-add of (row, 0) * (weight, 0) works
+      __m128i v = _mm_loadu_si128((const __m128i *) (rows[k] + x));
+      __m128i weight = _mm_set1_epi32(weights[k]);
+      low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(v, _mm_setzero_si128()), weight));
+      high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(v, _mm_setzero_si128()), weight));
+    }
+    low = _mm_srai_epi32(low, SCALE_SHIFT + SCALE_ROW_SHIFT);
+    high = _mm_srai_epi32(high, SCALE_SHIFT + SCALE_ROW_SHIFT);
+    __m128i words = _mm_packs_epi32(low, high);
+    _mm_storel_epi64((__m128i *) (out + x), _mm_packus_epi16(words, words));
+  }
+#elif defined(__ARM_NEON)
+  for (; x + 8 <= width; x += 8) {
+    uint32x4_t low = vdupq_n_u32(round), high = low;
+    for (k = 0; k < taps; k++) {
+      uint16x8_t v = vld1q_u16(rows[k] + x);
+      uint16x4_t weight = vdup_n_u16(weights[k]);
+      low = vmlal_u16(low, vget_low_u16(v), weight);
+      high = vmlal_u16(high, vget_high_u16(v), weight);
+    }
+    uint16x8_t words = vcombine_u16(vshrn_n_u32(low, 16), vshrn_n_u32(high, 16));
+    vst1_u8(out + x, vqshrn_n_u16(words, SCALE_SHIFT + SCALE_ROW_SHIFT - 16));
+  }
+#endif
+
+  for (; x < width; x++) {
+    int32_t sum = round;
+    for (k = 0; k < taps; k++)
+      sum += rows[k][x] * weights[k];
+    sum >>= SCALE_SHIFT + SCALE_ROW_SHIFT;
+    out[x] = sum > 255 ? 255 : sum;
+  }
+}
+
+// Scales the frame as set up by scalePrepare into out
+// src points to the first luma sample of the frame, which has step bytes between samples and linesize between lines
+static void scaleRun(const uint8_t *src, int linesize, uint8_t *out, int outLinesize) {
+  const int taps = scaleY.taps;
+  const uint16_t *rows[taps];
+  int j, k;
+
+  for (k = 0; k < taps; k++)
+    scaleRowSource[k] = -1;
+
+  // Output lines go down the frame, so the taps of the next one are at most taps rows further down
+  // and a ring of that many rows is enough for every source row to be scaled horizontally only once
+  for (j = 0; j < scaleY.size; j++) {
+    for (k = 0; k < taps; k++) {
+      int source = scaleY.start[j] + k;
+      uint16_t *row = scaleRows + (source % taps) * scaleX.size;
+      if (scaleRowSource[source % taps] != source) {
+        scaleRow(src + source * linesize, scaleGeometry.step, row);
+        scaleRowSource[source % taps] = source;
+      }
+      rows[k] = row;
+    }
+    scaleColumns(rows, scaleY.weights + j * taps, out + j * outLinesize);
+  }
+}
+
+// Sets the size frames are scaled to, taken from the display unless given in the config
+// Returns -1 if scaling is on but there is no size to scale to
+static int scaleSetup(int panelWidth, int panelHeight) {
+  scaleTargetWidth = config.scaleWidth ? config.scaleWidth : panelWidth;
+  scaleTargetHeight = config.scaleHeight ? config.scaleHeight : panelHeight;
+
+  if (config.scale != SCALE_OFF && (scaleTargetWidth <= 0 || scaleTargetHeight <= 0)) {
+    printf("ERROR the display doesn't report its size, set scale-width and scale-height to scale frames\n");
+    return -1;
+  }
+  if (config.scale != SCALE_OFF)
+    printf("Scaling frames to %s %dx%d\n", config.scale == SCALE_FIT ? "fit" : "fill", scaleTargetWidth, scaleTargetHeight);
+  return 0;
+}
+
+// Converts a frame to the grey frame that is dithered, the result stays valid until the next call
+// src points to the first luma sample, see scaleRun. Without any scaling or cropping to do, the luma plane
+// is used as it is, frames that are only cropped by whole pixels are used in place too
+static const uint8_t *scaleFrame(const uint8_t *src, int linesize, int step, int *width, int *height, int *outLinesize) {
+  ScaleGeometry geometry;
+
+  memset(&geometry, 0, sizeof(geometry));
+  geometry.width = geometry.outWidth = geometry.w = *width;
+  geometry.height = geometry.outHeight = geometry.h = *height;
+  geometry.step = step;
+
+  if (config.scale != SCALE_OFF) {
+    double ratioX = (double) scaleTargetWidth / *width, ratioY = (double) scaleTargetHeight / *height;
+
+    if (config.scale == SCALE_FIT) {
+      double factor = ratioX < ratioY ? ratioX : ratioY;
+      geometry.outWidth = (int) (*width * factor + 0.5);
+      geometry.outHeight = (int) (*height * factor + 0.5);
+      geometry.outWidth = geometry.outWidth < 1 ? 1 : (geometry.outWidth > scaleTargetWidth ? scaleTargetWidth : geometry.outWidth);
+      geometry.outHeight = geometry.outHeight < 1 ? 1 : (geometry.outHeight > scaleTargetHeight ? scaleTargetHeight : geometry.outHeight);
+    }
+    else {
+      double factor = ratioX > ratioY ? ratioX : ratioY;
+      geometry.outWidth = scaleTargetWidth;
+      geometry.outHeight = scaleTargetHeight;
+      geometry.w = scaleTargetWidth / factor;
+      geometry.h = scaleTargetHeight / factor;
+      geometry.x = (*width - geometry.w) / 2;
+      geometry.y = (*height - geometry.h) / 2;
+    }
+  }
+
+  if (step == 1 && geometry.w == geometry.outWidth && geometry.h == geometry.outHeight
+    && geometry.x == (int) geometry.x && geometry.y == (int) geometry.y) {
+    *width = geometry.outWidth;
+    *height = geometry.outHeight;
+    *outLinesize = linesize;
+    return src + (int) geometry.y * linesize + (int) geometry.x;
+  }
+
+  geometry.filterX = geometry.outWidth < geometry.w ? SCALE_AREA : SCALE_BILINEAR;
+  geometry.filterY = geometry.outHeight < geometry.h ? SCALE_AREA : SCALE_BILINEAR;
+  scalePrepare(&geometry);
+
+  scaleOutLinesize = (scaleX.size + 31) & ~31;
+  scaleOut = memoryFit(&scaleOutBuffer, scaleOutLinesize * scaleY.size);
+  scaleRun(src, linesize, scaleOut, scaleOutLinesize);
+
+  *width = scaleX.size;
+  *height = scaleY.size;
+  *outLinesize = scaleOutLinesize;
+  return scaleOut;
+}
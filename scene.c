@@ -0,0 +1,78 @@
+// Scene change detection
+// Before a frame is dithered, it is shrunk to one average grey value per SCENE_BLOCK x SCENE_BLOCK block
+// (sampling every SCENE_SAMPLE-th pixel of every SCENE_SAMPLE-th line) and compared to the last frame that wasn't skipped.
+// If it is about the same, dithering and refreshing it would only flash the same picture again, so it is skipped
+// Frames have to be prepared in the order they are shown for this to compare against what is on display
+
+#define SCENE_SAMPLE 4
+
+static int sceneDetection = SCENE_THRESHOLD > 0; // turned off while transcoding, where every frame is needed
+static int sceneSkipped = 0; // set if the frame prepared last was skipped
+
+static MemoryBuffer sceneBuffer = MEMORY_BUFFER("scene blocks"); // holds both of the following
+static uint16_t *sceneReference = NULL; // block averages of the last frame that wasn't skipped
+static uint16_t *sceneBlocks = NULL;    // block averages of the current frame
+static int sceneWidth = 0, sceneHeight = 0; // size of the reference frame, 0 if there is none
+
+static void sceneThumbnail(const uint8_t *frameBuf, int linesize, int width, int height, uint16_t *blocks) {
+  const int blocksX = (width + SCENE_BLOCK - 1) / SCENE_BLOCK;
+  const int blocksY = (height + SCENE_BLOCK - 1) / SCENE_BLOCK;
+  uint32_t sums[blocksX];
+  uint32_t counts[blocksX];
+  int bx, by, x, y;
+
+  for (by = 0; by < blocksY; by++) {
+    int y1 = (by + 1) * SCENE_BLOCK < height ? (by + 1) * SCENE_BLOCK : height;
+
+    memset(sums, 0, sizeof(sums));
+    memset(counts, 0, sizeof(counts));
+    for (y = by * SCENE_BLOCK; y < y1; y += SCENE_SAMPLE) {
+      const uint8_t *line = frameBuf + y * linesize;
+      for (x = 0; x < width; x += SCENE_SAMPLE) {
+        sums[x / SCENE_BLOCK] += line[x];
+        counts[x / SCENE_BLOCK]++;
+      }
+    }
+
+    for (bx = 0; bx < blocksX; bx++)
+      blocks[by * blocksX + bx] = sums[bx] / counts[bx];
+  }
+}
+
+// Returns 1 if the frame looks the same as the last one that wasn't skipped, otherwise it becomes the new reference
+// The frames' blocks may differ by SCENE_THRESHOLD grey levels on average, and no block by SCENE_BLOCK_THRESHOLD or more
+static int sceneUnchanged(const uint8_t *frameBuf, int linesize, int width, int height) {
+  const int blockCount = ((width + SCENE_BLOCK - 1) / SCENE_BLOCK) * ((height + SCENE_BLOCK - 1) / SCENE_BLOCK);
+  uint32_t total = 0;
+  int i, largest = 0;
+
+  if (!sceneDetection)
+    return 0;
+
+  if (width != sceneWidth || height != sceneHeight) {
+    sceneReference = memoryFit(&sceneBuffer, 2 * blockCount * sizeof(uint16_t));
+    sceneBlocks = sceneReference + blockCount;
+    sceneThumbnail(frameBuf, linesize, width, height, sceneReference);
+    sceneWidth = width;
+    sceneHeight = height;
+    return 0;
+  }
+
+  sceneThumbnail(frameBuf, linesize, width, height, sceneBlocks);
+  for (i = 0; i < blockCount; i++) {
+    int difference = abs(sceneBlocks[i] - sceneReference[i]);
+    total += difference;
+    largest = difference > largest ? difference : largest;
+  }
+
+  if (total < (uint32_t) SCENE_THRESHOLD * blockCount && largest < SCENE_BLOCK_THRESHOLD) {
+    printf("Frame looks unchanged (average difference %.2f, largest %d), skipping it\n", (double) total / blockCount, largest);
+    return 1;
+  }
+
+  // Swap instead of copying, the old reference is overwritten by the next frame
+  uint16_t *previous = sceneReference;
+  sceneReference = sceneBlocks;
+  sceneBlocks = previous;
+  return 0;
+}
@@ -0,0 +1,234 @@
+// Per-refresh stage timing
+// Every stage of a refresh is timed with the monotonic clock, so time spent waiting for SPI or the display counts too
+// Stages of preparing a frame are collected in frameTiming by whichever thread prepares it, display stages
+// in refreshTiming by the main loop and the display driver. At the end of a refresh, both are combined
+// into one line of output (and a CSV row), and kept for the summary printed on SIGUSR1
+// Along with the times, every refresh logs how many bytes were copied around in memory since the last one
+// and the peak resident set size of vsmp so far, as well as the heap allocations made by vsmp and by libav (see memory.c)
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/resource.h>
+
+enum {
+  STAGE_SEEK,
+  STAGE_DECODE,   // reading packets and decoding up to the target frame
+  STAGE_SCALE,    // scaling, cropping and grey conversion, see scale.c
+  STAGE_DITHER,   // the whole fused pass over the frame, including contrast and pack
+  STAGE_CONTRAST, // contrast adjustment and pack are summed up per line, over all dithering threads
+  STAGE_PACK,
+  STAGE_WAKE,
+  STAGE_UPLOAD,
+  STAGE_READY,    // waiting for the display to finish refreshing
+  STAGE_SLEEP,
+  STAGE_TOTAL,
+  STAGE_CPU,      // CPU time used by all of vsmp during the refresh, not a stage of its own
+  STAGE_COUNT
+};
+
+static const char *stageNames[STAGE_COUNT] = {
+  "seek", "decode", "scale", "dither", "contrast", "pack", "wake", "upload", "ready", "sleep", "total", "cpu"
+};
+
+typedef struct {
+  double ms[STAGE_COUNT];
+  int packets; // packets sent to the decoder
+  int decoded; // frames decoded
+  int transactions; // transactions with the display controller since the last refresh, if the driver counts them
+  long long copied; // bytes copied since the last refresh, see countCopy
+  long peakRss;     // peak resident set size in kB
+  long long allocations;      // heap allocations by vsmp since the last refresh, see MEMORY_AUDIT
+  long long libavAllocations; // and by libav
+} RefreshTiming;
+
+static RefreshTiming frameTiming;
+static RefreshTiming refreshTiming;
+static struct timespec refreshCpuStart;
+
+static RefreshTiming timingHistory[TIMING_HISTORY];
+static int timingHistoryCount = 0;
+static int timingHistoryNext = 0;
+
+static volatile sig_atomic_t timingSummaryRequested = 0;
+
+// Per-line stages, in ns
+static atomic_llong contrastNs;
+static atomic_llong packNs;
+
+static atomic_llong copiedBytes;
+
+static double msSince(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static long long nsSince(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
+// Counts bytes copied from one buffer to another, by vsmp or by a decoder that can't decode into our buffers
+static void countCopy(long long bytes) {
+  atomic_fetch_add(&copiedBytes, bytes);
+}
+
+// Adds the time since start to a stage of the refresh in progress
+static void timeStage(int stage, const struct timespec *start) {
+  refreshTiming.ms[stage] += msSince(start);
+}
+
+// Moves the per-line stages into frameTiming once a frame has been processed
+static void collectLineTiming() {
+  frameTiming.ms[STAGE_CONTRAST] = atomic_exchange(&contrastNs, 0) / 1000000.0;
+  frameTiming.ms[STAGE_PACK] = atomic_exchange(&packNs, 0) / 1000000.0;
+}
+
+// Copies the stages of preparing the frame that is about to be displayed into the refresh in progress
+static void timingTakeFrame(const RefreshTiming *prepared) {
+  for (int s = STAGE_SEEK; s <= STAGE_PACK; s++)
+    refreshTiming.ms[s] = prepared->ms[s];
+  refreshTiming.packets = prepared->packets;
+  refreshTiming.decoded = prepared->decoded;
+}
+
+static void timingSignal(int signal) {
+  timingSummaryRequested = 1;
+}
+
+static void timingInit() {
+  signal(SIGUSR1, timingSignal);
+}
+
+#if TIMING_CSV
+  // Number of rows in the CSV file, -1 if there is none
+  static int countCsvRows() {
+    FILE *in = fopen(TIMING_CSV_FILE, "r");
+    int c, lines = 0;
+
+    if (!in)
+      return -1;
+    while ((c = fgetc(in)) != EOF)
+      lines += c == '\n';
+    fclose(in);
+    return lines > 0 ? lines - 1 : 0;
+  }
+#endif
+
+// Appends the refresh in progress to TIMING_CSV_FILE, moving a full file to TIMING_CSV_FILE.1 first
+// The file is kept open, so only moving it allocates memory
+static void timingWriteCsv(int frame) {
+  #if TIMING_CSV
+    static int rows = -2; // rows in the file, -2 until the file has been looked at
+    static FILE *out = NULL;
+    int s;
+
+    if (rows == -2) {
+      rows = countCsvRows();
+      if (rows >= 0 && rows < TIMING_CSV_ROWS && !(out = fopen(TIMING_CSV_FILE, "a"))) {
+        rows = -2;
+        return;
+      }
+    }
+
+    if (rows < 0 || rows >= TIMING_CSV_ROWS) {
+      if (out)
+        fclose(out);
+      if (rows >= 0)
+        rename(TIMING_CSV_FILE, TIMING_CSV_FILE ".1");
+      if (!(out = fopen(TIMING_CSV_FILE, "w"))) {
+        rows = -2;
+        return;
+      }
+      fprintf(out, "time,frame,packets,decoded,transactions,copied_bytes,peak_rss_kb,allocations,libav_allocations");
+      for (s = 0; s < STAGE_COUNT; s++)
+        fprintf(out, ",%s_ms", stageNames[s]);
+      fprintf(out, "\n");
+      rows = 0;
+    }
+
+    fprintf(out, "%ld,%d,%d,%d,%d,%lld,%ld,%lld,%lld", (long) time(NULL), frame, refreshTiming.packets, refreshTiming.decoded,
+      refreshTiming.transactions, refreshTiming.copied, refreshTiming.peakRss, refreshTiming.allocations,
+      refreshTiming.libavAllocations);
+    for (s = 0; s < STAGE_COUNT; s++)
+      fprintf(out, ",%.1f", refreshTiming.ms[s]);
+    fprintf(out, "\n");
+    fflush(out);
+    rows++;
+  #endif
+}
+
+// Starts timing a new refresh
+static void timingBeginRefresh() {
+  memset(&refreshTiming, 0, sizeof(refreshTiming));
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &refreshCpuStart);
+}
+
+// Logs the refresh that just finished and adds it to the history
+static void timingEndRefresh(int frame, const struct timespec *start) {
+  int s;
+
+  struct timespec cpu;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+  refreshTiming.ms[STAGE_CPU] = (cpu.tv_sec - refreshCpuStart.tv_sec) * 1000.0 + (cpu.tv_nsec - refreshCpuStart.tv_nsec) / 1000000.0;
+  refreshTiming.ms[STAGE_TOTAL] = msSince(start);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  refreshTiming.peakRss = usage.ru_maxrss;
+  refreshTiming.copied = atomic_exchange(&copiedBytes, 0);
+  refreshTiming.allocations = atomic_exchange(&ownAllocations, 0);
+  refreshTiming.libavAllocations = atomic_exchange(&libavAllocations, 0);
+
+  #if TIMING_LOG
+    printf("Timing frame=%d packets=%d decoded=%d transactions=%d copied=%lld rss=%ld", frame, refreshTiming.packets,
+      refreshTiming.decoded, refreshTiming.transactions, refreshTiming.copied, refreshTiming.peakRss);
+    #if MEMORY_AUDIT
+      printf(" allocs=%lld libav-allocs=%lld", refreshTiming.allocations, refreshTiming.libavAllocations);
+    #endif
+    for (s = 0; s < STAGE_COUNT; s++)
+      printf(" %s=%.1f", stageNames[s], refreshTiming.ms[s]);
+    printf("\n");
+  #endif
+  timingWriteCsv(frame);
+
+  timingHistory[timingHistoryNext] = refreshTiming;
+  timingHistoryNext = (timingHistoryNext + 1) % TIMING_HISTORY;
+  if (timingHistoryCount < TIMING_HISTORY)
+    timingHistoryCount++;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+// Prints min / avg / p99 of every stage over the refreshes in the history if a summary was requested by SIGUSR1
+static void timingCheckSummary() {
+  double values[TIMING_HISTORY];
+  int r, s;
+
+  if (!timingSummaryRequested)
+    return;
+  timingSummaryRequested = 0;
+
+  printf("Timing over the last %d refreshes (ms):\n", timingHistoryCount);
+  if (!timingHistoryCount)
+    return;
+
+  printf("%-10s %10s %10s %10s\n", "stage", "min", "avg", "p99");
+  for (s = 0; s < STAGE_COUNT; s++) {
+    double sum = 0;
+    for (r = 0; r < timingHistoryCount; r++) {
+      values[r] = timingHistory[r].ms[s];
+      sum += values[r];
+    }
+    qsort(values, timingHistoryCount, sizeof(double), compareDoubles);
+
+    // Nearest rank
+    int p99 = (timingHistoryCount * 99 + 99) / 100 - 1;
+    printf("%-10s %10.1f %10.1f %10.1f\n", stageNames[s], values[0], sum / timingHistoryCount, values[p99]);
+  }
+}
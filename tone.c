@@ -0,0 +1,160 @@
+// Tone curve
+// Every pixel goes through contrastLut (see loadLine in dither.c) on its way to the dithering, which maps the
+// decoded grey values to the ones that are dithered. The table is built here from the tone settings:
+// black and white point, gamma, an S-curve for more contrast in the midtones and the measured response of the panel
+// With auto-levels, the black and white point are taken from every frame's histogram instead, which is
+// built from a sample of the frame before it is dithered, after which the table is rebuilt for that frame
+
+#include <math.h>
+
+#define TONE_SAMPLE 4        // the histogram counts every TONE_SAMPLE-th pixel of every TONE_SAMPLE-th line
+#define TONE_CURVE_LEVELS 256 // most grey levels a panel response curve can have
+
+static unsigned char contrastLut[256];
+static int contrastIdentity = 1; // set if contrastLut doesn't change anything
+
+// Panel response, brightness of the panel's grey levels from black to white scaled to 0 - 255, see toneInit
+static double panelCurve[TONE_CURVE_LEVELS];
+static int panelCurveLevels = 0; // 0 if there is no curve
+
+// Black and white point set by auto-levels, -1 for the configured ones
+static int toneBlack = -1, toneWhite = -1;
+
+// Reads the panel response curve: the brightness of every grey level the panel shows, from black to white,
+// in any unit, separated by whitespace. Returns -1 if it can't be used
+static int loadPanelCurve(const char *path) {
+  FILE *in = fopen(path, "r");
+  double value;
+  int i;
+
+  if (!in) {
+    printf("ERROR could not open panel curve %s\n", path);
+    return -1;
+  }
+
+  panelCurveLevels = 0;
+  while (panelCurveLevels < TONE_CURVE_LEVELS && fscanf(in, "%lf", &value) == 1)
+    panelCurve[panelCurveLevels++] = value;
+  fclose(in);
+
+  if (panelCurveLevels < 2) {
+    printf("ERROR panel curve %s needs the brightness of at least 2 grey levels\n", path);
+    panelCurveLevels = 0;
+    return -1;
+  }
+
+  for (i = 1; i < panelCurveLevels; i++) {
+    if (panelCurve[i] <= panelCurve[i - 1]) {
+      printf("ERROR panel curve %s has to get brighter with every grey level\n", path);
+      panelCurveLevels = 0;
+      return -1;
+    }
+  }
+
+  double black = panelCurve[0], white = panelCurve[panelCurveLevels - 1];
+  for (i = 0; i < panelCurveLevels; i++)
+    panelCurve[i] = (panelCurve[i] - black) * 255 / (white - black);
+  printf("Read the response of %d grey levels from %s\n", panelCurveLevels, path);
+  return 0;
+}
+
+// Checks the tone settings and reads the panel curve, returns -1 if they can't be used
+static int toneInit() {
+  if (config.blackValue >= config.whiteValue) {
+    printf("ERROR the black value (%d) has to be below the white value (%d)\n", config.blackValue, config.whiteValue);
+    return -1;
+  }
+  panelCurveLevels = 0;
+  return *config.panelCurve ? loadPanelCurve(config.panelCurve) : 0;
+}
+
+// Maps a grey value (0 - 255, already stretched between black and white point) through gamma, S-curve and panel response
+static double toneCurve(double value) {
+  double x = value / 255;
+
+  x = pow(x, 100.0 / config.gamma);
+
+  // Blends towards smoothstep, which is steeper in the middle and flat towards black and white
+  x += (x * x * (3 - 2 * x) - x) * config.sCurve / 100;
+
+  // The dithering spreads pixels evenly between the panel's levels, so the value is moved to where the
+  // panel's actual brightness, interpolated between its levels, is the one asked for
+  if (panelCurveLevels) {
+    double target = x * 255;
+    int level = 1;
+    while (level < panelCurveLevels - 1 && panelCurve[level] < target)
+      level++;
+    double position = level - 1 + (target - panelCurve[level - 1]) / (panelCurve[level] - panelCurve[level - 1]);
+    x = position / (panelCurveLevels - 1);
+  }
+
+  x = x * 255 + 0.5;
+  return x < 0 ? 0 : (x > 255 ? 255 : x);
+}
+
+// Fills contrastLut for the current black and white point, unless it already is
+static void toneSetup() {
+  static int lutBlack = -1, lutWhite = -1, lutGamma = 0, lutSCurve = 0, lutLevels = 0;
+  int black = toneBlack < 0 ? config.blackValue : toneBlack;
+  int white = toneWhite < 0 ? config.whiteValue : toneWhite;
+
+  if (lutBlack == black && lutWhite == white && lutGamma == config.gamma && lutSCurve == config.sCurve
+    && lutLevels == panelCurveLevels)
+    return;
+
+  // Without a curve, the stretch between black and white point is done in integers only
+  int curve = config.gamma != 100 || config.sCurve || panelCurveLevels;
+  contrastIdentity = 1;
+  for (int i = 0; i < 256; i++) {
+    int value = i <= black ? 0 : ((i - black) << 8) / (white - black);
+    value = value > 255 ? 255 : value;
+    contrastLut[i] = curve ? toneCurve(value) : value;
+    contrastIdentity &= contrastLut[i] == i;
+  }
+
+  lutBlack = black;
+  lutWhite = white;
+  lutGamma = config.gamma;
+  lutSCurve = config.sCurve;
+  lutLevels = panelCurveLevels;
+}
+
+// Sets the black and white point from the frame's histogram and rebuilds contrastLut for it
+// AUTO_LEVELS_CLIP per mille of the pixels may end up pure black or white,
+// frames with less than AUTO_LEVELS_MIN_RANGE grey levels between those aren't stretched any further
+static void toneAutoLevels(const unsigned char *frameBuf, int linesize, int width, int height) {
+  uint32_t histogram[256] = { 0 };
+  uint32_t samples = 0, clipped, count;
+  struct timespec start;
+  int x, y, black, white;
+
+  if (!config.autoLevels)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (y = TONE_SAMPLE / 2; y < height; y += TONE_SAMPLE) {
+    const unsigned char *line = frameBuf + y * linesize;
+    for (x = TONE_SAMPLE / 2; x < width; x += TONE_SAMPLE)
+      histogram[line[x]]++;
+  }
+  for (x = 0; x < 256; x++)
+    samples += histogram[x];
+  clipped = (uint64_t) samples * AUTO_LEVELS_CLIP / 1000;
+
+  for (black = 0, count = 0; black < 255 && count + histogram[black] <= clipped; black++)
+    count += histogram[black];
+  for (white = 255, count = 0; white > 0 && count + histogram[white] <= clipped; white--)
+    count += histogram[white];
+
+  // Widen narrow ranges around their middle, staying within 0 - 255
+  if (white - black < AUTO_LEVELS_MIN_RANGE) {
+    black = (black + white - AUTO_LEVELS_MIN_RANGE) / 2;
+    black = black < 0 ? 0 : (black > 255 - AUTO_LEVELS_MIN_RANGE ? 255 - AUTO_LEVELS_MIN_RANGE : black);
+    white = black + AUTO_LEVELS_MIN_RANGE;
+  }
+
+  toneBlack = black;
+  toneWhite = white;
+  toneSetup();
+  atomic_fetch_add_explicit(&contrastNs, nsSince(&start), memory_order_relaxed);
+}
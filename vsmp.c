@@ -2,10 +2,22 @@
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
 #include "vsmp.h"
+#include "config.c"
+#include "memory.c"
+#include "timing.c"
+#include "tone.c"
+#include "pack.c"
+#include "wavefront.c"
 #include "dither.c"
+#include "scene.c"
+#include "scale.c"
+#include "index.c"
 
 #if DRYRUN != 1
   // Change this include if you're using a custom display driver
@@ -14,12 +26,23 @@
   #include "displays/dryrun.c"
 #endif
 
+#include "container.c"
+#include "prefetch.c"
+
 #if LIGHSENSE == 1
   #include <bcm2835.h>
 #endif
 
+static int openVideo(const char *path);
+
+static int transcode(const char *videoPath, const char *containerPath);
+
+static int showFrame(int frame);
+
+static void prepareFrame(int frame);
+
 static void displayFrame(
-  int64_t timestamp,
+  int frameNumber,
   int streamIdx,
   AVFormatContext *formatCtx,
   AVCodecContext *codecCtx,
@@ -27,7 +50,15 @@ static void displayFrame(
   AVFrame *frame
 );
 
-static void processFrame(unsigned char *frameBuf, int linesize, int width, int height);
+static int needsSeek(int frameNumber, int64_t timestamp);
+
+static int64_t frameTimestamp(int frame);
+
+static int readVideoPacket(AVFormatContext *formatCtx, int streamIdx, AVPacket *packet);
+
+static void convertFrame(const AVFrame *frame);
+
+static void processFrame(const unsigned char *frameBuf, int linesize, int width, int height);
 
 static int lightsense();
 
@@ -36,6 +67,34 @@ static void backupProgress(int frame);
 // Duration of one frame in AV_TIME_BASE units
 int64_t timeBase;
 int target = 0;
+int frameCount = 0;
+
+AVFormatContext *pFormatContext = NULL;
+AVCodecContext *pCodecContext = NULL;
+AVFrame *pFrame = NULL;
+AVPacket *pPacket = NULL;
+int video_stream_index = -1;
+
+// Where processed frames go, the display unless we're prefetching or transcoding
+// target provides the buffer a frame is packed into, push is handed that buffer once the frame is complete
+// Sinks that can work on partial frames may also be told before dithering starts (begin) and after every line (progress)
+typedef struct {
+  uint8_t *(*target)(int width, int height);
+  void (*begin)(const uint8_t *packedBuf, int width, int height);
+  void (*progress)(int lines);
+  void (*push)(const uint8_t *packedBuf, int width, int height);
+} FrameSink;
+
+#ifdef DISPLAY_STREAMING
+  static FrameSink frameSink = { transferBuffer, pixelStreamBegin, pixelStreamLines, pixelStreamEnd };
+#else
+  static FrameSink frameSink = { transferBuffer, NULL, NULL, pixelPushPacked };
+#endif
+
+// Decoder position for sequential decoding: pts of the last frame returned by the decoder
+int64_t decoderCursor = AV_NOPTS_VALUE;
+int64_t lastKeyframePts = AV_NOPTS_VALUE;
+int64_t gopLength = 0; // longest keyframe distance seen so far in frames, 0 if unknown
 
 void cleanup() {
   printf("Shutting down");
@@ -46,21 +105,65 @@ void cleanup() {
 // libav code patched together from multiple sources,
 // most importantly https://github.com/leandromoreira/ffmpeg-libav-tutorial/blob/master/0_hello_world.c
 int main(int argc, const char *argv[]) {
+  // Settings from the config file and leading options, the rest of the command line is parsed as before
+  int first = configArgs(argc, argv);
+  if (first < 0 || memoryInit() || ditherSetup())
+    return -1;
+  argv[first - 1] = argv[0];
+  argv += first - 1;
+  argc -= first - 1;
 
-  if (argc == 2) {
+  if (argc == 3 && strcmp(argv[1], "--build-index") == 0) {
+    return buildIndex(argv[2]);
+  }
+  else if (argc == 4 && strcmp(argv[1], "--transcode") == 0) {
+    return transcode(argv[2], argv[3]);
+  }
+  else if (argc == 2 && strcmp(argv[1], "--dither-selftest") == 0) {
+    return ditherSelftest();
+  }
+  #ifdef DISPLAY_SPI_SELFTEST
+    else if (argc == 2 && strcmp(argv[1], "--spi-selftest") == 0) {
+      if (initDisplay()) {
+        printf("Display init error \n");
+        return 1;
+      }
+      return spiSelftest();
+    }
+  #endif
+  else if (argc == 2) {
     printf("Attempting to read vsmp-index file\n");
     FILE *f = fopen("vsmp-index", "r");
     char fidx[16];
-    fgets(fidx, 16, f);
-    target = atoi(fidx);
-    fclose(f);
-    printf("Resuming playback at frame %d\n", target);
+    if (f && fgets(fidx, 16, f) && atoi(fidx) >= 0) {
+      target = atoi(fidx);
+      printf("Resuming playback at frame %d\n", target);
+    }
+    else
+      printf("No usable vsmp-index file found, starting from the beginning\n");
+    if (f)
+      fclose(f);
   }
   else if (argc == 3) {
-    target = atoi(argv[2]);
+    char *end;
+    long frame = strtol(argv[2], &end, 10);
+    if (end == argv[2] || *end || frame < 0 || frame > INT_MAX) {
+      printf("ERROR invalid frame index '%s', expected a frame number from 0\n", argv[2]);
+      return -1;
+    }
+    target = frame;
   }
   else {
-    printf("Usage: vsmp [video file] [frame index]\n");
+    printf("Usage: vsmp [options] [video or container file] [frame index]\n");
+    printf("       vsmp --build-index [video file]\n");
+    printf("       vsmp --transcode [video file] [container file]\n");
+    printf("       vsmp --dither-selftest\n");
+    printf("       vsmp --spi-selftest\n");
+    printf("Options, which override vsmp.conf and the defaults from vsmp.h:\n");
+    printf("       --config [file] --bpp [1-8] --transport-bpp [2, 4 or 8] --frames-per-hour [n] --frame-step [n]\n");
+    printf("       --white [1-255] --black [0-254] --gamma [0.2-5] --s-curve [0-100] --auto-levels [0 or 1] --panel-curve [file]\n");
+    printf("       --scale [0-2] --scale-width [n] --scale-height [n] --hwaccel [0 or 1] --dither [algorithm]\n");
+    printf("       --noise-seed [n] --blue-noise-offset [0 or 1]\n");
     return -1;
   }
 
@@ -69,28 +172,164 @@ int main(int argc, const char *argv[]) {
     return 1;
   }
   printf("Display initialized\n");
-  
+
+  // Pre-dithered containers are played without touching libav
+  int container = containerOpen(argv[1]);
+  if (container < 0)
+    return -1;
+
+  // Frame numbers given on the command line and in vsmp-index always count source frames,
+  // so a container continues where its video left off. Container records are frame-step source frames apart
+  int stepSize = container ? 1 : config.frameStepSize;
+  int sourceStep = container ? containerHeader->frameStep : 1;
+
+  if (container) {
+    frameCount = containerHeader->frameCount;
+    target /= sourceStep;
+  }
+  else if (openVideo(argv[1]))
+    return -1;
+
+  if (target >= frameCount) {
+    printf("ERROR frame %d is past the end of the video, which has %d frames\n", target * sourceStep, frameCount * sourceStep);
+    return -1;
+  }
+
+  int panelWidth, panelHeight;
+  displaySize(&panelWidth, &panelHeight);
+  if (!container && scaleSetup(panelWidth, panelHeight))
+    return -1;
+
+  #if PREFETCH
+    if (!container) {
+      frameSink = (FrameSink) { prefetchTarget, NULL, NULL, prefetchSink };
+      if (prefetchInit(prepareFrame, frameCount)) {
+        printf("ERROR could not start prefetch thread\n");
+        return -1;
+      }
+    }
+  #endif
+
+  #if LIGHSENSE
+    if (!bcm2835_init()) {
+      printf("bcm2835_init error (lightsense init) \n");
+      return 1;
+    }
+    printf("Lightsense init done \n");
+  #endif
+
+  clearDisplay();
+  printf("Display cleared \n");
+
+  struct timespec loopstart;
+  uint8_t consecutivePaints = 0;
+  int refreshes = 0, skippedRefreshes = 0;
+  int advanced = 0; // frames advanced through without waiting, see SCENE_ADVANCE
+
+  signal(SIGINT, cleanup);
+  timingInit();
+
+  while(target < frameCount) {
+    int skipped = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &loopstart);
+    timingBeginRefresh();
+
+    #if LIGHSENSE
+      if(lightsense())
+    #endif
+    {
+      if (container)
+        containerDisplayFrame(target);
+      else
+        skipped = showFrame(target);
+      timingEndRefresh(target, &loopstart);
+      memoryCheckRefresh(target, refreshTiming.allocations);
+    }
+
+    consecutivePaints++;
+    target += stepSize;
+
+    if(consecutivePaints % 32 == 0)
+      backupProgress(target * sourceStep);
+
+    refreshes++;
+    if (skipped) {
+      skippedRefreshes++;
+      printf("Skipped %d of %d refreshes so far\n", skippedRefreshes, refreshes);
+
+      // Go on with the next frame right away
+      if (advanced < SCENE_ADVANCE) {
+        advanced++;
+        continue;
+      }
+    }
+    advanced = 0;
+
+    // Wall clock time, so time spent waiting for the display counts too
+    int timeSpent = msSince(&loopstart) / 1000;
+    int sleepTime = (3600 / config.framesPerHour) - timeSpent;
+
+    // SIGUSR1 interrupts the sleep, print the timing summary and sleep for the rest of the time
+    timingCheckSummary();
+    while(sleepTime > 0) {
+      sleepTime = sleep(sleepTime);
+      timingCheckSummary();
+    }
+  }
+
+  // CLEANUP
+
+  teardownDisplay();
+
+  if (!container) {
+    avformat_close_input(&pFormatContext);
+    av_packet_free(&pPacket);
+    av_frame_free(&pFrame);
+    avcodec_free_context(&pCodecContext);
+  }
+  return 0;
+}
+
+// Frames are decoded into libav's buffers, which it keeps in a pool of its own (AVBufferPool) and reuses
+// Decoders without direct rendering (AV_CODEC_CAP_DR1, e.g. h264_mmal) copy every frame from their own memory
+// into one of those, that copy is counted by countCopy
+static int countingGetBuffer(AVCodecContext *codecCtx, AVFrame *frame, int flags) {
+  if (!(codecCtx->codec->capabilities & AV_CODEC_CAP_DR1)) {
+    int size = av_image_get_buffer_size(frame->format, frame->width, frame->height, 1);
+    countCopy(size > 0 ? size : 0);
+  }
+  return avcodec_default_get_buffer2(codecCtx, frame, flags);
+}
+
+// Opens the video file and sets up the decoder, see openVideo
+static int openDecoder(const char *path) {
   // AVFormatContext holds the header information from the format (Container)
   // http://ffmpeg.org/doxygen/trunk/structAVFormatContext.html
-  AVFormatContext *pFormatContext = avformat_alloc_context();
+  pFormatContext = avformat_alloc_context();
   if (!pFormatContext) {
     printf("ERROR could not allocate memory for Format Context");
     return -1;
   }
 
-  if (avformat_open_input(&pFormatContext, argv[1], NULL, NULL) != 0) {
+  if (avformat_open_input(&pFormatContext, path, NULL, NULL) != 0) {
     printf("ERROR could not open the file");
     return -1;
   }
 
-  if (avformat_find_stream_info(pFormatContext,  NULL) < 0) {
+  memoryOwner(1);
+  loadIndex(path, pFormatContext);
+  memoryOwner(0);
+
+  // Probing the stream info takes a while, with an index we only do it if the container header lacks the basics
+  if ((!indexHeader || pFormatContext->streams[indexHeader->streamIdx]->codecpar->width <= 0) &&
+      avformat_find_stream_info(pFormatContext,  NULL) < 0) {
     printf("ERROR could not get the stream info");
     return -1;
   }
 
   AVCodec *pCodec = NULL;
   AVCodecParameters *pCodecParameters =  NULL;
-  int video_stream_index = -1;
 
   // loop though all the streams and print its main information
   for (int i = 0; i < pFormatContext->nb_streams; i++) {
@@ -101,18 +340,22 @@ int main(int argc, const char *argv[]) {
     if (pLocalCodecParameters->codec_type == AVMEDIA_TYPE_VIDEO) {
       video_stream_index = i;
 
-      #if HWACCEL
+      if (config.hwaccel)
         pCodec = avcodec_find_decoder_by_name("h264_mmal");
-      #else
+      else
         pCodec = avcodec_find_decoder(pLocalCodecParameters->codec_id);
-      #endif
-      
+
       pCodecParameters = pLocalCodecParameters;
     } 
   }
 
+  if (!pCodec) {
+    printf("ERROR could not find a decoder%s\n", config.hwaccel ? " (hwaccel needs ffmpeg with the h264_mmal decoder)" : "");
+    return -1;
+  }
+
   // https://ffmpeg.org/doxygen/trunk/structAVCodecContext.html
-  AVCodecContext *pCodecContext = avcodec_alloc_context3(pCodec);
+  pCodecContext = avcodec_alloc_context3(pCodec);
   if (!pCodecContext) {
     printf("failed to allocated memory for AVCodecContext");
     return -1;
@@ -125,6 +368,8 @@ int main(int argc, const char *argv[]) {
     return -1;
   }
 
+  pCodecContext->get_buffer2 = countingGetBuffer;
+
   // Initialize the AVCodecContext to use the given AVCodec.
   // https://ffmpeg.org/doxygen/trunk/group__lavc__core.html#ga11f785a188d7d9df71621001465b0f1d
   if (avcodec_open2(pCodecContext, pCodec, NULL) < 0) {
@@ -134,153 +379,339 @@ int main(int argc, const char *argv[]) {
 
   AVStream *vidstream;
   vidstream = pFormatContext->streams[video_stream_index];
-  timeBase = (vidstream->time_base.den * vidstream->r_frame_rate.den) / (vidstream->time_base.num * vidstream->r_frame_rate.num);
+
+  if (indexHeader && indexHeader->streamIdx != video_stream_index) {
+    printf("Index file does not match the video stream, ignoring it\n");
+    indexHeader = NULL;
+    indexEntries = NULL;
+  }
+
+  // Without probing the stream info the frame rate may be unknown, the index has the frame duration
+  timeBase = indexHeader ? indexHeader->timeBase : frameDuration(vidstream);
+  if (timeBase <= 0) {
+    printf("ERROR the frame rate of the video is unknown\n");
+    return -1;
+  }
+
+  // Container duration is given in AV_TIME_BASE units
+  frameCount = indexHeader ? indexHeader->frameCount :
+    av_rescale_q(pFormatContext->duration, AV_TIME_BASE_Q, vidstream->time_base) / timeBase;
 
   // https://ffmpeg.org/doxygen/trunk/structAVFrame.html
-  AVFrame *pFrame = av_frame_alloc();
+  pFrame = av_frame_alloc();
   if (!pFrame) {
     printf("failed to allocated memory for AVFrame");
     return -1;
   }
   
   // https://ffmpeg.org/doxygen/trunk/structAVPacket.html
-  AVPacket *pPacket = av_packet_alloc();
+  pPacket = av_packet_alloc();
   if (!pPacket) {
     printf("failed to allocated memory for AVPacket");
     return -1;
   }
 
-  #if LIGHSENSE
-    if (!bcm2835_init()) {
-      printf("bcm2835_init error (lightsense init) \n");
-      return 1;
-    }
-    printf("Lightsense init done \n");
-  #endif
-
-  // INIT DONE
   printf("FFmpeg init done\n");
+  return 0;
+}
 
-  clearDisplay();
-  printf("Display cleared \n");
-
-  int64_t timestamp = target * timeBase;
-  clock_t loopstart;
-  uint8_t consecutivePaints = 0;
-
-  signal(SIGINT, cleanup);
-
-  while(timestamp < pFormatContext->duration) {
-    loopstart = clock();
-
-    #if LIGHSENSE
-      if(lightsense()) {
-        displayFrame(timestamp, video_stream_index, pFormatContext, pCodecContext, pPacket, pFrame);  
-      }
-    #else
-      displayFrame(timestamp, video_stream_index, pFormatContext, pCodecContext, pPacket, pFrame);
-    #endif
+// Opens the video file and sets up the decoder
+// Apart from the index, everything allocated on the way is libav's, including its decoder threads (see memoryOwner)
+static int openVideo(const char *path) {
+  memoryOwner(0);
+  int status = openDecoder(path);
+  memoryOwner(1);
+  return status;
+}
 
-    consecutivePaints++;
-    target += FRAME_STEP_SIZE;
-    timestamp = target * timeBase;
+// Runs every frame-step-th frame of the video through the frame pipeline and stores the results in a container
+static int transcode(const char *videoPath, const char *containerPath) {
+  if (scaleSetup(0, 0) || openVideo(videoPath) || containerCreate(containerPath))
+    return -1;
 
-    if(consecutivePaints % 32 == 0)
-      backupProgress(target);
+  frameSink = (FrameSink) { containerTarget, NULL, NULL, containerWriteFrame };
+  sceneDetection = 0;
 
-    int timeSpent = (clock() - loopstart) / CLOCKS_PER_SEC;
-    int sleepTime = (3600 / FRAMES_PER_HOUR) - timeSpent;
-    if(sleepTime > 0)
-      sleep(sleepTime);
+  for (target = 0; target < frameCount; target += config.frameStepSize) {
+    containerOutRecord = target / config.frameStepSize;
+    prepareFrame(target);
   }
 
-  // CLEANUP
-
-  teardownDisplay();
-
   avformat_close_input(&pFormatContext);
   av_packet_free(&pPacket);
   av_frame_free(&pFrame);
   avcodec_free_context(&pCodecContext);
-  return 0;
+  return containerFinish();
+}
+
+// Puts the given video frame on the display
+// Returns 1 if the frame was skipped as it looks the same as the one on display
+static int showFrame(int frame) {
+  int skipped = 0;
+
+  #if PREFETCH
+    // A frame that was uploaded to the display ahead of time only needs a display command
+    #ifdef DISPLAY_PRELOAD
+      prefetchWait();
+      if (prefetchWasSkipped(frame))
+        skipped = 1;
+      else if (pixelShowPreloaded(frame))
+    #endif
+    {
+      PrefetchSlot *slot = prefetchTake(frame);
+      if (slot) {
+        timingTakeFrame(&slot->timing);
+        skipped = slot->skipped;
+        if (!skipped)
+          pixelPushPacked(slot->packed, slot->width, slot->height);
+      }
+    }
+
+    // Prepare the next frame while this one is on display
+    // This only happens after frames that were actually shown, so no work is wasted while lightsense keeps us paused
+    if (frame + config.frameStepSize < frameCount)
+      prefetchStart(frame + config.frameStepSize);
+  #else
+    prepareFrame(frame);
+    timingTakeFrame(&frameTiming);
+    skipped = sceneSkipped;
+  #endif
+
+  return skipped;
+}
+
+// Decodes and processes the given frame, passing the result on to frameSink
+static void prepareFrame(int frame) {
+  memset(&frameTiming, 0, sizeof(frameTiming));
+  sceneSkipped = 0;
+  displayFrame(frame, video_stream_index, pFormatContext, pCodecContext, pPacket, pFrame);
 }
 
 static void displayFrame(
-  int64_t timestamp,
+  int frameNumber,
   int streamIdx,
   AVFormatContext *formatCtx,
   AVCodecContext *codecCtx,
   AVPacket *packet,
   AVFrame *frame
 ) {
+  int64_t timestamp = frameTimestamp(frameNumber);
+  int decodedFrames = 0;
+  char seeked = 0;
+  char draining = 0;
+  struct timespec start;
+
+  noiseFrame = frameNumber;
+
+  // Allocations while seeking and decoding are libav's
+  memoryOwner(0);
+
+  if(needsSeek(frameNumber, timestamp)) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Seek to closest preceeding i-frame, which the index knows exactly
+    // Frames still buffered in the decoder belong to the old position, so flush them
+    if (indexEntries)
+      av_seek_frame(formatCtx, streamIdx, indexEntries[indexEntries[frameNumber].keyframe].pts, AVSEEK_FLAG_BACKWARD);
+    else
+      av_seek_frame(formatCtx, streamIdx, timestamp, AVSEEK_FLAG_BACKWARD);
+    avcodec_flush_buffers(codecCtx);
+    decoderCursor = AV_NOPTS_VALUE;
+    lastKeyframePts = AV_NOPTS_VALUE;
+    seeked = 1;
+    frameTiming.ms[STAGE_SEEK] = msSince(&start);
+  }
+
+  // Everything up to processing the target frame counts as decoding
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (1) {
+    int response = avcodec_receive_frame(codecCtx, frame);
+
+    // Decoder needs more input, feed it the next packet of our stream
+    if (response == AVERROR(EAGAIN)) {
+      int status = readVideoPacket(formatCtx, streamIdx, packet);
+
+      // For some reason, the mmal decoder freaks out every now and then (~ once per week?), which I believe causes an endless loop here
+      // So if we get an unknown decoding error, we'll just skip this frame
+      if (status == AVERROR_UNKNOWN)
+        break;
 
-  // Seek to closest preceeding i-frame
-  // This may not be necessary (and actually inefficient) when playing continuously frame-by-frame
-  // but it keeps us from having to worry too much about out-of-order frames being lost
-  av_seek_frame(formatCtx, streamIdx, timestamp, AVSEEK_FLAG_BACKWARD);
-
-  char breakflag = 0;
-  int status = av_read_frame(formatCtx, packet);
-
-  // For some reason, the mmal decoder freaks out every now and then (~ once per week?), which I believe causes an endless loop here
-  // So if we get an unknown decoding error, we'll just skip this frame
-  while (status >= 0 && status != AVERROR_UNKNOWN) {
-    if (packet->stream_index == streamIdx) {
-      int response = avcodec_send_packet(codecCtx, packet);
-
-      // One packet may contain multiple frames
-      while (response >= 0) {
-        response = avcodec_receive_frame(codecCtx, frame);
-       
-        // Frames may arrive out-of-order, so we'll check that we find a reasonably close match
-        if(frame->pts >= timestamp && frame->pts <= timestamp + timeBase * 2) {
-          processFrame(frame->data[0], frame->linesize[0], frame->width, frame->height);
-          breakflag = 1;
+      if (status < 0) {
+        // End of file, drain frames still buffered in the decoder
+        if (draining || avcodec_send_packet(codecCtx, NULL) < 0)
           break;
-        }
+        draining = 1;
+        continue;
       }
 
-      if(breakflag)
+      status = avcodec_send_packet(codecCtx, packet);
+      av_packet_unref(packet);
+      frameTiming.packets++;
+
+      // A damaged packet only costs the frames depending on it, anything else leaves the decoder unusable
+      if (status == AVERROR_INVALIDDATA)
+        printf("Skipping a damaged packet\n");
+      else if (status < 0) {
+        printf("Error sending a packet to the decoder: %s\n", av_err2str(status));
+        decoderCursor = AV_NOPTS_VALUE;
         break;
+      }
+      continue;
+    }
+
+    if (response < 0) {
+      // Decoder error or fully drained, force a seek on the next refresh
+      decoderCursor = AV_NOPTS_VALUE;
+      break;
+    }
+
+    decodedFrames++;
+    frameTiming.decoded++;
+    decoderCursor = frame->pts;
+
+    // With an index, timestamps are exact
+    // Otherwise frames may arrive out-of-order, so we'll check that we find a reasonably close match
+    if(indexEntries ? frame->pts == timestamp : (frame->pts >= timestamp && frame->pts <= timestamp + timeBase * 2)) {
+      frameTiming.ms[STAGE_DECODE] = msSince(&start);
+      memoryOwner(1);
+      convertFrame(frame);
+      break;
+    }
+
+    // Frames come out in presentation order, so once the target has been passed it won't come anymore
+    if (frame->pts != AV_NOPTS_VALUE && frame->pts > timestamp) {
+      printf("Frame %d was not found, the decoder went past it\n", frameNumber);
+      break;
     }
-    av_packet_unref(packet);
-    status = av_read_frame(formatCtx, packet);
   }
+
+  memoryOwner(1);
+
+  // The target frame wasn't found, but the time was still spent decoding
+  if (!frameTiming.ms[STAGE_DECODE])
+    frameTiming.ms[STAGE_DECODE] = msSince(&start);
+
+  // A drained decoder won't accept new packets until it is flushed
+  if (draining)
+    decoderCursor = AV_NOPTS_VALUE;
+
+  printf("Decoded %d frames for frame %d (%s)\n", decodedFrames, frameNumber, seeked ? "seek" : "sequential");
+}
+
+// Decides whether the decoder has to be repositioned to reach timestamp,
+// or whether decoding forward from the current position is cheaper
+static int needsSeek(int frameNumber, int64_t timestamp) {
+  #if SEQUENTIAL_DECODE
+    if (decoderCursor == AV_NOPTS_VALUE || timestamp <= decoderCursor)
+      return 1;
+
+    // The index knows where decoding of the target has to start
+    if (indexEntries)
+      return indexEntries[indexEntries[frameNumber].keyframe].pts > decoderCursor;
+
+    if (!gopLength || lastKeyframePts == AV_NOPTS_VALUE)
+      return timestamp - decoderCursor > SEQUENTIAL_MAX_SKIP * timeBase;
+
+    // Seeking pays off as soon as there is a keyframe between the cursor and the target,
+    // as decoding would then start from that keyframe instead
+    return timestamp >= lastKeyframePts + gopLength * timeBase;
+  #else
+    return 1;
+  #endif
 }
 
-// Performs simple white value adjustment
-// Everything above newWhite in the buffer will be plain white
-static unsigned char contrastAdjust(unsigned char newWhite, unsigned char pixel) {
-  unsigned int in = pixel;
-  unsigned int out = (in << 8)/(newWhite);
-  if(out > 255)
-    return 255;
-  else
-    return (unsigned char) out;
+// Presentation timestamp of the given frame number
+static int64_t frameTimestamp(int frame) {
+  if (indexEntries)
+    return indexEntries[frame].pts;
+  return frame * timeBase;
 }
 
-static void contrastAdjustBuffer(unsigned char *frameBuf, int linesize, int width, int height) {
-  uint32_t i,j,idx;
+// Reads packets until one belonging to the video stream is found
+// Keyframe distances are tracked along the way to learn the GOP length of the file
+static int readVideoPacket(AVFormatContext *formatCtx, int streamIdx, AVPacket *packet) {
+  int status;
 
-  for(j = 0; j < height; j++) {
-    for(i = 0; i < width; i++) {
-      idx = j * linesize + i;
-      frameBuf[idx] = contrastAdjust(WHITE_VALUE, frameBuf[idx]);
+  while ((status = av_read_frame(formatCtx, packet)) >= 0) {
+    if (packet->stream_index == streamIdx)
+      break;
+    av_packet_unref(packet);
+  }
+
+  if (status >= 0 && (packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE) {
+    if (lastKeyframePts != AV_NOPTS_VALUE && packet->pts > lastKeyframePts) {
+      int64_t distance = (packet->pts - lastKeyframePts) / timeBase;
+      if (distance > gopLength)
+        gopLength = distance;
     }
+    lastKeyframePts = packet->pts;
+  }
+
+  return status;
+}
+
+// Hands the luma plane of a decoded frame to processFrame, scaled and cropped if that is configured, see scale.c
+static void convertFrame(const AVFrame *frame) {
+  const AVPixFmtDescriptor *format = av_pix_fmt_desc_get(frame->format);
+  static int warned = 0;
+  int linesize, width = frame->width, height = frame->height;
+  int plane = 0, step = 1, offset = 0;
+
+  // Frames without an 8 bit luma component are shown as if their first plane was grey
+  if (format && !(format->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM))
+    && format->comp[0].depth == 8) {
+    plane = format->comp[0].plane;
+    step = format->comp[0].step;
+    offset = format->comp[0].offset;
+  }
+  else if (!warned) {
+    printf("Frames in pixel format %s have no 8 bit luma plane, showing the first plane as grey\n", format ? format->name : "(unknown)");
+    warned = 1;
   }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  const uint8_t *grey = scaleFrame(frame->data[plane] + offset, frame->linesize[plane], step, &width, &height, &linesize);
+  frameTiming.ms[STAGE_SCALE] = msSince(&start);
+
+  processFrame(grey, linesize, width, height);
 }
 
-static void processFrame(unsigned char *frameBuf, int linesize, int width, int height) {
-  contrastAdjustBuffer(frameBuf, linesize, width, height);
-  DITHER(frameBuf, linesize, width, height);
-  pixelPush(frameBuf, linesize, width, height);
+// Dithers the frame after mapping it through the tone curve (see tone.c)
+// The tone curve, dithering and packing happen in a single pass over the frame, see readLine in dither.c
+// With auto-levels, a sample of the frame is read before that to pick the black and white value
+// The frame is only read, so the decoder can keep using it as a reference
+static void processFrame(const unsigned char *frameBuf, int linesize, int width, int height) {
+  // Frames that look like the one on display are neither dithered nor shown
+  if ((sceneSkipped = sceneUnchanged(frameBuf, linesize, width, height)))
+    return;
+
+  uint8_t *packed = frameSink.target(width, height);
+  if (!packed)
+    return;
+
+  if (frameSink.begin)
+    frameSink.begin(packed, width, height);
+  linePacked = frameSink.progress;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  toneAutoLevels(frameBuf, linesize, width, height);
+  ditherFrame(frameBuf, linesize, width, height, packed);
+  frameTiming.ms[STAGE_DITHER] = msSince(&start);
+  collectLineTiming();
+
+  frameSink.push(packed, width, height);
 }
 
+// Written without stdio streams, which would allocate memory every time
 static void backupProgress(int target) {
-  FILE *f;
-  f = fopen("vsmp-index", "w");
-  fprintf(f, "%d\n", target);
-  fclose(f);
+  char line[16];
+  int f = open("vsmp-index", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (f < 0)
+    return;
+  write(f, line, snprintf(line, sizeof(line), "%d\n", target));
+  close(f);
 }
 
 #if LIGHSENSE
@@ -2,13 +2,115 @@
 // Can be used to compile / test on a faster machine
 #define DRYRUN 0
 
+// Defaults for the settings that can be changed at runtime, in vsmp.conf or on the command line (see config.c)
+// bpp, transport-bpp, frames-per-hour, frame-step, white, black, gamma, s-curve, panel-curve, auto-levels,
+// scale, scale-width, scale-height, hwaccel, dither, noise-seed and blue-noise-offset
 #define BITS_PER_PIXEL 4
 #define TRANSPORT_BPP 4 // Bit packing used for transfer to the display controller - set equal to or higher than BPP to avoid quality loss. Supported values are 2, 4 and 8
 #define FRAMES_PER_HOUR 24 // refresh the display this many times per hour
 #define FRAME_STEP_SIZE 1  // on every display refresh, move this many frames forward in the source file
 #define WHITE_VALUE 255
+// Tone curve applied before dithering (see tone.c): grey values up to BLACK_VALUE become black and from WHITE_VALUE white,
+// GAMMA above 1 brightens the midtones, S_CURVE (0 - 100) adds contrast to them
+// PANEL_CURVE names a file with the measured brightness of the panel's grey levels, which the tone curve then makes up for
+#define BLACK_VALUE 0
+#define GAMMA 1.0
+#define S_CURVE 0
+#define PANEL_CURVE ""
+// Take black and white value from every frame instead (auto-levels), so that dark scenes use all grey levels
+// AUTO_LEVELS_CLIP per mille of the pixels may end up pure black or white, the range between black and white value
+// is never narrower than AUTO_LEVELS_MIN_RANGE, so that flat frames aren't stretched into noise
+#define AUTO_LEVELS 0
+#define AUTO_LEVELS_CLIP 5
+#define AUTO_LEVELS_MIN_RANGE 64
+// Scale decoded frames to the panel at runtime (scale), so videos don't have to be scaled and converted to grey beforehand
+// 0 shows frames at their size, 1 scales them to fit the panel, 2 scales them to cover the panel and crops the center
+// Frames are scaled to SCALE_WIDTH x SCALE_HEIGHT instead if those are set, which they have to be without a display
+#define SCALE_MODE 0
+#define SCALE_WIDTH 0
+#define SCALE_HEIGHT 0
 
-// Use RPi hardware acceleration to decode video frames
+// Keep the decoder position between refreshes and only decode forward to the next frame
+// instead of seeking to the closest preceding i-frame on every refresh
+// A seek is still performed when the target is behind the decoder or more than a GOP ahead
+#define SEQUENTIAL_DECODE 1
+#define SEQUENTIAL_MAX_SKIP 250 // GOP length assumed until the first two keyframes have been seen
+
+// vsmp's buffers (scaled frame, dithering, packed frames, ...) are allocated as the first frames arrive and then
+// reused, a report of their sizes is printed after the first refreshes (see memory.c). With MEMORY_ARENA_SIZE set to
+// a number of bytes, all of them come from one block of that size allocated at startup. Make it a little larger than
+// the total in the report. 0 allocates every buffer on its own
+// MEMORY_AUDIT counts heap allocations, logs them with every refresh and warns about any by vsmp itself after the first refreshes
+// It replaces malloc and pthread_create for the whole process, so it is meant for checking changes rather than for everyday use
+#define MEMORY_ARENA_SIZE 0
+#define MEMORY_AUDIT 0
+
+// Decode and dither the next frame in a background thread while the current one is on display
+// so that a refresh only takes as long as the transfer to the display
+#define PREFETCH 1
+
+// Upload upcoming frames into the display controller's own memory while the display is idle, so that with PREFETCH
+// a refresh is just a display command. Up to PRELOAD_FRAMES frames are kept there in panel-sized buffers
+// behind the controller's image buffer, as many as fit into CONTROLLER_MEMORY_SIZE bytes
+// 8 MB is on the safe side, raise it if your controller has more. Set PRELOAD_FRAMES to 0 to send every frame when it's due
+#define PRELOAD_FRAMES 4
+#define CONTROLLER_MEMORY_SIZE 0x800000
+
+// SPI clock divider for the display connection, the SPI clock is the core clock (250 MHz on most Pis) divided by this
+// Must be an even number from 2 to 65536, run `vsmp --spi-selftest` to find the fastest one that works with your wiring
+#define SPI_CLOCK_DIVIDER 32
+// With PREFETCH off, frames are sent to the display in chunks of this many bytes (must be even) while they are dithered,
+// a chunk as soon as it is complete, so the transfer overlaps with dithering the rest of the frame
+// With PREFETCH on, frames are complete before they are due and every area is sent in one transfer, so this isn't used
+#define SPI_CHUNK_SIZE 65536
+
+// Wait for the display controller without keeping the CPU busy, so decoding and dithering can go on during refreshes
+// HRDY is waited for using GPIO edge events from the kernel (gpiochip character device) once it isn't ready
+// after HRDY_SPINS reads, and the end of a refresh is polled with pauses growing up to DISPLAY_READY_MAX_POLL_MS
+// Set to 0 to busy wait for both like the original waveshare code
+#define EVENT_WAIT 1
+#define HRDY_GPIOCHIP "/dev/gpiochip0"
+#define HRDY_SPINS 100
+#define HRDY_TIMEOUT_MS 5000
+#define DISPLAY_READY_MAX_POLL_MS 16
+
+// Only upload and refresh the parts of the display that changed since the last frame
+// Frames are compared in tiles of PARTIAL_REFRESH_TILE x PARTIAL_REFRESH_TILE pixels (must be a multiple of 8),
+// if more than PARTIAL_REFRESH_THRESHOLD percent of them changed, the whole display is refreshed
+#define PARTIAL_REFRESH 1
+#define PARTIAL_REFRESH_TILE 32
+#define PARTIAL_REFRESH_THRESHOLD 50
+
+// Refresh frames that only have black and white pixels (always the case at 1 bpp) with the fast
+// DU / A2 waveforms instead of GC16, which takes a fraction of the time and power
+// Every WAVEFORM_CLEAR_INTERVAL refreshes, the whole frame is refreshed with GC16 to remove ghosting left
+// by the fast waveforms and partial refreshes, set to 0 to never do that
+#define FAST_WAVEFORMS 1
+#define WAVEFORM_CLEAR_INTERVAL 24
+
+// Skip frames that look the same as the one on display (black frames, credits, static shots), which saves
+// dithering, the transfer and a refresh. Frames are compared on their average grey values in blocks of
+// SCENE_BLOCK x SCENE_BLOCK pixels (a multiple of 4) before dithering. A frame is skipped if the blocks differ by less
+// than SCENE_THRESHOLD grey levels (0 - 255) on average and none by SCENE_BLOCK_THRESHOLD or more
+// 0 (the default) shows every frame, 2 is a good value to start with
+#define SCENE_THRESHOLD 0
+#define SCENE_BLOCK_THRESHOLD 12
+#define SCENE_BLOCK 32
+// Instead of waiting for the next refresh, move on to the next frame right away when a frame was skipped,
+// up to SCENE_ADVANCE frames in a row, so runs of identical frames don't leave the display unchanged for long
+// Playback gets ahead of schedule by the frames skipped this way. 0 keeps the regular pace
+#define SCENE_ADVANCE 0
+
+// Print how long every stage of a refresh took (seeking, decoding, dithering, SPI upload, display refresh, ...)
+// Send SIGUSR1 (`sudo kill -USR1 $(pidof vsmp)`) to print min / avg / p99 of every stage over the last TIMING_HISTORY refreshes
+#define TIMING_LOG 1
+#define TIMING_HISTORY 1024
+// Also append the timings to a CSV file, which is moved to [file].1 once it has TIMING_CSV_ROWS rows
+#define TIMING_CSV 0
+#define TIMING_CSV_FILE "vsmp-timing.csv"
+#define TIMING_CSV_ROWS 10000
+
+// Use RPi hardware acceleration to decode video frames (hwaccel)
 // requires custom-compiled ffmpeg and a h264 encoded video and no funky pixel format (8bpp grayscale works)
 // also requires ~128 MB graphics memory on the pi
 #define HWACCEL 0
@@ -18,7 +120,7 @@
 #define LIGHTSENSE_THRESHOLD 1000000
 #define LIGHTSENSE_GPIO_PIN RPI_V2_GPIO_P1_07
 
-/* Choose dithering algorithm, one of:
+/* Choose dithering algorithm (dither), one of:
 1. floydSteinberg             very common, slight patterns / artifacts
 2. floydSteinbergSerpentine   less artifacts than regular floyd-steinberg, more even dot-spacing
 3. interleavedGradient        somewhat similar to Bayer dithering, noticable hatching patterns
@@ -37,18 +139,49 @@ Further reading:
 */
 #define DITHER floydSteinbergSerpentine
 
+// Side of the square mask used by the blueNoise dither, a power of two. The mask is generated while building vsmp
+// (bluenoise.c), larger ones repeat less visibly on large panels but take longer to generate: about two seconds for 256
+// on a PC, four times as long for every doubling. BLUE_NOISE_OFFSET (blue-noise-offset) moves the mask to a different
+// place for every video frame, so the pattern doesn't stand still, but then flat areas change on every refresh too
+#define BLUE_NOISE_SIZE 256
+#define BLUE_NOISE_OFFSET 0
+
+// Seed of the whiteNoise dither (noise-seed). Every frame gets its own noise, which is the same every time the frame
+// is dithered with the same seed, so output can be compared between runs. 0 picks a new seed on every start
+#define NOISE_SEED 1
+
+// Number of threads used for the error diffusion dithers, set to the number of cores on a Pi Zero 2 W, Pi 3 or Pi 4
+// Rows are dithered in parallel, each one trailing a few pixels behind the one above, with identical results
+// Serpentine Floyd-Steinberg and the ordered dithers always use a single thread
+#define DITHER_THREADS 1
+
 // Automatically calculated definitions, please do not change
 
-// Colour depth conversion things
-#define BPP_MUL (256 / ((1 << BITS_PER_PIXEL) - 1))
-#define BPP_BIAS (BPP_MUL / 2)
-#define BPP_CLIP (255 - BPP_BIAS)
-
-// Transport BPP flag conversion
-#if TRANSPORT_BPP == 2
-	#define TRANSPORT_BPP_FLAG 0
-#elif TRANSPORT_BPP == 4
-	#define TRANSPORT_BPP_FLAG 2
-#else
-	#define TRANSPORT_BPP_FLAG 3
+// Colour depth conversion things, for the given bits per pixel
+#define BPP_MUL(bpp) (256 / ((1 << (bpp)) - 1))
+#define BPP_BIAS(bpp) (BPP_MUL(bpp) / 2)
+#define BPP_CLIP(bpp) (255 - BPP_BIAS(bpp))
+
+#if SPI_CLOCK_DIVIDER < 2 || SPI_CLOCK_DIVIDER > 65536 || SPI_CLOCK_DIVIDER % 2
+	#error "SPI_CLOCK_DIVIDER must be an even number from 2 to 65536"
+#endif
+
+#if SPI_CHUNK_SIZE < 2 || SPI_CHUNK_SIZE % 2
+	#error "SPI_CHUNK_SIZE must be an even number"
+#endif
+
+#if PARTIAL_REFRESH_TILE < 8 || PARTIAL_REFRESH_TILE % 8
+	#error "PARTIAL_REFRESH_TILE must be a multiple of 8"
+#endif
+
+#if BLUE_NOISE_SIZE < 16 || BLUE_NOISE_SIZE & (BLUE_NOISE_SIZE - 1)
+	#error "BLUE_NOISE_SIZE must be a power of two from 16"
+#endif
+
+#if AUTO_LEVELS_MIN_RANGE < 1 || AUTO_LEVELS_MIN_RANGE > 255
+	#error "AUTO_LEVELS_MIN_RANGE must be between 1 and 255"
+#endif
+
+#if SCENE_BLOCK < 4 || SCENE_BLOCK % 4
+	#error "SCENE_BLOCK must be a multiple of 4"
 #endif
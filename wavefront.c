@@ -0,0 +1,114 @@
+// Thread pool for wavefront-parallel error diffusion, see the error diffusion engine in dither.c
+// A job is run by ditherThreads threads at once, the calling thread being thread 0, and returns once all of them are done
+// Threads coordinate through one progress counter each, which they publish with release stores and
+// poll with acquire loads while waiting for the thread ahead of them, so no locks are taken while dithering
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define WAVEFRONT_MAX_THREADS 16
+
+static int ditherThreads = DITHER_THREADS;
+
+// Counters are padded to a cache line each, so publishing progress doesn't slow down the other threads
+typedef struct {
+  atomic_int value;
+  char padding[64 - sizeof(atomic_int)];
+} WavefrontCounter;
+
+static WavefrontCounter wavefrontProgress[WAVEFRONT_MAX_THREADS];
+
+static void (*wavefrontJob)(int thread, int threads);
+static int wavefrontThreads = 0;    // threads taking part in the current job
+static int wavefrontGeneration = 0; // incremented for every job
+static int wavefrontBusy = 0;       // worker threads still running the current job
+static int wavefrontWorkers = 0;    // worker threads started so far
+
+static pthread_mutex_t wavefrontLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wavefrontCond = PTHREAD_COND_INITIALIZER;
+
+static inline void wavefrontPublish(int thread, int value) {
+  atomic_store_explicit(&wavefrontProgress[thread].value, value, memory_order_release);
+}
+
+// Waits until the counter of thread reaches at least target and returns its value
+// Spins for a bit first, as the thread ahead is usually only a few pixels away from where it needs to be
+static inline int wavefrontWait(int thread, int target) {
+  int value, spins = 0;
+
+  while ((value = atomic_load_explicit(&wavefrontProgress[thread].value, memory_order_acquire)) < target) {
+    if (++spins > 64)
+      sched_yield();
+  }
+  return value;
+}
+
+static void *wavefrontWorker(void *arg) {
+  int thread = (int) (intptr_t) arg;
+  int generation = 0;
+
+  pthread_mutex_lock(&wavefrontLock);
+
+  while (1) {
+    while (wavefrontGeneration == generation)
+      pthread_cond_wait(&wavefrontCond, &wavefrontLock);
+
+    generation = wavefrontGeneration;
+    if (thread >= wavefrontThreads)
+      continue;
+
+    void (*job)(int, int) = wavefrontJob;
+    int threads = wavefrontThreads;
+    pthread_mutex_unlock(&wavefrontLock);
+
+    job(thread, threads);
+
+    pthread_mutex_lock(&wavefrontLock);
+    if (--wavefrontBusy == 0)
+      pthread_cond_broadcast(&wavefrontCond);
+  }
+
+  return NULL;
+}
+
+// Runs job on threads threads (including the calling one), starting worker threads as needed
+// Returns the number of threads actually used, which is less than requested if threads couldn't be started
+static int wavefrontRun(void (*job)(int thread, int threads), int threads) {
+  int t;
+
+  if (threads > WAVEFRONT_MAX_THREADS)
+    threads = WAVEFRONT_MAX_THREADS;
+
+  while (wavefrontWorkers < threads - 1) {
+    pthread_t worker;
+    if (pthread_create(&worker, NULL, wavefrontWorker, (void *) (intptr_t) (wavefrontWorkers + 1))) {
+      printf("Failed to start dithering thread, using %d\n", wavefrontWorkers + 1);
+      break;
+    }
+    pthread_detach(worker);
+    wavefrontWorkers++;
+  }
+  if (threads > wavefrontWorkers + 1)
+    threads = wavefrontWorkers + 1;
+
+  for (t = 0; t < threads; t++)
+    wavefrontPublish(t, 0);
+
+  pthread_mutex_lock(&wavefrontLock);
+  wavefrontJob = job;
+  wavefrontThreads = threads;
+  wavefrontBusy = threads - 1;
+  wavefrontGeneration++;
+  pthread_cond_broadcast(&wavefrontCond);
+  pthread_mutex_unlock(&wavefrontLock);
+
+  job(0, threads);
+
+  pthread_mutex_lock(&wavefrontLock);
+  while (wavefrontBusy > 0)
+    pthread_cond_wait(&wavefrontCond, &wavefrontLock);
+  pthread_mutex_unlock(&wavefrontLock);
+
+  return threads;
+}